@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include "arena.h"
+
+void arena_init(ARENA *A, int huge_pages) {
+    // An empty arena. Buffers are only allocated when first needed.
+    memset(A, 0, sizeof(ARENA));
+    A->huge_pages = huge_pages;
+}
+
+static void *huge_alloc(long bytes, int *mapped) {
+    // Map whole huge pages if the system has any reserved, otherwise ask
+    // for transparent huge pages.
+    void *ptr = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (ptr != MAP_FAILED) {
+        *mapped = 1;
+        return ptr;
+    }
+
+    ptr = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        *mapped = 0;
+        return malloc(bytes);
+    }
+    madvise(ptr, bytes, MADV_HUGEPAGE);
+    *mapped = 2;
+    return ptr;
+}
+
+static void scratch_release(ARENA *A, SCRATCH *S) {
+    if (S->mapped) {
+        munmap(S->ptr, S->capacity);
+        A->huge_bytes -= S->capacity;
+    } else {
+        free(S->ptr);
+    }
+    A->reserved -= S->capacity;
+    S->ptr = NULL;
+    S->capacity = 0;
+    S->mapped = 0;
+}
+
+void arena_release(ARENA *A) {
+    // Free every buffer, keeping the statistics other than reserved.
+    int slot;
+    for (slot=0; slot<SCRATCH_SLOTS; slot++) {
+        scratch_release(A, &A->scratch[slot]);
+    }
+}
+
+void *scratch_get(ARENA *A, int slot, long bytes) {
+    // A buffer of at least `bytes` for a temporary of kind `slot`, with
+    // undefined contents. Without an arena this is just malloc. Return it
+    // with scratch_put.
+    SCRATCH *S;
+
+    bytes = bytes > 0 ? bytes : 1;
+    if (A == NULL) {
+        return malloc(bytes);
+    }
+
+    S = &A->scratch[slot];
+    if (S->capacity < bytes) {
+        // Grow geometrically so slowly growing calls rarely reallocate.
+        long capacity = S->capacity*3/2 > bytes ? S->capacity*3/2 : bytes;
+        scratch_release(A, S);
+        if (A->huge_pages && (capacity >= HUGE_PAGE_SIZE)) {
+            capacity = (capacity + HUGE_PAGE_SIZE - 1)
+                       / HUGE_PAGE_SIZE*HUGE_PAGE_SIZE;
+            S->ptr = huge_alloc(capacity, &S->mapped);
+        } else {
+            S->ptr = malloc(capacity);
+        }
+        S->capacity = capacity;
+        A->reserved += capacity;
+        if (S->mapped) {
+            A->huge_bytes += capacity;
+        }
+        A->n_grows += 1;
+    }
+
+    A->in_use += bytes;
+    A->peak = A->in_use > A->peak ? A->in_use : A->peak;
+    return S->ptr;
+}
+
+void scratch_put(ARENA *A, int slot, void *ptr, long bytes) {
+    // Give back a buffer from scratch_get, which the arena keeps.
+    if (A == NULL) {
+        free(ptr);
+        return;
+    }
+    A->in_use -= bytes > 0 ? bytes : 1;
+}
+
+void huge_advise(void *ptr, long bytes) {
+    // Ask for transparent huge pages over the whole huge pages inside a
+    // large allocation, for example a search index that lives for a long
+    // time and is read at random.
+    uintptr_t start = ((uintptr_t)ptr + HUGE_PAGE_SIZE - 1)
+                      & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+    uintptr_t end = ((uintptr_t)ptr + bytes) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+    if (end > start) {
+        madvise((void *)start, end - start, MADV_HUGEPAGE);
+    }
+}
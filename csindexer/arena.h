@@ -0,0 +1,51 @@
+/* Scratch buffers that are kept and reused across indexing calls, instead
+ * of being allocated (and faulted in) on every call, optionally backed by
+ * huge pages. */
+#ifndef CSINDEXER_ARENA_H_
+#define CSINDEXER_ARENA_H_
+
+// The kinds of temporaries, each with its own buffer in an arena.
+enum {
+    SCRATCH_ROW_START,
+    SCRATCH_OFFSETS,
+    SCRATCH_COUNTS,
+    SCRATCH_BUCKET_PTR,
+    SCRATCH_BUCKET_OFFSETS,
+    SCRATCH_BUCKET_VALUES,
+    SCRATCH_SYMMETRIC_AXES,
+    SCRATCH_SYMMETRIC_PTR,
+    SCRATCH_SYMMETRIC_KEYS,
+    SCRATCH_SYMMETRIC_PERM,
+    SCRATCH_SYMMETRIC_VALUES,
+    SCRATCH_SLOTS
+};
+
+// Size of a huge page, and the smallest buffer worth backing with them.
+#define HUGE_PAGE_SIZE (2L << 20)
+
+typedef struct {
+    void *ptr;
+    long capacity;  // Bytes available at ptr
+    int mapped;     // 0 from malloc, 1 mapped with huge pages, 2 mapped
+                    // with transparent huge pages advised
+} SCRATCH;
+
+typedef struct ARENA {
+    // One buffer per kind of temporary, grown when a call needs more. An
+    // arena must only be used by one call at a time.
+    SCRATCH scratch[SCRATCH_SLOTS];
+    int huge_pages;   // Whether large buffers are backed by huge pages
+    long in_use;      // Bytes handed out to the running call
+    long peak;        // Largest in_use seen
+    long reserved;    // Bytes kept over all buffers
+    long huge_bytes;  // Bytes of reserved backed by huge pages
+    long n_grows;     // Times a buffer had to be reallocated
+} ARENA;
+
+void arena_init(ARENA *A, int huge_pages);
+void arena_release(ARENA *A);
+void *scratch_get(ARENA *A, int slot, long bytes);
+void scratch_put(ARENA *A, int slot, void *ptr, long bytes);
+void huge_advise(void *ptr, long bytes);
+
+#endif  // CSINDEXER_ARENA_H_
@@ -0,0 +1,219 @@
+#include <stdlib.h>
+#include <omp.h>
+#include "block_indexer.h"
+#include "operations.h"
+
+static inline __attribute__((always_inline))
+void process_block_row(BSR *M, int row, int *axis1, int index_pointer,
+                       int index_end, double *values, OP *op,
+                       const int type) {
+    // Merge the indexer entries index_pointer, ..., index_end - 1, which all
+    // lie in scalar `row` of M and are sorted by column, against the blocks
+    // of the block row containing it. The merge compares block columns and
+    // then walks the indexer through each matching dense block.
+    int block_row = row/M->R;
+    long block_size = (long)M->R*M->C;
+    int row_in_block = (row % M->R)*M->C;
+    int sparse_pointer = M->indptr[block_row];
+    int sparse_end = M->indptr[block_row + 1];
+    int block_col;
+    int run_end;
+    double *block;
+
+    while ((index_pointer < index_end) &&
+           (sparse_pointer < sparse_end)) {
+        block_col = axis1[index_pointer]/M->C;
+
+        if (M->indices[sparse_pointer] == block_col) {
+            // Apply every indexer entry within this block, reducing runs of
+            // the same column together.
+            block = &(M->data[sparse_pointer*block_size + row_in_block]);
+            while ((index_pointer < index_end) &&
+                   (axis1[index_pointer]/M->C == block_col)) {
+                run_end = index_pointer + 1;
+                while ((run_end < index_end) &&
+                       (axis1[run_end] == axis1[index_pointer])) {
+                    run_end += 1;
+                }
+                apply_segment(type, op, &(block[axis1[index_pointer] % M->C]),
+                              values, 1, index_pointer, run_end);
+                index_pointer = run_end;
+            }
+        } else if (M->indices[sparse_pointer] > block_col) {
+            // The block isn't stored so skip the indexer entry.
+            index_pointer += 1;
+        } else {
+            // Need to increment sparse pointer
+            sparse_pointer += 1;
+        }
+    }
+}
+
+static inline __attribute__((always_inline))
+void block_sorted_loop(BSR *M, COO *indexer, OP *op, int *row_start,
+                       int total_rows, const int type) {
+    // Each thread processes a whole scalar row of the indexer at a time. Rows
+    // sharing a block row update different rows of its blocks so threads
+    // still own the entries they update.
+    int i;
+    #pragma omp parallel for
+    for (i=0; i<total_rows; i++) {
+        process_block_row(M, indexer->row[row_start[i]], indexer->col,
+                          row_start[i], row_start[i+1], indexer->data, op,
+                          type);
+    }
+}
+
+void block_sparse_index_sorted(BSR *M, COO *indexer, OP *op, int n_threads) {
+    /*
+    Inputs:
+        M: A block compressed sparse row matrix with sorted indices.
+        index: A sparse matrix in COO form containing index into M, ordered
+               by (row, column).
+        op: The operation to apply between M->data and index->data.
+    Repeated values in the indexer are reduced together before being applied
+    so, as each row is handled by a single thread, no atomics are needed.
+    */
+    int i;
+    int prev_row = -1;
+    int total_rows = 0;
+
+    // Get where the rows start in indexer, as in
+    // compressed_sparse_index_sorted.
+    for (i=0; i<indexer->nnz; i++) {
+        if (indexer->row[i] != prev_row) {
+            total_rows += 1;
+            prev_row = indexer->row[i];
+        }
+    }
+    int *row_start = malloc((total_rows + 1)*sizeof(int));
+    prev_row = -1;
+    total_rows = 0;
+    for (i=0; i<indexer->nnz; i++) {
+        if (indexer->row[i] != prev_row) {
+            row_start[total_rows] = i;
+            total_rows += 1;
+            prev_row = indexer->row[i];
+        }
+    }
+    row_start[total_rows] = indexer->nnz;
+
+    if (n_threads != -1) {
+        omp_set_num_threads(n_threads);
+    }
+
+    // Dispatch to a loop with the operation compiled into it.
+    switch (op->type) {
+        case OP_GET:
+            block_sorted_loop(M, indexer, op, row_start, total_rows,
+                              OP_GET);
+            break;
+        case OP_SET:
+            block_sorted_loop(M, indexer, op, row_start, total_rows,
+                              OP_SET);
+            break;
+        case OP_ADD:
+            block_sorted_loop(M, indexer, op, row_start, total_rows,
+                              OP_ADD);
+            break;
+        case OP_MUL:
+            block_sorted_loop(M, indexer, op, row_start, total_rows,
+                              OP_MUL);
+            break;
+        case OP_MIN:
+            block_sorted_loop(M, indexer, op, row_start, total_rows,
+                              OP_MIN);
+            break;
+        case OP_MAX:
+            block_sorted_loop(M, indexer, op, row_start, total_rows,
+                              OP_MAX);
+            break;
+        case OP_AXPY_GET:
+            block_sorted_loop(M, indexer, op, row_start, total_rows,
+                              OP_AXPY_GET);
+            break;
+        case OP_AXPY_ADD:
+            block_sorted_loop(M, indexer, op, row_start, total_rows,
+                              OP_AXPY_ADD);
+            break;
+    }
+
+    free(row_start);
+}
+
+static inline __attribute__((always_inline))
+void block_loop(BSR *M, COO *indexer, OP *op, int search_type,
+                const int type) {
+    int index_pointer;
+    long block_size = (long)M->R*M->C;
+
+    #pragma omp parallel for schedule(dynamic) shared(M, indexer)
+    for (index_pointer=0; index_pointer<indexer->nnz; index_pointer++) {
+        // Search for the block containing the entry and then index into the
+        // dense block directly.
+        int idx;
+        int depth;
+        int start;
+        int n;
+        int row = indexer->row[index_pointer];
+        int col = indexer->col[index_pointer];
+        long offset;
+
+        start = M->indptr[row/M->R];
+        n = M->indptr[row/M->R + 1] - start;
+        idx = get_first_occurence(&M->indices[start], n, col/M->C, &depth,
+                                  search_type);
+
+        // Skip values whose block is not in M.
+        if (idx == -1) {
+            continue;
+        }
+
+        offset = (start + idx)*block_size + (row % M->R)*M->C + col % M->C;
+        apply_entry(type, op, &(M->data[offset]),
+                    &(indexer->data[index_pointer]), index_pointer);
+    }
+}
+
+void block_sparse_index(BSR *M, COO *indexer, OP *op, int search_type,
+                        int n_threads) {
+    /*
+    Inputs:
+        M: A block compressed sparse row matrix.
+        index: A sparse matrix in COO form containing index into M.
+        op: The operation to apply between M->data and index->data.
+        search_type: As for compressed_sparse_index, applied to the block
+                     columns so each search covers R*C values.
+    */
+    if (n_threads != -1) {
+        omp_set_num_threads(n_threads);
+    }
+
+    // Dispatch to a loop with the operation compiled into it.
+    switch (op->type) {
+        case OP_GET:
+            block_loop(M, indexer, op, search_type, OP_GET);
+            break;
+        case OP_SET:
+            block_loop(M, indexer, op, search_type, OP_SET);
+            break;
+        case OP_ADD:
+            block_loop(M, indexer, op, search_type, OP_ADD);
+            break;
+        case OP_MUL:
+            block_loop(M, indexer, op, search_type, OP_MUL);
+            break;
+        case OP_MIN:
+            block_loop(M, indexer, op, search_type, OP_MIN);
+            break;
+        case OP_MAX:
+            block_loop(M, indexer, op, search_type, OP_MAX);
+            break;
+        case OP_AXPY_GET:
+            block_loop(M, indexer, op, search_type, OP_AXPY_GET);
+            break;
+        case OP_AXPY_ADD:
+            block_loop(M, indexer, op, search_type, OP_AXPY_ADD);
+            break;
+    }
+}
@@ -0,0 +1,20 @@
+#ifndef CSINDEXER_BLOCK_INDEXER_H_
+#define CSINDEXER_BLOCK_INDEXER_H_
+
+#include "indexer_c.h"
+
+typedef struct {
+    // A block compressed sparse row (BSR) matrix made of dense R x C blocks
+    int *indptr;   // Where each block row starts in indices
+    int *indices;  // The block column of each stored block
+    double *data;  // The stored blocks, each R*C values in row major order
+    int n_indptr;  // Length of indptr vector
+    int R;         // Rows in each block
+    int C;         // Columns in each block
+} BSR;
+
+void block_sparse_index_sorted(BSR *M, COO *indexer, OP *op, int n_threads);
+void block_sparse_index(BSR *M, COO *indexer, OP *op, int search_type,
+                        int n_threads);
+
+#endif  // CSINDEXER_BLOCK_INDEXER_H_
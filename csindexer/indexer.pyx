@@ -1,5 +1,15 @@
 import numpy as np
+import scipy as sp
+import scipy.sparse
+import asyncio
+import functools
+import os
+import queue
+import threading
+import warnings
+from concurrent.futures import Future, ThreadPoolExecutor
 cimport numpy as np
+from libc.stdlib cimport malloc, free
 from contexttimer import Timer
 
 cdef extern from 'indexer_c.h':
@@ -9,6 +19,11 @@ cdef extern from 'indexer_c.h':
         int *indices
         double *data
         int n_indptr
+        void *learned
+        void *cache
+        void *filter
+        void *arena
+        int symmetric
 
     ctypedef struct COO:
         int *row
@@ -16,14 +31,254 @@ cdef extern from 'indexer_c.h':
         double *data
         int nnz
 
-    void compressed_sparse_index_sorted(CS *M, COO *indexer, void (*f)(double *, double *),
-                                 int n_threads);
-    void compressed_sparse_index(CS *M, COO *indexer, 
-                                 void (*f)(double *, double *),
-                                 int search_type, int n_threads);
+    enum:
+        OP_GET
+        OP_SET
+        OP_ADD
+        OP_MUL
+        OP_MIN
+        OP_MAX
+        OP_AXPY_GET
+        OP_AXPY_ADD
+
+    ctypedef struct OP:
+        int type
+        double alpha
+        double beta
+        double *weights
+
+    ctypedef struct VALUES:
+        double **data
+        int n_data
+        int stride
+
+    void compressed_sparse_index_sorted(CS *M, COO *indexer, OP *op,
+                                        int n_threads)
+    void compressed_sparse_index(CS *M, COO *indexer, OP *op,
+                                 int search_type, int n_threads)
+    void compressed_sparse_index_sorted_multi(CS *M, VALUES *M_values,
+                                              COO *indexer, VALUES *values,
+                                              OP *op, int n_threads)
+    void compressed_sparse_index_multi(CS *M, VALUES *M_values, COO *indexer,
+                                       VALUES *values, OP *op,
+                                       int search_type, int n_threads)
+    void compressed_sparse_index_pattern(CS *M, CS *P, OP *op, int n_threads)
+    void compressed_sparse_index_batched(CS *M, int n_matrices,
+                                         COO *indexer, int *matrix, OP *op,
+                                         int search_type, int n_threads)
+    void compressed_sparse_locate(CS *M, COO *indexer, long *offsets,
+                                  int search_type, int n_threads) nogil
+
+cdef extern from 'block_indexer.h':
+    ctypedef struct BSR:
+        int *indptr
+        int *indices
+        double *data
+        int n_indptr
+        int R
+        int C
+
+    void block_sparse_index_sorted(BSR *M, COO *indexer, OP *op,
+                                   int n_threads)
+    void block_sparse_index(BSR *M, COO *indexer, OP *op, int search_type,
+                            int n_threads)
+
+cdef extern from 'mutable.h':
+    ctypedef struct MCS:
+        CS base
+        long n_delta
+        long threshold
+
+    void mutable_init(MCS *A, CS *M, long threshold)
+    void mutable_free(MCS *A)
+    long mutable_insert(MCS *A, COO *entries, int n_threads)
+    void mutable_index(MCS *A, COO *indexer, OP *op, int search_type,
+                       int n_threads)
+    void mutable_compact(MCS *A, int n_threads)
+
+cdef extern from 'learned_index.h':
+    ctypedef struct LEARNED:
+        int n_indptr
+        int *row_segment
+
+    void learned_build(LEARNED *L, CS *M, int error, int min_length,
+                       int n_threads)
+    void learned_free(LEARNED *L)
+    long learned_nbytes(LEARNED *L)
+
+cdef extern from 'lookup_cache.h':
+    enum:
+        CACHE_WAYS
+
+    ctypedef struct CACHE:
+        long n_sets
+        long hits
+        long misses
+
+    void cache_init(CACHE *C, long capacity)
+    void cache_free(CACHE *C)
+    void cache_clear(CACHE *C)
+    long cache_nbytes(CACHE *C)
+
+cdef extern from 'row_filter.h':
+    ctypedef struct FILTER:
+        int n_indptr
+        int n_hashes
+
+    void filter_build(FILTER *F, CS *M, int bits_per_entry, int n_threads)
+    void filter_free(FILTER *F)
+    long filter_nbytes(FILTER *F)
+
+cdef extern from 'scatter_add.h':
+    void scatter_add_set_simd(int enabled)
+    int scatter_add_simd()
+
+cdef extern from 'snapshot.h' nogil:
+    ctypedef struct SNAPSHOT:
+        CS base
+        long nnz
+        long epoch
+        long n_pages
+        long n_retired
+
+    void snapshot_init(SNAPSHOT *S, CS *M, int page_shift)
+    void snapshot_free(SNAPSHOT *S)
+    void snapshot_index(SNAPSHOT *S, COO *indexer, OP *op, int search_type,
+                        int n_threads)
+    void snapshot_read(SNAPSHOT *S, double *out)
+
+cdef extern from 'arena.h':
+    ctypedef struct ARENA:
+        int huge_pages
+        long in_use
+        long peak
+        long reserved
+        long huge_bytes
+        long n_grows
+
+    void arena_init(ARENA *A, int huge_pages)
+    void arena_release(ARENA *A)
+
+cdef extern from 'pipeline.h' nogil:
+    void compressed_sparse_apply_located(CS *M, long *offsets,
+                                         double *values, OP *op, int n,
+                                         int n_threads)
+
+cdef extern from 'packed_indices.h':
+    ctypedef struct PACKED:
+        int n_indptr
+
+    void packed_set_simd(int enabled)
+    int packed_simd()
+    void packed_build(PACKED *P, CS *M, int n_threads)
+    void packed_free(PACKED *P)
+    long packed_nbytes(PACKED *P)
+    void packed_sparse_index(CS *M, PACKED *P, COO *indexer, OP *op,
+                             int n_threads)
+    void packed_sparse_index_sorted(CS *M, PACKED *P, COO *indexer, OP *op,
+                                    int n_threads)
+
+cdef extern from 'sidecar.h':
+    enum:
+        SIDECAR_OK
+        SIDECAR_IO_ERROR
+        SIDECAR_BAD_FORMAT
+        SIDECAR_WRONG_MATRIX
+        SIDECAR_BAD_CHECKSUM
+
+    ctypedef struct MAPPED:
+        void *addr
+        long length
+
+    int sidecar_save_learned(LEARNED *L, CS *M, const char *path)
+    int sidecar_load_learned(LEARNED *L, CS *M, const char *path, int error,
+                             int min_length, int verify, MAPPED *map)
+    int sidecar_save_filter(FILTER *F, CS *M, int bits_per_entry,
+                            const char *path)
+    int sidecar_load_filter(FILTER *F, CS *M, const char *path,
+                            int bits_per_entry, int verify, MAPPED *map)
+    int sidecar_save_packed(PACKED *P, CS *M, const char *path)
+    int sidecar_load_packed(PACKED *P, CS *M, const char *path, int verify,
+                            MAPPED *map)
+    void sidecar_unmap(MAPPED *map)
+
+SIDECAR_ERRORS = {SIDECAR_IO_ERROR: 'could not be read or written',
+                  SIDECAR_BAD_FORMAT: 'is not a sidecar of this version',
+                  SIDECAR_WRONG_MATRIX: 'was built from another matrix',
+                  SIDECAR_BAD_CHECKSUM: 'is corrupt'}
+
+OPERATIONS = {'get': OP_GET,
+              'set': OP_SET,
+              'add': OP_ADD,
+              'multiply': OP_MUL,
+              'min': OP_MIN,
+              'max': OP_MAX,
+              'axpy_get': OP_AXPY_GET,
+              'axpy_add': OP_AXPY_ADD}
+
+cdef extern from 'range_query.h':
+    ctypedef struct WINDOWS:
+        int *r0
+        int *r1
+        int *c0
+        int *c1
+        int n
+
+    void compressed_sparse_range_count(CS *M, WINDOWS *windows, int *count,
+                                       int n_threads)
+    void compressed_sparse_range_sum(CS *M, WINDOWS *windows, double *sum,
+                                     int n_threads)
+    void compressed_sparse_range_extract(CS *M, WINDOWS *windows, int *row,
+                                         int *col, double *data,
+                                         int n_threads)
+
+SEARCH_TYPES = {'binary': 0,
+                'interpolation': 1,
+                'joint': 2,
+                'learned': 3,
+                'sorted': -1}
+
+
+def set_simd(enabled):
+    """Whether the unsorted add and axpy_add may use the AVX-512 kernel, and
+    PackedIndices the AVX2 decode. Each is only used if the CPU supports it,
+    otherwise a scalar kernel is."""
+    scatter_add_set_simd(1 if enabled else 0)
+    packed_set_simd(1 if enabled else 0)
+
+
+def simd_enabled():
+    """Whether the unsorted add and axpy_add use the AVX-512 kernel."""
+    return bool(scatter_add_simd())
+
+
+cdef int build_values(values, np.int32_t size, VALUES *out) except -1:
+    """Fill out with a C view of values, which is either a list of 1d arrays
+    or a 2d array with one column per value array. Each array must have size
+    entries. The caller must free out.data and keep values alive."""
+    cdef np.float64_t[::1] array_view
+    cdef np.float64_t[:, ::1] block_view
+    cdef int j
+
+    if isinstance(values, np.ndarray) and values.ndim == 2:
+        block_view = values
+        assert(block_view.shape[0] == size)
+        out.n_data = block_view.shape[1]
+        out.stride = block_view.shape[1]
+        out.data = <double **> malloc(out.n_data*sizeof(double *))
+        for j in range(out.n_data):
+            out.data[j] = <double *> &(block_view[0, j])
+    else:
+        out.n_data = len(values)
+        out.stride = 1
+        out.data = <double **> malloc(out.n_data*sizeof(double *))
+        for j in range(out.n_data):
+            array_view = values[j]
+            assert(array_view.size == size)
+            out.data[j] = <double *> &(array_view[0])
+
+    return 0
 
-    void get(double *x, double *y);
-    void add(double *x, double *y);
 
 def apply(M,
           np.int32_t[:] row_vector,
@@ -32,8 +287,16 @@ def apply(M,
           operation,
           search_type,
           n_threads,
-          debug):
-    """Gets M[row_vector, col_vector].
+          debug,
+          alpha=1.0,
+          beta=0.0,
+          weights=None,
+          learned_index=None,
+          cache=None,
+          row_filter=None,
+          arena=None,
+          symmetric=None):
+    """Applies operation between M[row_vector, col_vector] and data_vector.
     If M is a CSR matrix, then 
         indices = [row_vector, col_vector]
     must be ordered by precedence (row, column). Technically the 
@@ -51,29 +314,73 @@ def apply(M,
     The variable search_type can be
         binary: Binary search.
         interpolation: Interpolation search.
+        joint: Alternating interpolation and binary search.
+        learned: The models of learned_index (a LearnedIndex of M) predict
+                 the position which is then searched within the error bound.
+                 Build learned_index once per matrix, it must be given.
+        sorted: A merge against M, assuming the indices are ordered as above.
+
+    The variable operation can be (with x = M[row, col] and y = data)
+        get: y = x
+        set: x = y
+        add: x += y
+        multiply: x *= y
+        min: x = min(x, y)
+        max: x = max(x, y)
+        axpy_get: y = alpha*x + beta*y
+        axpy_add: x += alpha*y
+    where alpha is replaced per entry by weights if they are given. Entries
+    that are not stored in M are skipped.
+
+    If cache (a LookupCache) is given, every search except sorted first
+    looks for the entry in the cache and remembers where it found it. This
+    is worth it when a few entries make up most of the indexer across calls.
+
+    If row_filter (a RowFilter of M) is given, every search except sorted
+    first checks the filter so most entries that are not stored in M are
+    skipped without searching.
+
+    If arena (a ScratchArena) is given, the temporaries of the sorted search
+    and of unsorted adds are kept in it between calls rather than allocated
+    every time.
+
+    If symmetric is 'upper' (or 'lower'), M is the upper (or lower) triangle
+    of a symmetric matrix, for example sp.sparse.triu(A, format='csr'), and
+    M[i, j] and M[j, i] both refer to the single stored entry. The sorted
+    search takes the indices ordered as usual and sorts them again after
+    mapping them to the stored triangle.
+
+    M can also be a BSR matrix, in which case the indices must be ordered as
+    for CSR and the searches are over blocks (see apply_block). The
+    learned_index, cache, row_filter, arena and symmetric options are not
+    supported for BSR matrices.
         """
+    if M.getformat() == 'bsr':
+        if not (learned_index is None and cache is None and
+                row_filter is None and arena is None and symmetric is None):
+            raise Exception('learned_index, cache, row_filter, arena and '
+                            'symmetric are not supported for BSR matrices')
+        return apply_block(M, row_vector, col_vector, data_vector, operation,
+                           search_type, n_threads, debug, alpha, beta,
+                           weights)
+
     cdef np.int32_t N = row_vector.size
     cdef CS M_CS
     cdef np.int32_t[:] indptr  = M.indptr
     cdef np.int32_t[:] indices = M.indices
     cdef np.float64_t[:] data  = M.data
     cdef COO indexer
+    cdef OP op
+    cdef np.float64_t[::1] weights_view
     cdef np.int32_t search_type_int
 
     with Timer() as t:
         assert(row_vector.size == col_vector.size)
         assert(row_vector.size == data_vector.size)
 
-        if search_type == 'binary':
-            search_type_int = 0
-        elif search_type == 'interpolation':
-            search_type_int = 1
-        elif search_type == 'joint':
-            search_type_int = 2
-        elif search_type == 'sorted':
-            search_type_int = -1
-        else:
+        if search_type not in SEARCH_TYPES:
             raise Exception("Unrecognised search_type: %s" % search_type)
+        search_type_int = SEARCH_TYPES[search_type]
 
 
         # Build the CS and COO structures
@@ -90,24 +397,1804 @@ def apply(M,
         M_CS.indptr  = <int *> &(indptr[0])
         M_CS.indices = <int *> &(indices[0])
         M_CS.data    = <double *> &(data[0])
+        M_CS.learned = NULL
+        M_CS.cache = NULL
+        M_CS.filter = NULL
+        M_CS.arena = NULL
+        M_CS.symmetric = symmetric_mode(M, symmetric)
+        if search_type == 'learned':
+            if learned_index is None:
+                raise Exception('The learned search needs a learned_index')
+            M_CS.learned = learned_model(learned_index, M)
+        if cache is not None:
+            M_CS.cache = &(<LookupCache?> cache).C
+        if row_filter is not None:
+            M_CS.filter = filter_model(row_filter, M)
+        if arena is not None:
+            M_CS.arena = &(<ScratchArena?> arena).A
 
         indexer.row = <int *> &(row_vector[0]) 
         indexer.col = <int *> &(col_vector[0]) 
         indexer.data = <double *> &(data_vector[0])
         indexer.nnz = N
 
-        # Run our function with the get or add method
-        if operation == 'get':
-            if search_type_int == -1:
-                compressed_sparse_index_sorted(&M_CS, &indexer, get, n_threads)
-            else:
-                compressed_sparse_index(&M_CS, &indexer, get, search_type_int,
-                                        n_threads)
-        if operation == 'add':
+        # Build the operation
+        if operation not in OPERATIONS:
+            raise Exception("Unrecognised operation: %s" % operation)
+        op.type = OPERATIONS[operation]
+        op.alpha = alpha
+        op.beta = beta
+        op.weights = NULL
+        if weights is not None:
+            weights_view = weights
+            assert(weights_view.size == N)
+            op.weights = <double *> &(weights_view[0])
+
+        # Run our function with the operation
+        if search_type_int == -1:
+            compressed_sparse_index_sorted(&M_CS, &indexer, &op, n_threads)
+        else:
+            compressed_sparse_index(&M_CS, &indexer, &op, search_type_int,
+                                    n_threads)
+    if debug:
+        print("\tCython internal time: %s" % t.elapsed)
+
+
+def apply_block(M,
+                np.int32_t[:] row_vector,
+                np.int32_t[:] col_vector,
+                np.float64_t[:] data_vector,
+                operation,
+                search_type,
+                n_threads,
+                debug,
+                alpha=1.0,
+                beta=0.0,
+                weights=None):
+    """Applies operation between M[row_vector, col_vector] and data_vector
+    for a BSR matrix M. Each search finds the R x C block containing an entry
+    and the entry is then indexed directly within the dense block, so only
+    one index is stored and searched per block rather than per value. For
+    the sorted search_type the indices must be ordered by (row, column) and
+    M must have sorted indices.
+
+    The variables search_type, operation, alpha, beta and weights are as for
+    apply, except that there is no learned search over blocks.
+        """
+    cdef np.int32_t N = row_vector.size
+    cdef BSR M_BSR
+    cdef np.int32_t[:] indptr  = M.indptr
+    cdef np.int32_t[:] indices = M.indices
+    cdef np.float64_t[:, :, ::1] data = M.data
+    cdef COO indexer
+    cdef OP op
+    cdef np.float64_t[::1] weights_view
+    cdef np.int32_t search_type_int
+
+    with Timer() as t:
+        assert(row_vector.size == col_vector.size)
+        assert(row_vector.size == data_vector.size)
+
+        if search_type not in SEARCH_TYPES or search_type == 'learned':
+            raise Exception("Unrecognised search_type: %s" % search_type)
+        search_type_int = SEARCH_TYPES[search_type]
+        if search_type_int == -1 and not M.has_sorted_indices:
+            raise Exception('M must have sorted indices for the sorted search')
+
+        # Build the BSR and COO structures
+        M_BSR.R, M_BSR.C = M.blocksize
+        M_BSR.n_indptr = M.shape[0]//M_BSR.R + 1
+        M_BSR.indptr  = <int *> &(indptr[0])
+        M_BSR.indices = <int *> &(indices[0])
+        M_BSR.data    = <double *> &(data[0, 0, 0])
+
+        indexer.row = <int *> &(row_vector[0])
+        indexer.col = <int *> &(col_vector[0])
+        indexer.data = <double *> &(data_vector[0])
+        indexer.nnz = N
+
+        # Build the operation
+        if operation not in OPERATIONS:
+            raise Exception("Unrecognised operation: %s" % operation)
+        op.type = OPERATIONS[operation]
+        op.alpha = alpha
+        op.beta = beta
+        op.weights = NULL
+        if weights is not None:
+            weights_view = weights
+            assert(weights_view.size == N)
+            op.weights = <double *> &(weights_view[0])
+
+        # Run our function with the operation
+        if search_type_int == -1:
+            block_sparse_index_sorted(&M_BSR, &indexer, &op, n_threads)
+        else:
+            block_sparse_index(&M_BSR, &indexer, &op, search_type_int,
+                               n_threads)
+
+    if debug:
+        print("\tCython internal time: %s" % t.elapsed)
+
+
+def apply_multi(M,
+                M_values,
+                np.int32_t[:] row_vector,
+                np.int32_t[:] col_vector,
+                values,
+                operation,
+                search_type,
+                n_threads,
+                debug,
+                alpha=1.0,
+                beta=0.0,
+                weights=None,
+                learned_index=None,
+                cache=None,
+                row_filter=None,
+                arena=None,
+                symmetric=None):
+    """Applies operation between M_values[j][row_vector, col_vector] and
+    values[j] for every j at once, searching for each index only once. This
+    is for several matrices that share the sparsity pattern of M, for
+    example weights and their optimiser moments.
+
+    M_values is either a list of data arrays (each like M.data) or a 2d
+    C-contiguous array of shape (M.nnz, k). values is then either a list of k
+    arrays or a 2d C-contiguous array of shape (row_vector.size, k). Storing
+    the k values of an entry next to each other (the 2d form) is the most
+    cache friendly.
+
+    The ordering of the indices and the variables search_type, operation,
+    alpha, beta, weights, learned_index, cache, row_filter, arena and
+    symmetric are as for apply.
+        """
+    cdef np.int32_t N = row_vector.size
+    cdef CS M_CS
+    cdef np.int32_t[:] indptr  = M.indptr
+    cdef np.int32_t[:] indices = M.indices
+    cdef COO indexer
+    cdef VALUES M_values_c
+    cdef VALUES values_c
+    cdef OP op
+    cdef np.float64_t[::1] weights_view
+    cdef np.int32_t search_type_int
+
+    M_values_c.data = NULL
+    values_c.data = NULL
+    with Timer() as t:
+        assert(row_vector.size == col_vector.size)
+
+        if search_type not in SEARCH_TYPES:
+            raise Exception("Unrecognised search_type: %s" % search_type)
+        search_type_int = SEARCH_TYPES[search_type]
+
+        # Build the CS and COO structures
+        if M.getformat() == 'csr':
+            M_CS.CSR = 1
+            M_CS.n_indptr = M.shape[0] + 1
+        elif M.getformat() == 'csc':
+            M_CS.CSR = 0
+            M_CS.n_indptr = M.shape[1] + 1
+        else:
+            raise Exception('Sparse format %s not csr or csc' % M.getformat())
+
+        M_CS.indptr  = <int *> &(indptr[0])
+        M_CS.indices = <int *> &(indices[0])
+        M_CS.data    = NULL
+        M_CS.learned = NULL
+        M_CS.cache = NULL
+        M_CS.filter = NULL
+        M_CS.arena = NULL
+        M_CS.symmetric = symmetric_mode(M, symmetric)
+        if search_type == 'learned':
+            if learned_index is None:
+                raise Exception('The learned search needs a learned_index')
+            M_CS.learned = learned_model(learned_index, M)
+        if cache is not None:
+            M_CS.cache = &(<LookupCache?> cache).C
+        if row_filter is not None:
+            M_CS.filter = filter_model(row_filter, M)
+        if arena is not None:
+            M_CS.arena = &(<ScratchArena?> arena).A
+
+        indexer.row = <int *> &(row_vector[0])
+        indexer.col = <int *> &(col_vector[0])
+        indexer.data = NULL
+        indexer.nnz = N
+
+        # Build the operation
+        if operation not in OPERATIONS:
+            raise Exception("Unrecognised operation: %s" % operation)
+        op.type = OPERATIONS[operation]
+        op.alpha = alpha
+        op.beta = beta
+        op.weights = NULL
+        if weights is not None:
+            weights_view = weights
+            assert(weights_view.size == N)
+            op.weights = <double *> &(weights_view[0])
+
+        try:
+            build_values(M_values, M.nnz, &M_values_c)
+            build_values(values, N, &values_c)
+            assert(M_values_c.n_data == values_c.n_data)
+
             if search_type_int == -1:
-                compressed_sparse_index_sorted(&M_CS, &indexer, add, n_threads)
+                compressed_sparse_index_sorted_multi(&M_CS, &M_values_c,
+                                                     &indexer, &values_c,
+                                                     &op, n_threads)
             else:
-                compressed_sparse_index(&M_CS, &indexer, add, search_type_int,
-                                        n_threads)
+                compressed_sparse_index_multi(&M_CS, &M_values_c, &indexer,
+                                              &values_c, &op,
+                                              search_type_int, n_threads)
+        finally:
+            free(M_values_c.data)
+            free(values_c.data)
+
+    if debug:
+        print("\tCython internal time: %s" % t.elapsed)
+
+
+def apply_pattern(M,
+                  P,
+                  operation,
+                  n_threads,
+                  debug,
+                  alpha=1.0,
+                  beta=0.0,
+                  weights=None):
+    """Applies operation between M and the entries of P, a sparse matrix of
+    the same shape and format as M (e.g. a mask or sampled edges), without
+    converting P to COO. Each row (column for CSC) of P is merged against the
+    same row of M in parallel, so both must have sorted indices.
+
+    With x = M[i, j] and y = P[i, j] for every stored entry of P, operation
+    is as for apply, so for example
+        get: Gathers the values of M onto the pattern of P (into P.data).
+        add: Scatter-adds the values of P into M.
+    Entries of P not stored in M are left untouched, so zero P.data first
+    when gathering. If given, weights are indexed like P.data.
+        """
+    cdef CS M_CS
+    cdef CS P_CS
+    cdef np.int32_t[:] indptr  = M.indptr
+    cdef np.int32_t[:] indices = M.indices
+    cdef np.float64_t[:] data  = M.data
+    cdef np.int32_t[:] P_indptr  = P.indptr
+    cdef np.int32_t[:] P_indices = P.indices
+    cdef np.float64_t[:] P_data  = P.data
+    cdef OP op
+    cdef np.float64_t[::1] weights_view
+
+    with Timer() as t:
+        if M.getformat() != P.getformat():
+            raise Exception('M and P must have the same format')
+        if M.shape != P.shape:
+            raise Exception('M and P must have the same shape')
+        if not (M.has_sorted_indices and P.has_sorted_indices):
+            raise Exception('M and P must have sorted indices')
+
+        # Build the CS structures
+        if M.getformat() == 'csr':
+            M_CS.CSR = 1
+            M_CS.n_indptr = M.shape[0] + 1
+        elif M.getformat() == 'csc':
+            M_CS.CSR = 0
+            M_CS.n_indptr = M.shape[1] + 1
+        else:
+            raise Exception('Sparse format %s not csr or csc' % M.getformat())
+        P_CS.CSR = M_CS.CSR
+        P_CS.n_indptr = M_CS.n_indptr
+
+        # Build the operation
+        if operation not in OPERATIONS:
+            raise Exception("Unrecognised operation: %s" % operation)
+        op.type = OPERATIONS[operation]
+        op.alpha = alpha
+        op.beta = beta
+        op.weights = NULL
+        if weights is not None:
+            weights_view = weights
+            assert(weights_view.size == P.nnz)
+            op.weights = <double *> &(weights_view[0])
+
+        if M.nnz > 0 and P.nnz > 0:
+            M_CS.indptr  = <int *> &(indptr[0])
+            M_CS.indices = <int *> &(indices[0])
+            M_CS.data    = <double *> &(data[0])
+            M_CS.learned = NULL
+            M_CS.cache = NULL
+            M_CS.filter = NULL
+            M_CS.arena = NULL
+            M_CS.symmetric = 0
+            P_CS.indptr  = <int *> &(P_indptr[0])
+            P_CS.indices = <int *> &(P_indices[0])
+            P_CS.data    = <double *> &(P_data[0])
+            P_CS.learned = NULL
+            P_CS.cache = NULL
+            P_CS.filter = NULL
+            P_CS.arena = NULL
+            P_CS.symmetric = 0
+
+            compressed_sparse_index_pattern(&M_CS, &P_CS, &op, n_threads)
+
+    if debug:
+        print("\tCython internal time: %s" % t.elapsed)
+
+
+def apply_batched(matrices,
+                  np.int32_t[:] matrix_vector,
+                  np.int32_t[:] row_vector,
+                  np.int32_t[:] col_vector,
+                  np.float64_t[:] data_vector,
+                  operation,
+                  search_type,
+                  n_threads,
+                  debug,
+                  alpha=1.0,
+                  beta=0.0,
+                  weights=None):
+    """Applies operation between matrices[matrix_vector[i]][row_vector[i],
+    col_vector[i]] and data_vector[i] for every i in a single call, where
+    matrices is a MatrixBatch (or a list of CSR and CSC matrices). All the
+    entries are spread over the threads at once, so this is much faster than
+    calling apply for each of many small matrices.
+
+    operation and search_type are as for apply, except that learned is not
+    supported. For sorted, the indices must be ordered by matrix and then as
+    for apply within each matrix. Entries of matrices that do not exist, or
+    that lie outside their matrix, are skipped.
+        """
+    cdef MatrixBatch batch
+    cdef np.int32_t N = row_vector.size
+    cdef COO indexer
+    cdef OP op
+    cdef np.float64_t[::1] weights_view
+    cdef np.int32_t search_type_int
+
+    with Timer() as t:
+        if not isinstance(matrices, MatrixBatch):
+            matrices = MatrixBatch(matrices)
+        batch = matrices
+
+        assert(matrix_vector.size == N)
+        assert(col_vector.size == N)
+        assert(data_vector.size == N)
+
+        if search_type not in SEARCH_TYPES or search_type == 'learned':
+            raise Exception("Unrecognised search_type: %s" % search_type)
+        search_type_int = SEARCH_TYPES[search_type]
+
+        # Build the operation
+        if operation not in OPERATIONS:
+            raise Exception("Unrecognised operation: %s" % operation)
+        op.type = OPERATIONS[operation]
+        op.alpha = alpha
+        op.beta = beta
+        op.weights = NULL
+        if weights is not None:
+            weights_view = weights
+            assert(weights_view.size == N)
+            op.weights = <double *> &(weights_view[0])
+
+        if N > 0:
+            indexer.row = <int *> &(row_vector[0])
+            indexer.col = <int *> &(col_vector[0])
+            indexer.data = <double *> &(data_vector[0])
+            indexer.nnz = N
+            compressed_sparse_index_batched(batch.M, batch.n_matrices,
+                                            &indexer,
+                                            <int *> &(matrix_vector[0]), &op,
+                                            search_type_int, n_threads)
     if debug:
         print("\tCython internal time: %s" % t.elapsed)
+
+
+def range_query(M,
+                r0,
+                r1,
+                c0,
+                c1,
+                operation,
+                n_threads,
+                debug):
+    """Aggregates M over the rectangular windows
+        M[r0[k]:r1[k], c0[k]:c1[k]]
+    for every k at once, without building a submatrix per window. Windows are
+    clipped to the shape of M and M must have sorted indices.
+
+    The variable operation can be
+        count: Returns the total stored entries in each window.
+        sum: Returns the sum of the stored entries in each window.
+        extract: Returns (window_ptr, row, col, data) where the stored
+                 entries of window k are row[window_ptr[k]:window_ptr[k+1]]
+                 etc. Entries are ordered by (row, column) within a window if
+                 M is CSR and by (column, row) if M is CSC.
+        """
+    cdef CS M_CS
+    cdef np.int32_t[:] indptr  = M.indptr
+    cdef np.int32_t[:] indices = M.indices
+    cdef np.float64_t[:] data  = M.data
+    cdef np.int32_t[:] r0_view
+    cdef np.int32_t[:] r1_view
+    cdef np.int32_t[:] c0_view
+    cdef np.int32_t[:] c1_view
+    cdef np.int32_t[:] count_view
+    cdef np.float64_t[:] sum_view
+    cdef np.int32_t[:] row_view
+    cdef np.int32_t[:] col_view
+    cdef np.float64_t[:] data_view
+    cdef WINDOWS windows
+
+    with Timer() as t:
+        assert(len(r0) == len(r1) == len(c0) == len(c1))
+
+        # Build the CS structure
+        if M.getformat() == 'csr':
+            M_CS.CSR = 1
+            M_CS.n_indptr = M.shape[0] + 1
+        elif M.getformat() == 'csc':
+            M_CS.CSR = 0
+            M_CS.n_indptr = M.shape[1] + 1
+        else:
+            raise Exception('Sparse format %s not csr or csc' % M.getformat())
+
+        if not M.has_sorted_indices:
+            raise Exception('M must have sorted indices for range queries')
+
+        # Clip the windows to M so the search never leaves its rows.
+        r0_arr = np.clip(r0, 0, M.shape[0]).astype(np.int32)
+        r1_arr = np.clip(r1, 0, M.shape[0]).astype(np.int32)
+        c0_arr = np.clip(c0, 0, M.shape[1]).astype(np.int32)
+        c1_arr = np.clip(c1, 0, M.shape[1]).astype(np.int32)
+        windows.n = r0_arr.size
+
+        count = np.zeros(windows.n, dtype=np.int32)
+        if windows.n > 0 and M.nnz > 0:
+            r0_view = r0_arr
+            r1_view = r1_arr
+            c0_view = c0_arr
+            c1_view = c1_arr
+            windows.r0 = <int *> &(r0_view[0])
+            windows.r1 = <int *> &(r1_view[0])
+            windows.c0 = <int *> &(c0_view[0])
+            windows.c1 = <int *> &(c1_view[0])
+
+            M_CS.indptr  = <int *> &(indptr[0])
+            M_CS.indices = <int *> &(indices[0])
+            M_CS.data    = <double *> &(data[0])
+            M_CS.learned = NULL
+            M_CS.cache = NULL
+            M_CS.filter = NULL
+            M_CS.arena = NULL
+            M_CS.symmetric = 0
+
+        if operation == 'count':
+            if windows.n > 0 and M.nnz > 0:
+                count_view = count
+                compressed_sparse_range_count(&M_CS, &windows,
+                                              <int *> &(count_view[0]),
+                                              n_threads)
+            out = count
+        elif operation == 'sum':
+            out = np.zeros(windows.n, dtype=np.float64)
+            if windows.n > 0 and M.nnz > 0:
+                sum_view = out
+                compressed_sparse_range_sum(&M_CS, &windows,
+                                            <double *> &(sum_view[0]),
+                                            n_threads)
+        elif operation == 'extract':
+            if windows.n > 0 and M.nnz > 0:
+                count_view = count
+                compressed_sparse_range_count(&M_CS, &windows,
+                                              <int *> &(count_view[0]),
+                                              n_threads)
+            window_ptr = np.zeros(windows.n + 1, dtype=np.int64)
+            np.cumsum(count, out=window_ptr[1:])
+
+            row_out = np.empty(window_ptr[-1], dtype=np.int32)
+            col_out = np.empty(window_ptr[-1], dtype=np.int32)
+            data_out = np.empty(window_ptr[-1], dtype=np.float64)
+            if window_ptr[-1] > 0:
+                row_view = row_out
+                col_view = col_out
+                data_view = data_out
+                compressed_sparse_range_extract(&M_CS, &windows,
+                                                <int *> &(row_view[0]),
+                                                <int *> &(col_view[0]),
+                                                <double *> &(data_view[0]),
+                                                n_threads)
+            out = (window_ptr, row_out, col_out, data_out)
+        else:
+            raise Exception("Unrecognised operation: %s" % operation)
+
+    if debug:
+        print("\tCython internal time: %s" % t.elapsed)
+
+    return out
+
+
+def contains(M,
+             row_vector,
+             col_vector,
+             search_type='binary',
+             n_threads=-1,
+             return_offsets=False,
+             learned_index=None,
+             cache=None,
+             row_filter=None,
+             symmetric=None):
+    """Returns a boolean mask of which entries (row_vector[i], col_vector[i])
+    are stored in M, a CSR or CSC matrix. The entries can be in any order and
+    may lie outside M. If return_offsets is True the positions in M.data are
+    returned as well, with -1 for the entries that are not stored.
+
+    The search_type can be any of those for apply except sorted, and
+    learned_index, cache, row_filter and symmetric are as for apply. When
+    most entries are not stored, a RowFilter rejects nearly all of them
+    without searching.
+        """
+    cdef CS M_CS
+    cdef np.int32_t[:] indptr = M.indptr
+    cdef np.int32_t[:] indices
+    cdef np.int32_t[:] row_view
+    cdef np.int32_t[:] col_view
+    cdef np.int64_t[:] offsets_view
+    cdef COO indexer
+
+    if search_type not in SEARCH_TYPES or search_type == 'sorted':
+        raise Exception("Unrecognised search_type: %s" % search_type)
+    if M.getformat() == 'csr':
+        M_CS.CSR = 1
+        M_CS.n_indptr = M.shape[0] + 1
+    elif M.getformat() == 'csc':
+        M_CS.CSR = 0
+        M_CS.n_indptr = M.shape[1] + 1
+    else:
+        raise Exception('Sparse format %s not csr or csc' % M.getformat())
+
+    row = np.asarray(row_vector)
+    col = np.asarray(col_vector)
+    assert(row.size == col.size)
+    offsets = np.full(row.size, -1, dtype=np.int64)
+    if row.size > 0 and M.nnz > 0:
+        # Entries outside M are searched for as index -1 of the first row
+        # (or column), which is never stored.
+        inside = ((row >= 0) & (row < M.shape[0]) &
+                  (col >= 0) & (col < M.shape[1]))
+        outside_row, outside_col = (0, -1) if M_CS.CSR == 1 else (-1, 0)
+        row_view = np.where(inside, row, outside_row).astype(np.int32)
+        col_view = np.where(inside, col, outside_col).astype(np.int32)
+
+        indices = M.indices
+        M_CS.indptr  = <int *> &(indptr[0])
+        M_CS.indices = <int *> &(indices[0])
+        M_CS.data    = NULL
+        M_CS.learned = NULL
+        M_CS.cache = NULL
+        M_CS.filter = NULL
+        M_CS.arena = NULL
+        M_CS.symmetric = symmetric_mode(M, symmetric)
+        if search_type == 'learned':
+            if learned_index is None:
+                raise Exception('The learned search needs a learned_index')
+            M_CS.learned = learned_model(learned_index, M)
+        if cache is not None:
+            M_CS.cache = &(<LookupCache?> cache).C
+        if row_filter is not None:
+            M_CS.filter = filter_model(row_filter, M)
+
+        indexer.row = <int *> &(row_view[0])
+        indexer.col = <int *> &(col_view[0])
+        indexer.data = NULL
+        indexer.nnz = row.size
+        offsets_view = offsets
+        compressed_sparse_locate(&M_CS, &indexer,
+                                 <long *> &(offsets_view[0]),
+                                 SEARCH_TYPES[search_type], n_threads)
+
+    mask = offsets != -1
+    if return_offsets:
+        return mask, offsets
+    return mask
+
+
+cdef class MutableMatrix:
+    """A CSR or CSC matrix whose sparsity pattern can grow. Inserted entries
+    go into small sorted per-row (per-column for CSC) delta buffers that are
+    searched after the base matrix, and are merged into a new base matrix in
+    parallel once more than threshold of them have built up.
+
+    The matrix is copied on construction so later changes to M are not
+    seen. Inserts and lookups must not run at the same time.
+    """
+    cdef MCS A
+    cdef object shape
+    cdef object format
+    cdef bint initialised
+
+    def __cinit__(self, M, threshold=None):
+        cdef CS M_CS
+        cdef np.int32_t[:] indptr
+        cdef np.int32_t[:] indices
+        cdef np.float64_t[:] data
+
+        self.initialised = False
+        if M.getformat() == 'csr':
+            M_CS.CSR = 1
+            M_CS.n_indptr = M.shape[0] + 1
+        elif M.getformat() == 'csc':
+            M_CS.CSR = 0
+            M_CS.n_indptr = M.shape[1] + 1
+        else:
+            raise Exception('Sparse format %s not csr or csc' % M.getformat())
+
+        # Never read past the end of empty arrays.
+        M = M.copy()
+        M.sort_indices()
+        indptr = M.indptr
+        indices = np.append(M.indices, np.int32(0))
+        data = np.append(M.data, 0.0)
+        M_CS.indptr  = <int *> &(indptr[0])
+        M_CS.indices = <int *> &(indices[0])
+        M_CS.data    = <double *> &(data[0])
+        M_CS.learned = NULL
+        M_CS.cache = NULL
+        M_CS.filter = NULL
+        M_CS.arena = NULL
+        M_CS.symmetric = 0
+
+        if threshold is None:
+            threshold = max(1024, M.nnz//16)
+
+        mutable_init(&self.A, &M_CS, threshold)
+        self.shape = M.shape
+        self.format = M.getformat()
+        self.initialised = True
+
+    def __dealloc__(self):
+        if self.initialised:
+            mutable_free(&self.A)
+
+    @property
+    def n_delta(self):
+        """Total entries waiting in the delta buffers."""
+        return self.A.n_delta
+
+    @property
+    def nnz(self):
+        """Total stored entries."""
+        return self.A.base.indptr[self.A.base.n_indptr - 1] + self.A.n_delta
+
+    def insert(self, row_vector, col_vector, data_vector, n_threads=-1):
+        """Inserts the entries (row_vector[i], col_vector[i]) with values
+        data_vector[i], setting the value of any that are already stored
+        (the last copy wins). Returns the total new entries."""
+        cdef np.int32_t[:] row_view = np.asarray(row_vector, dtype=np.int32)
+        cdef np.int32_t[:] col_view = np.asarray(col_vector, dtype=np.int32)
+        cdef np.float64_t[:] data_view = np.asarray(data_vector,
+                                                    dtype=np.float64)
+        cdef COO entries
+
+        assert(row_view.size == col_view.size == data_view.size)
+        if row_view.size == 0:
+            return 0
+        if (np.min(row_view) < 0 or np.max(row_view) >= self.shape[0] or
+                np.min(col_view) < 0 or np.max(col_view) >= self.shape[1]):
+            raise Exception('Entries out of bounds for shape %s' %
+                            (self.shape,))
+
+        entries.row = <int *> &(row_view[0])
+        entries.col = <int *> &(col_view[0])
+        entries.data = <double *> &(data_view[0])
+        entries.nnz = row_view.size
+        return mutable_insert(&self.A, &entries, n_threads)
+
+    def apply(self,
+              np.int32_t[:] row_vector,
+              np.int32_t[:] col_vector,
+              np.float64_t[:] data_vector,
+              operation,
+              search_type,
+              n_threads,
+              debug,
+              alpha=1.0,
+              beta=0.0,
+              weights=None):
+        """As the module level apply, with the sorted search_type not
+        supported. The learned search_type binary searches as the base
+        matrix changes on every compaction. Entries that are not stored are
+        skipped."""
+        cdef np.int32_t N = row_vector.size
+        cdef COO indexer
+        cdef OP op
+        cdef np.float64_t[::1] weights_view
+        cdef np.int32_t search_type_int
+
+        with Timer() as t:
+            assert(row_vector.size == col_vector.size)
+            assert(row_vector.size == data_vector.size)
+
+            if search_type not in SEARCH_TYPES or search_type == 'sorted':
+                raise Exception("Unrecognised search_type: %s" % search_type)
+            search_type_int = SEARCH_TYPES[search_type]
+
+            if operation not in OPERATIONS:
+                raise Exception("Unrecognised operation: %s" % operation)
+            op.type = OPERATIONS[operation]
+            op.alpha = alpha
+            op.beta = beta
+            op.weights = NULL
+            if weights is not None:
+                weights_view = weights
+                assert(weights_view.size == N)
+                op.weights = <double *> &(weights_view[0])
+
+            if N > 0:
+                indexer.row = <int *> &(row_vector[0])
+                indexer.col = <int *> &(col_vector[0])
+                indexer.data = <double *> &(data_vector[0])
+                indexer.nnz = N
+                mutable_index(&self.A, &indexer, &op, search_type_int,
+                              n_threads)
+
+        if debug:
+            print("\tCython internal time: %s" % t.elapsed)
+
+    def compact(self, n_threads=-1):
+        """Merges the delta buffers into the base matrix now."""
+        mutable_compact(&self.A, n_threads)
+
+    def to_scipy(self, n_threads=-1):
+        """Compacts and returns a copy as a scipy matrix of the original
+        format."""
+        cdef int nnz
+        self.compact(n_threads)
+        nnz = self.A.base.indptr[self.A.base.n_indptr - 1]
+
+        indptr = np.asarray(<np.int32_t[:self.A.base.n_indptr]>
+                            <np.int32_t *> self.A.base.indptr).copy()
+        if nnz > 0:
+            indices = np.asarray(<np.int32_t[:nnz]>
+                                 <np.int32_t *> self.A.base.indices).copy()
+            data = np.asarray(<np.float64_t[:nnz]>
+                              self.A.base.data).copy()
+        else:
+            indices = np.zeros(0, dtype=np.int32)
+            data = np.zeros(0, dtype=np.float64)
+
+        if self.format == 'csr':
+            return sp.sparse.csr_matrix((data, indices, indptr),
+                                        shape=self.shape)
+        return sp.sparse.csc_matrix((data, indices, indptr),
+                                    shape=self.shape)
+
+
+cdef object pattern_view(M, CS *M_CS):
+    """Point M_CS at the sparsity pattern of M (a CSR or CSC matrix) and
+    return the arrays it points into, which must be kept alive while M_CS is
+    used."""
+    cdef np.int32_t[:] indptr = M.indptr
+    cdef np.int32_t[:] indices
+
+    if M.getformat() not in ('csr', 'csc'):
+        raise Exception('Sparse format %s not csr or csc' % M.getformat())
+    # Never take the address of an empty array.
+    indices = M.indices if M.nnz > 0 else np.zeros(1, dtype=np.int32)
+    M_CS.CSR = 1 if M.getformat() == 'csr' else 0
+    M_CS.n_indptr = indptr.shape[0]
+    M_CS.indptr  = <int *> &(indptr[0])
+    M_CS.indices = <int *> &(indices[0])
+    M_CS.data    = NULL
+    M_CS.learned = NULL
+    M_CS.cache = NULL
+    M_CS.filter = NULL
+    M_CS.arena = NULL
+    M_CS.symmetric = 0
+    return (indptr, indices)
+
+
+cdef int sidecar_check(int status, path) except -1:
+    """Raises an exception if saving or loading the sidecar at path failed."""
+    if status != SIDECAR_OK:
+        raise Exception('Sidecar %s %s' % (path, SIDECAR_ERRORS[status]))
+    return 0
+
+
+cdef sidecar_warn(int status, path):
+    """Warns if saving the sidecar at path failed. The structure it was built
+    from is still usable, it is just built again next time."""
+    if status != SIDECAR_OK:
+        warnings.warn('Sidecar %s %s' % (path, SIDECAR_ERRORS[status]))
+
+
+cdef class PackedIndices:
+    """The indices of a CSR or CSC matrix delta encoded and bit packed in
+    blocks, with a skip array of the first index of each block. Lookups
+    binary search the skip array and decode a single block, so the matrix
+    can be indexed without keeping M.indices in memory.
+
+    Only M.indptr and M.data are kept, so changes to the values of M are
+    seen but its sparsity pattern must not change.
+
+    If sidecar (a path) holds the packed indices of M they are mapped from
+    it, which is almost instant, and otherwise they are packed and saved
+    there, with a warning if that fails. With verify the whole file is
+    checksummed and compared with M rather than a sample of M.indices.
+    """
+    cdef PACKED P
+    cdef MAPPED map
+    cdef CS M_CS
+    cdef object indptr
+    cdef object data
+    cdef long nnz
+    cdef bint initialised
+
+    def __cinit__(self, M, n_threads=-1, sidecar=None, verify=False):
+        cdef np.int32_t[:] indptr
+        cdef np.int32_t[:] indices
+        cdef np.float64_t[:] data
+
+        self.initialised = False
+        self.map.addr = NULL
+        if M.getformat() == 'csr':
+            self.M_CS.CSR = 1
+            self.M_CS.n_indptr = M.shape[0] + 1
+        elif M.getformat() == 'csc':
+            self.M_CS.CSR = 0
+            self.M_CS.n_indptr = M.shape[1] + 1
+        else:
+            raise Exception('Sparse format %s not csr or csc' % M.getformat())
+        if not M.has_sorted_indices:
+            raise Exception('M must have sorted indices to be packed')
+        if M.nnz == 0:
+            raise Exception('M must have stored entries to be packed')
+
+        self.indptr = M.indptr
+        self.data = M.data
+        self.nnz = M.nnz
+        indptr = self.indptr
+        indices = M.indices
+        data = self.data
+        self.M_CS.indptr  = <int *> &(indptr[0])
+        self.M_CS.indices = <int *> &(indices[0])
+        self.M_CS.data    = <double *> &(data[0])
+        self.M_CS.learned = NULL
+        self.M_CS.cache = NULL
+        self.M_CS.filter = NULL
+        self.M_CS.arena = NULL
+        self.M_CS.symmetric = 0
+
+        if sidecar is None:
+            packed_build(&self.P, &self.M_CS, n_threads)
+        elif sidecar_load_packed(&self.P, &self.M_CS, os.fsencode(sidecar),
+                                 1 if verify else 0,
+                                 &self.map) != SIDECAR_OK:
+            packed_build(&self.P, &self.M_CS, n_threads)
+            sidecar_warn(sidecar_save_packed(&self.P, &self.M_CS,
+                                             os.fsencode(sidecar)), sidecar)
+        self.M_CS.indices = NULL
+        self.initialised = True
+
+    def __dealloc__(self):
+        if self.map.addr != NULL:
+            sidecar_unmap(&self.map)
+        elif self.initialised:
+            packed_free(&self.P)
+
+    @property
+    def mapped(self):
+        """Whether the packed indices were mapped from a sidecar."""
+        return self.map.addr != NULL
+
+    def save(self, path, M):
+        """Saves the packed indices of M to a sidecar at path."""
+        cdef CS M_CS
+        if (M.shape[M.getformat() == 'csc'] + 1 != self.M_CS.n_indptr or
+                M.nnz != self.nnz or
+                (M.getformat() == 'csr') != (self.M_CS.CSR == 1)):
+            raise Exception('M is not the packed matrix')
+        arrays = pattern_view(M, &M_CS)
+        sidecar_check(sidecar_save_packed(&self.P, &M_CS, os.fsencode(path)),
+                      path)
+
+    @property
+    def nbytes(self):
+        """Total bytes used by the packed indices and skip arrays."""
+        return packed_nbytes(&self.P)
+
+    @property
+    def compression_ratio(self):
+        """The size of the uncompressed indptr and indices over nbytes."""
+        return (4.0*(self.nnz + self.M_CS.n_indptr))/self.nbytes
+
+    @property
+    def simd(self):
+        """Whether blocks are decoded with the AVX2 kernel (see set_simd)."""
+        return bool(packed_simd())
+
+    def apply(self,
+              np.int32_t[:] row_vector,
+              np.int32_t[:] col_vector,
+              np.float64_t[:] data_vector,
+              operation,
+              search_type,
+              n_threads,
+              debug,
+              alpha=1.0,
+              beta=0.0,
+              weights=None):
+        """As the module level apply. The search_type can be 'sorted' to merge
+        against the packed blocks, and any other search_type binary searches
+        the skip array."""
+        cdef np.int32_t N = row_vector.size
+        cdef COO indexer
+        cdef OP op
+        cdef np.float64_t[::1] weights_view
+
+        with Timer() as t:
+            assert(row_vector.size == col_vector.size)
+            assert(row_vector.size == data_vector.size)
+
+            if search_type not in SEARCH_TYPES:
+                raise Exception("Unrecognised search_type: %s" % search_type)
+
+            if operation not in OPERATIONS:
+                raise Exception("Unrecognised operation: %s" % operation)
+            op.type = OPERATIONS[operation]
+            op.alpha = alpha
+            op.beta = beta
+            op.weights = NULL
+            if weights is not None:
+                weights_view = weights
+                assert(weights_view.size == N)
+                op.weights = <double *> &(weights_view[0])
+
+            if N > 0:
+                indexer.row = <int *> &(row_vector[0])
+                indexer.col = <int *> &(col_vector[0])
+                indexer.data = <double *> &(data_vector[0])
+                indexer.nnz = N
+                if search_type == 'sorted':
+                    packed_sparse_index_sorted(&self.M_CS, &self.P, &indexer,
+                                               &op, n_threads)
+                else:
+                    packed_sparse_index(&self.M_CS, &self.P, &indexer, &op,
+                                        n_threads)
+
+        if debug:
+            print("\tCython internal time: %s" % t.elapsed)
+
+
+cdef class LearnedIndex:
+    """Error bounded piecewise linear models of the indices of each row (or
+    column for CSC) of M with at least min_length stored entries. A lookup
+    evaluates the model of its row and then binary searches only the
+    positions within error of the prediction. Shorter rows are binary
+    searched as usual.
+
+    Pass it to apply with search_type='learned'. Only the sparsity pattern of
+    M is modelled so its values may change, but if the pattern changes the
+    index must be rebuilt.
+
+    If sidecar (a path) holds an index of M fitted with the same error and
+    min_length it is mapped from there instead of being fitted again.
+    Otherwise the new index is saved there, with a warning if that fails.
+    Set verify to checksum the file and compare it with all of M.indices.
+    """
+    cdef LEARNED L
+    cdef MAPPED map
+    cdef object format
+    cdef object shape
+    cdef long nnz
+    cdef bint initialised
+
+    def __cinit__(self, M, error=32, min_length=64, n_threads=-1,
+                  sidecar=None, verify=False):
+        cdef CS M_CS
+        cdef np.int32_t[:] indptr = M.indptr
+        cdef np.int32_t[:] indices
+
+        self.initialised = False
+        self.map.addr = NULL
+        if M.getformat() == 'csr':
+            M_CS.CSR = 1
+            M_CS.n_indptr = M.shape[0] + 1
+        elif M.getformat() == 'csc':
+            M_CS.CSR = 0
+            M_CS.n_indptr = M.shape[1] + 1
+        else:
+            raise Exception('Sparse format %s not csr or csc' % M.getformat())
+        if not M.has_sorted_indices:
+            raise Exception('M must have sorted indices to be learned')
+        if error < 0 or min_length < 1:
+            raise Exception('error must be >= 0 and min_length >= 1')
+
+        # Never take the address of an empty array.
+        indices = M.indices if M.nnz > 0 else np.zeros(1, dtype=np.int32)
+        M_CS.indptr  = <int *> &(indptr[0])
+        M_CS.indices = <int *> &(indices[0])
+        M_CS.data    = NULL
+        M_CS.learned = NULL
+        M_CS.cache = NULL
+        M_CS.filter = NULL
+        M_CS.arena = NULL
+        M_CS.symmetric = 0
+
+        if sidecar is None:
+            learned_build(&self.L, &M_CS, error, min_length, n_threads)
+        elif sidecar_load_learned(&self.L, &M_CS, os.fsencode(sidecar),
+                                  error, min_length, 1 if verify else 0,
+                                  &self.map) != SIDECAR_OK:
+            learned_build(&self.L, &M_CS, error, min_length, n_threads)
+            sidecar_warn(sidecar_save_learned(&self.L, &M_CS,
+                                              os.fsencode(sidecar)), sidecar)
+        self.format = M.getformat()
+        self.shape = M.shape
+        self.nnz = M.nnz
+        self.initialised = True
+
+    def __dealloc__(self):
+        if self.map.addr != NULL:
+            sidecar_unmap(&self.map)
+        elif self.initialised:
+            learned_free(&self.L)
+
+    @property
+    def mapped(self):
+        """Whether the models were mapped from a sidecar."""
+        return self.map.addr != NULL
+
+    def save(self, path, M):
+        """Saves the models of M to a sidecar at path."""
+        cdef CS M_CS
+        learned_model(self, M)
+        arrays = pattern_view(M, &M_CS)
+        sidecar_check(sidecar_save_learned(&self.L, &M_CS, os.fsencode(path)),
+                      path)
+
+    @property
+    def nbytes(self):
+        """Total bytes used by the models."""
+        return learned_nbytes(&self.L)
+
+    @property
+    def n_segments(self):
+        """Total linear segments over all rows."""
+        return self.L.row_segment[self.L.n_indptr - 1]
+
+
+cdef LEARNED *learned_model(LearnedIndex learned_index, M) except NULL:
+    """The models of learned_index after checking they were built from a
+    matrix like M."""
+    if (learned_index.format != M.getformat() or
+            learned_index.shape != M.shape or learned_index.nnz != M.nnz):
+        raise Exception('learned_index was not built from M')
+    return &learned_index.L
+
+
+cdef class LookupCache:
+    """A bounded cache of where entries of a matrix are stored, for indexers
+    where a few (row, col) pairs make up most lookups across calls to apply.
+    The cache is set associative with CLOCK eviction in each set and can be
+    shared by any number of threads without locks.
+
+    Every hit is checked against the indices of the matrix so a stale cache
+    never gives a wrong answer, but use one cache per matrix and clear it if
+    the sparsity pattern changes so it is not filled with stale entries.
+    """
+    cdef CACHE C
+
+    def __cinit__(self, capacity=2**16):
+        cache_init(&self.C, capacity)
+
+    def __dealloc__(self):
+        cache_free(&self.C)
+
+    @property
+    def capacity(self):
+        """Total entries the cache can hold."""
+        return self.C.n_sets*CACHE_WAYS
+
+    @property
+    def nbytes(self):
+        """Total bytes used by the cache."""
+        return cache_nbytes(&self.C)
+
+    @property
+    def hits(self):
+        """Lookups found in the cache since it was last cleared."""
+        return self.C.hits
+
+    @property
+    def misses(self):
+        """Lookups that had to be searched since it was last cleared."""
+        return self.C.misses
+
+    @property
+    def hit_rate(self):
+        """The fraction of lookups found in the cache."""
+        total = self.C.hits + self.C.misses
+        return self.C.hits/total if total > 0 else 0.0
+
+    def clear(self):
+        """Empties the cache and resets the counters."""
+        cache_clear(&self.C)
+
+
+cdef class RowFilter:
+    """A filter for each row (or column for CSC) of M that rejects most
+    indices that are not stored with a single memory access. Rows whose
+    indices span few enough columns get an exact bitmap and the others a
+    blocked Bloom filter of bits_per_entry bits per stored entry.
+
+    Pass it to contains or apply as row_filter. Only the sparsity pattern of
+    M is filtered so its values may change, but if the pattern changes the
+    filter must be rebuilt.
+
+    A filter of M with the same bits_per_entry is mapped from sidecar (a
+    path) if it holds one, and otherwise the new filter is saved there
+    (failing to save only warns). verify checks the whole file and
+    M.indices rather than a sample.
+    """
+    cdef FILTER F
+    cdef MAPPED map
+    cdef int bits_per_entry
+    cdef object format
+    cdef object shape
+    cdef long nnz
+    cdef bint initialised
+
+    def __cinit__(self, M, bits_per_entry=10, n_threads=-1, sidecar=None,
+                  verify=False):
+        cdef CS M_CS
+        cdef np.int32_t[:] indptr = M.indptr
+        cdef np.int32_t[:] indices
+
+        self.initialised = False
+        self.map.addr = NULL
+        if M.getformat() == 'csr':
+            M_CS.CSR = 1
+            M_CS.n_indptr = M.shape[0] + 1
+        elif M.getformat() == 'csc':
+            M_CS.CSR = 0
+            M_CS.n_indptr = M.shape[1] + 1
+        else:
+            raise Exception('Sparse format %s not csr or csc' % M.getformat())
+        if not M.has_sorted_indices:
+            raise Exception('M must have sorted indices to be filtered')
+        if bits_per_entry < 1:
+            raise Exception('bits_per_entry must be >= 1')
+
+        # Never take the address of an empty array.
+        indices = M.indices if M.nnz > 0 else np.zeros(1, dtype=np.int32)
+        M_CS.indptr  = <int *> &(indptr[0])
+        M_CS.indices = <int *> &(indices[0])
+        M_CS.data    = NULL
+        M_CS.learned = NULL
+        M_CS.cache = NULL
+        M_CS.filter = NULL
+        M_CS.arena = NULL
+        M_CS.symmetric = 0
+
+        if sidecar is None:
+            filter_build(&self.F, &M_CS, bits_per_entry, n_threads)
+        elif sidecar_load_filter(&self.F, &M_CS, os.fsencode(sidecar),
+                                 bits_per_entry, 1 if verify else 0,
+                                 &self.map) != SIDECAR_OK:
+            filter_build(&self.F, &M_CS, bits_per_entry, n_threads)
+            sidecar_warn(sidecar_save_filter(&self.F, &M_CS, bits_per_entry,
+                                             os.fsencode(sidecar)), sidecar)
+        self.bits_per_entry = bits_per_entry
+        self.format = M.getformat()
+        self.shape = M.shape
+        self.nnz = M.nnz
+        self.initialised = True
+
+    def __dealloc__(self):
+        if self.map.addr != NULL:
+            sidecar_unmap(&self.map)
+        elif self.initialised:
+            filter_free(&self.F)
+
+    @property
+    def mapped(self):
+        """Whether the filters were mapped from a sidecar."""
+        return self.map.addr != NULL
+
+    def save(self, path, M):
+        """Saves the filters of M to a sidecar at path."""
+        cdef CS M_CS
+        filter_model(self, M)
+        arrays = pattern_view(M, &M_CS)
+        sidecar_check(sidecar_save_filter(&self.F, &M_CS, self.bits_per_entry,
+                                          os.fsencode(path)), path)
+
+    @property
+    def nbytes(self):
+        """Total bytes used by the filters."""
+        return filter_nbytes(&self.F)
+
+
+cdef FILTER *filter_model(RowFilter row_filter, M) except NULL:
+    """The filters of row_filter after checking they were built from a
+    matrix like M."""
+    if (row_filter.format != M.getformat() or
+            row_filter.shape != M.shape or row_filter.nnz != M.nnz):
+        raise Exception('row_filter was not built from M')
+    return &row_filter.F
+
+
+cdef int symmetric_mode(M, symmetric) except -2:
+    """The symmetric field of the CS of M when M is the given triangle
+    ('upper' or 'lower') of a symmetric matrix, or 0 if symmetric is None."""
+    if symmetric is None:
+        return 0
+    if symmetric not in ('upper', 'lower'):
+        raise Exception("Unrecognised symmetric: %s" % symmetric)
+    if M.shape[0] != M.shape[1]:
+        raise Exception('A symmetric matrix must be square')
+
+    # The upper triangle of CSR has axis0 <= axis1 and of CSC the reverse.
+    if (symmetric == 'upper') == (M.getformat() == 'csr'):
+        return 1
+    return -1
+
+
+cdef class SnapshotMatrix:
+    """A CSR or CSC matrix that can be read from and written to by several
+    Python threads at once, where every get sees the values from before or
+    after each write but never a mix. The values are kept in pages of
+    2**page_shift entries. A write (any operation other than get and
+    axpy_get) copies the pages it touches, applies the whole batch to the
+    copies and then publishes them all at once. Gets never block and replaced
+    pages are freed once no get can still be reading them.
+
+    The matrix is copied on construction so later changes to M are not seen,
+    and its sparsity pattern is fixed.
+    """
+    cdef SNAPSHOT S
+    cdef object shape
+    cdef object format
+    cdef bint initialised
+
+    def __cinit__(self, M, page_shift=12):
+        cdef CS M_CS
+        cdef np.int32_t[:] indptr
+        cdef np.int32_t[:] indices
+        cdef np.float64_t[:] data
+
+        self.initialised = False
+        if M.getformat() == 'csr':
+            M_CS.CSR = 1
+            M_CS.n_indptr = M.shape[0] + 1
+        elif M.getformat() == 'csc':
+            M_CS.CSR = 0
+            M_CS.n_indptr = M.shape[1] + 1
+        else:
+            raise Exception('Sparse format %s not csr or csc' % M.getformat())
+        if not 0 <= page_shift < 30:
+            raise Exception('page_shift must be in [0, 30)')
+
+        # Never read past the end of empty arrays.
+        M = M.copy()
+        M.sort_indices()
+        indptr = M.indptr
+        indices = np.append(M.indices, np.int32(0))
+        data = np.append(M.data, 0.0)
+        M_CS.indptr  = <int *> &(indptr[0])
+        M_CS.indices = <int *> &(indices[0])
+        M_CS.data    = <double *> &(data[0])
+        M_CS.learned = NULL
+        M_CS.cache = NULL
+        M_CS.filter = NULL
+        M_CS.arena = NULL
+        M_CS.symmetric = 0
+
+        snapshot_init(&self.S, &M_CS, page_shift)
+        self.shape = M.shape
+        self.format = M.getformat()
+        self.initialised = True
+
+    def __dealloc__(self):
+        if self.initialised:
+            snapshot_free(&self.S)
+
+    @property
+    def epoch(self):
+        """Total writes published so far, plus 1."""
+        return self.S.epoch
+
+    @property
+    def n_retired(self):
+        """Replaced page tables still waiting for their readers to finish."""
+        return self.S.n_retired
+
+    def apply(self,
+              np.int32_t[:] row_vector,
+              np.int32_t[:] col_vector,
+              np.float64_t[:] data_vector,
+              operation,
+              search_type,
+              n_threads,
+              debug,
+              alpha=1.0,
+              beta=0.0,
+              weights=None):
+        """As the module level apply, with the sorted search_type not
+        supported. The GIL is released so other threads can read or write at
+        the same time. Entries that are not stored are skipped."""
+        cdef np.int32_t N = row_vector.size
+        cdef COO indexer
+        cdef OP op
+        cdef np.float64_t[::1] weights_view
+        cdef int search_type_int
+        cdef int n_threads_int = n_threads
+
+        with Timer() as t:
+            assert(row_vector.size == col_vector.size)
+            assert(row_vector.size == data_vector.size)
+
+            if search_type not in SEARCH_TYPES or search_type == 'sorted':
+                raise Exception("Unrecognised search_type: %s" % search_type)
+            search_type_int = SEARCH_TYPES[search_type]
+
+            if operation not in OPERATIONS:
+                raise Exception("Unrecognised operation: %s" % operation)
+            op.type = OPERATIONS[operation]
+            op.alpha = alpha
+            op.beta = beta
+            op.weights = NULL
+            if weights is not None:
+                weights_view = weights
+                assert(weights_view.size == N)
+                op.weights = <double *> &(weights_view[0])
+
+            if N > 0:
+                indexer.row = <int *> &(row_vector[0])
+                indexer.col = <int *> &(col_vector[0])
+                indexer.data = <double *> &(data_vector[0])
+                indexer.nnz = N
+                with nogil:
+                    snapshot_index(&self.S, &indexer, &op, search_type_int,
+                                   n_threads_int)
+
+        if debug:
+            print("\tCython internal time: %s" % t.elapsed)
+
+    def to_scipy(self):
+        """Returns a copy of a single snapshot as a scipy matrix of the
+        original format."""
+        cdef np.float64_t[:] data_view
+        cdef long nnz = self.S.nnz
+
+        indptr = np.asarray(<np.int32_t[:self.S.base.n_indptr]>
+                            <np.int32_t *> self.S.base.indptr).copy()
+        if nnz > 0:
+            indices = np.asarray(<np.int32_t[:nnz]>
+                                 <np.int32_t *> self.S.base.indices).copy()
+            data = np.empty(nnz, dtype=np.float64)
+            data_view = data
+            with nogil:
+                snapshot_read(&self.S, &data_view[0])
+        else:
+            indices = np.zeros(0, dtype=np.int32)
+            data = np.zeros(0, dtype=np.float64)
+
+        if self.format == 'csr':
+            return sp.sparse.csr_matrix((data, indices, indptr),
+                                        shape=self.shape)
+        return sp.sparse.csc_matrix((data, indices, indptr),
+                                    shape=self.shape)
+
+
+cdef class ScratchArena:
+    """Scratch buffers for the temporaries of apply, which are kept and
+    grown as needed between calls instead of being allocated and faulted in
+    on every call. With huge_pages, buffers of 2MB or more are backed by
+    huge pages (explicit ones if the system has any reserved, otherwise
+    transparent huge pages).
+
+    An arena must only be used by one call at a time, so give each thread
+    its own.
+    """
+    cdef ARENA A
+
+    def __cinit__(self, huge_pages=False):
+        arena_init(&self.A, 1 if huge_pages else 0)
+
+    def __dealloc__(self):
+        arena_release(&self.A)
+
+    @property
+    def peak_bytes(self):
+        """The most scratch memory a single call has used."""
+        return self.A.peak
+
+    @property
+    def reserved_bytes(self):
+        """Total scratch memory kept by the arena."""
+        return self.A.reserved
+
+    @property
+    def huge_page_bytes(self):
+        """How much of reserved_bytes is backed by huge pages."""
+        return self.A.huge_bytes
+
+    @property
+    def n_grows(self):
+        """Times a buffer had to be reallocated to make it larger."""
+        return self.A.n_grows
+
+    def release(self):
+        """Frees every buffer, which are reallocated when next needed."""
+        arena_release(&self.A)
+
+
+cdef class MatrixBatch:
+    """Many small CSR or CSC matrices to index together with apply_batched.
+    The matrices are given as a list of scipy matrices, or with from_arrays
+    as one concatenated set of arrays. Either way nothing is copied, so
+    updates are made to the original data arrays.
+    """
+    cdef CS *M
+    cdef int n_matrices
+    cdef object arrays
+
+    def __cinit__(self, matrices=()):
+        cdef int m
+        cdef np.ndarray indptr
+        cdef np.ndarray indices
+        cdef np.ndarray data
+
+        matrices = list(matrices)
+        self.n_matrices = len(matrices)
+        self.M = <CS *> malloc(max(self.n_matrices, 1)*sizeof(CS))
+        self.arrays = []
+        for m in range(self.n_matrices):
+            A = matrices[m]
+            if A.getformat() == 'csr':
+                self.M[m].CSR = 1
+                self.M[m].n_indptr = A.shape[0] + 1
+            elif A.getformat() == 'csc':
+                self.M[m].CSR = 0
+                self.M[m].n_indptr = A.shape[1] + 1
+            else:
+                raise Exception('Sparse format %s not csr or csc'
+                                % A.getformat())
+            indptr = np.ascontiguousarray(A.indptr, dtype=np.int32)
+            indices = np.ascontiguousarray(A.indices, dtype=np.int32)
+            data = A.data
+            if not (data.dtype == np.float64 and data.flags.c_contiguous):
+                raise Exception('Matrix data must be contiguous float64')
+            self.arrays.append((indptr, indices, data))
+
+            self.M[m].indptr = <int *> np.PyArray_DATA(indptr)
+            self.M[m].indices = <int *> np.PyArray_DATA(indices)
+            self.M[m].data = <double *> np.PyArray_DATA(data)
+            self.M[m].learned = NULL
+            self.M[m].cache = NULL
+            self.M[m].filter = NULL
+            self.M[m].arena = NULL
+            self.M[m].symmetric = 0
+
+    def __dealloc__(self):
+        free(self.M)
+
+    @staticmethod
+    def from_arrays(indptr, indices, data, indptr_offsets, data_offsets,
+                    format='csr'):
+        """The matrices stored one after another in the same arrays, where
+        matrix m has indptr[indptr_offsets[m]:indptr_offsets[m+1]] (starting
+        from 0 for every matrix) and its entries are
+        indices[data_offsets[m]:data_offsets[m+1]] and the same of data. Every
+        matrix has the same format."""
+        cdef MatrixBatch batch = MatrixBatch()
+        cdef np.int64_t[:] indptr_view
+        cdef np.int64_t[:] data_view
+        cdef int *indptr_base
+        cdef int *indices_base
+        cdef double *data_base
+        cdef int m
+
+        if format not in ('csr', 'csc'):
+            raise Exception('Sparse format %s not csr or csc' % format)
+        indptr = np.ascontiguousarray(indptr, dtype=np.int32)
+        indices = np.ascontiguousarray(indices, dtype=np.int32)
+        if not (isinstance(data, np.ndarray) and data.dtype == np.float64
+                and data.flags.c_contiguous):
+            raise Exception('data must be a contiguous float64 array')
+        indptr_offsets = np.ascontiguousarray(indptr_offsets, dtype=np.int64)
+        data_offsets = np.ascontiguousarray(data_offsets, dtype=np.int64)
+
+        # Cheap checks that the offsets agree with each other and the arrays.
+        n = indptr_offsets.size - 1
+        if n < 0 or data_offsets.size != n + 1:
+            raise Exception('Need an offset per matrix plus one')
+        if (np.any(np.diff(indptr_offsets) < 1) or
+                np.any(np.diff(data_offsets) < 0) or
+                indptr_offsets[0] < 0 or indptr_offsets[n] > indptr.size or
+                data_offsets[0] < 0 or data_offsets[n] > indices.size or
+                indices.size != data.size):
+            raise Exception('Offsets are out of order or out of bounds')
+        if (np.any(indptr[indptr_offsets[:-1]] != 0) or
+                np.any(indptr[indptr_offsets[1:] - 1]
+                       != np.diff(data_offsets))):
+            raise Exception('indptr does not match data_offsets')
+
+        free(batch.M)
+        batch.n_matrices = n
+        batch.M = <CS *> malloc(max(n, 1)*sizeof(CS))
+        batch.arrays = [(indptr, indices, data)]
+        indptr_base = <int *> np.PyArray_DATA(indptr)
+        indices_base = <int *> np.PyArray_DATA(indices)
+        data_base = <double *> np.PyArray_DATA(data)
+        indptr_view = indptr_offsets
+        data_view = data_offsets
+        for m in range(n):
+            batch.M[m].CSR = 1 if format == 'csr' else 0
+            batch.M[m].n_indptr = indptr_view[m+1] - indptr_view[m]
+            batch.M[m].indptr = indptr_base + indptr_view[m]
+            batch.M[m].indices = indices_base + data_view[m]
+            batch.M[m].data = data_base + data_view[m]
+            batch.M[m].learned = NULL
+            batch.M[m].cache = NULL
+            batch.M[m].filter = NULL
+            batch.M[m].arena = NULL
+            batch.M[m].symmetric = 0
+        return batch
+
+    def __len__(self):
+        return self.n_matrices
+
+
+class PipelineBatch:
+    """A batch submitted to a Pipeline as it passes through the stages."""
+    def __init__(self, future, M, rows, cols, values, operation, alpha,
+                 beta, weights):
+        self.future = future
+        self.M = M
+        self.rows = rows
+        self.cols = cols
+        self.values = values
+        self.operation = operation
+        self.alpha = alpha
+        self.beta = beta
+        self.weights = weights
+        self.error = None
+
+
+def group_batch(batch):
+    """The first stage of a Pipeline, which sorts the batch by (axis0, axis1)
+    so repeated entries are next to each other. Entries outside M are
+    grouped at the start and searched for as index -1, which is never
+    stored."""
+    M = batch.M
+    if batch.operation not in OPERATIONS:
+        raise Exception("Unrecognised operation: %s" % batch.operation)
+    if M.getformat() not in ('csr', 'csc'):
+        raise Exception('Sparse format %s not csr or csc' % M.getformat())
+    if not (isinstance(batch.values, np.ndarray) and
+            batch.values.dtype == np.float64 and batch.values.ndim == 1):
+        raise Exception('values must be a 1d float64 array')
+
+    row = np.asarray(batch.rows)
+    col = np.asarray(batch.cols)
+    assert(row.size == col.size == batch.values.size)
+    inside = ((row >= 0) & (row < M.shape[0]) &
+              (col >= 0) & (col < M.shape[1]))
+    if M.getformat() == 'csr':
+        key = row.astype(np.int64)*M.shape[1] + col
+        outside_row, outside_col = (0, -1)
+    else:
+        key = col.astype(np.int64)*M.shape[0] + row
+        outside_row, outside_col = (-1, 0)
+
+    # A stable sort keeps repeated entries in the order they were given.
+    batch.order = np.argsort(np.where(inside, key, -1), kind='stable')
+    batch.row = np.where(inside, row, outside_row)[batch.order].astype(
+        np.int32)
+    batch.col = np.where(inside, col, outside_col)[batch.order].astype(
+        np.int32)
+    batch.grouped = batch.values[batch.order]
+    if batch.weights is not None:
+        weights = np.asarray(batch.weights, dtype=np.float64)
+        if weights.shape != batch.values.shape:
+            raise Exception('weights must have one entry per value')
+        batch.grouped_weights = weights[batch.order]
+
+
+cdef search_batch(batch, int search_type, int n_threads):
+    """The second stage of a Pipeline, which finds the offset of every entry
+    in M.data."""
+    cdef CS M_CS
+    cdef np.int32_t[:] indptr = batch.M.indptr
+    cdef np.int32_t[:] indices
+    cdef np.int32_t[:] row_view = batch.row
+    cdef np.int32_t[:] col_view = batch.col
+    cdef np.int64_t[:] offsets_view
+    cdef COO indexer
+
+    M = batch.M
+    batch.offsets = np.full(batch.row.size, -1, dtype=np.int64)
+    if batch.row.size == 0 or M.nnz == 0:
+        return
+
+    indices = M.indices
+    M_CS.CSR = 1 if M.getformat() == 'csr' else 0
+    M_CS.n_indptr = indptr.size
+    M_CS.indptr  = <int *> &(indptr[0])
+    M_CS.indices = <int *> &(indices[0])
+    M_CS.data    = NULL
+    M_CS.learned = NULL
+    M_CS.cache = NULL
+    M_CS.filter = NULL
+    M_CS.arena = NULL
+    M_CS.symmetric = 0
+
+    indexer.row = <int *> &(row_view[0])
+    indexer.col = <int *> &(col_view[0])
+    indexer.data = NULL
+    indexer.nnz = row_view.size
+    offsets_view = batch.offsets
+    with nogil:
+        compressed_sparse_locate(&M_CS, &indexer,
+                                 <long *> &(offsets_view[0]), search_type,
+                                 n_threads)
+
+
+cdef apply_batch(batch, int n_threads):
+    """The last stage of a Pipeline, which applies the operation at the
+    offsets and writes any results back in the order they were given."""
+    cdef CS M_CS
+    cdef np.float64_t[:] data
+    cdef np.float64_t[:] grouped_view = batch.grouped
+    cdef np.int64_t[:] offsets_view = batch.offsets
+    cdef np.float64_t[:] weights_view
+    cdef int n = grouped_view.shape[0]
+    cdef OP op
+
+    M = batch.M
+    if batch.row.size == 0 or M.nnz == 0:
+        return
+
+    data = M.data
+    M_CS.data = <double *> &(data[0])
+    op.type = OPERATIONS[batch.operation]
+    op.alpha = batch.alpha
+    op.beta = batch.beta
+    op.weights = NULL
+    if batch.weights is not None:
+        weights_view = batch.grouped_weights
+        op.weights = <double *> &(weights_view[0])
+
+    with nogil:
+        compressed_sparse_apply_located(&M_CS, <long *> &(offsets_view[0]),
+                                        &(grouped_view[0]), &op,
+                                        n, n_threads)
+
+    if op.type in (OP_GET, OP_AXPY_GET):
+        batch.values[batch.order] = batch.grouped
+
+
+class Pipeline:
+    """Applies batches asynchronously, with the stages of each batch
+    (grouping by axis0, searching and applying) run by their own thread so
+    they overlap across queued batches. The C parts of every stage release
+    the GIL and are parallelised over n_threads as usual.
+
+    Each stage has a queue of at most max_pending batches, so submit blocks
+    once the pipeline is full until the slowest stage catches up. Batches
+    are applied one at a time in the order they were submitted, so batches
+    touching the same entries of a matrix see each other's updates in order.
+    Within a batch repeated entries are reduced in order as for the sorted
+    search_type.
+
+    The sparsity pattern of a matrix, and the arrays of a batch, must not be
+    changed until its batches are done. close the pipeline (or use it as a
+    context manager) to stop its threads.
+    """
+    def __init__(self, search_type='binary', n_threads=-1, max_pending=4):
+        if (search_type not in SEARCH_TYPES or
+                search_type in ('sorted', 'learned')):
+            raise Exception("Unrecognised search_type: %s" % search_type)
+        search_type_int = SEARCH_TYPES[search_type]
+
+        self.queues = [queue.Queue(max_pending) for i in range(3)]
+        stages = [group_batch,
+                  lambda batch: search_batch(batch, search_type_int,
+                                             n_threads),
+                  lambda batch: apply_batch(batch, n_threads)]
+        self.threads = []
+        for i, stage in enumerate(stages):
+            outbox = self.queues[i+1] if i < 2 else None
+            thread = threading.Thread(target=self.run_stage,
+                                      args=(stage, self.queues[i], outbox),
+                                      daemon=True)
+            thread.start()
+            self.threads.append(thread)
+
+        # Submits from asyncio wait for room here, in order, so the event
+        # loop is never blocked.
+        self.executor = ThreadPoolExecutor(max_workers=1)
+        self.closed = False
+
+    def run_stage(self, stage, inbox, outbox):
+        while True:
+            batch = inbox.get()
+            if batch is None:
+                if outbox is not None:
+                    outbox.put(None)
+                return
+
+            if inbox is self.queues[0]:
+                # A batch cancelled before it started is dropped.
+                if not batch.future.set_running_or_notify_cancel():
+                    continue
+            if batch.error is None:
+                try:
+                    stage(batch)
+                except Exception as error:
+                    batch.error = error
+
+            if outbox is not None:
+                outbox.put(batch)
+            elif batch.error is not None:
+                batch.future.set_exception(batch.error)
+            else:
+                batch.future.set_result(batch.values)
+
+    def submit(self, M, rows, cols, values, operation, alpha=1.0, beta=0.0,
+               weights=None, block=True):
+        """Queues operation between M[rows, cols] and values (see apply) and
+        returns a concurrent.futures.Future of values, which holds the
+        results of get and axpy_get once it is done. If the pipeline is full
+        this blocks, or raises queue.Full if block is False."""
+        if self.closed:
+            raise Exception('Pipeline is closed')
+        future = Future()
+        batch = PipelineBatch(future, M, rows, cols, values, operation,
+                              alpha, beta, weights)
+        self.queues[0].put(batch, block)
+        return future
+
+    async def submit_async(self, M, rows, cols, values, operation, alpha=1.0,
+                           beta=0.0, weights=None):
+        """As submit but awaitable from asyncio, waiting for room in the
+        pipeline without blocking the event loop."""
+        submit = functools.partial(self.submit, M, rows, cols, values,
+                                   operation, alpha, beta, weights)
+        future = await asyncio.get_running_loop().run_in_executor(
+            self.executor, submit)
+        return await asyncio.wrap_future(future)
+
+    def close(self):
+        """Waits for the queued batches to be done and stops the threads."""
+        if not self.closed:
+            self.closed = True
+            self.executor.shutdown()
+            self.queues[0].put(None)
+            for thread in self.threads:
+                thread.join()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+
+default_pipeline = None
+default_pipeline_lock = threading.Lock()
+
+
+def submit(M, rows, cols, values, operation, alpha=1.0, beta=0.0,
+           weights=None):
+    """Pipeline.submit on a shared pipeline with the default settings, which
+    is started on first use."""
+    global default_pipeline
+    with default_pipeline_lock:
+        if default_pipeline is None:
+            default_pipeline = Pipeline()
+    return default_pipeline.submit(M, rows, cols, values, operation, alpha,
+                                   beta, weights)
@@ -3,7 +3,14 @@
 #include <omp.h>
 #include <math.h>
 #include "indexer_c.h"
+#include "operations.h"
 #include "interpolation_search.h"
+#include "learned_index.h"
+#include "lookup_cache.h"
+#include "row_filter.h"
+#include "scatter_add.h"
+#include "arena.h"
+#include "symmetric.h"
 #include "csv.h"
 
 int get_first_occurence(int arr[], int n, int x, int *depth, int search_type) {
@@ -12,6 +19,8 @@ int get_first_occurence(int arr[], int n, int x, int *depth, int search_type) {
     //     search_type:
     //         0: Binary search.
     //         1: Interpolation search.
+    //         2: Joint interpolation and binary search.
+    // The learned search (3) needs to know the row so is in find_offset.
 
     int idx;
     switch (search_type) {
@@ -26,11 +35,15 @@ int get_first_occurence(int arr[], int n, int x, int *depth, int search_type) {
         case 2:
             idx = jointSearch(arr, n, x, depth);
             break;
+
+        default:
+            idx = binarySearch(arr, n, x, depth);
+            break;
     }
 
-    // Handle the case where the idx is not found.
+    // Handle the case where the idx is not found. This is a normal result
+    // (e.g. entries only in a delta buffer) so it is left to the caller.
     if (idx == -1) {
-        printf("\nValue not found in array in get_first_occurence.\n");
         return -1;
     }
 
@@ -54,17 +67,56 @@ int get_first_occurence(int arr[], int n, int x, int *depth, int search_type) {
     }
 }
 
-void process_row(int index_pointer, CS *M, COO *indexer, void (*f)(double *,
-                 double *), int *axis0, int *axis1) {
-    int sparse_pointer = M->indptr[axis0[index_pointer]];
-    // printf("\n\t\t(Index pointer, Sparse pointer): (%d, %d)", index_pointer, sparse_pointer);
+long find_offset(CS *M, int axis0, int axis1, int search_type) {
+    // Find where (axis0, axis1) is stored in M->data, returning -1 if it is
+    // not stored. The learned search (search_type 3) falls back to a binary
+    // search if M has no learned index.
+    int depth;
+    int idx;
+    int start;
+    int n;
+
+    symmetric_canonical(M, &axis0, &axis1);
+    start = M->indptr[axis0];
+    n = M->indptr[axis0+1] - start;
 
-    int new_axis0 = 0;
+    // Most missing entries are rejected without a search.
+    if ((M->filter != NULL) &&
+        !filter_maybe_contains(M->filter, axis0, axis1)) {
+        return -1;
+    }
+
+    if ((search_type == 3) && (M->learned != NULL)) {
+        idx = learned_search(M->learned, axis0, &M->indices[start], n, axis1,
+                             &depth);
+    } else {
+        idx = get_first_occurence(&M->indices[start], n, axis1, &depth,
+                                  search_type);
+    }
+
+    if (idx == -1) {
+        return -1;
+    }
+    return start + idx;
+}
+
+static inline __attribute__((always_inline))
+void process_row(CS *M, VALUES *M_values, int row, int *axis1,
+                 int index_pointer, int index_end, VALUES *values, OP *op,
+                 const int type) {
+    // Merge the indexer entries index_pointer, ..., index_end - 1, which all
+    // lie in `row` (or column) of M and are sorted by axis1, against that row
+    // of M.
+    int sparse_pointer = M->indptr[row];
+    int sparse_end = M->indptr[row + 1];
+    int run_end;
+    int j;
+    // printf("\n\t\t(Index pointer, Sparse pointer): (%d, %d)", index_pointer, sparse_pointer);
 
     // Now choose between incrementing index_pointer and the sparse_pointer based on what values
     // we get.
-    while ((new_axis0 == 0) & 
-           (sparse_pointer < M->indptr[axis0[index_pointer] + 1])) {
+    while ((index_pointer < index_end) &&
+           (sparse_pointer < sparse_end)) {
         /* While both the indexer and M are on the same axis
            We begin by pointing at the top of this axis of
            our vectors and gradually move down them. In the event of 
@@ -75,30 +127,26 @@ void process_row(int index_pointer, CS *M, COO *indexer, void (*f)(double *,
            column vector (only 1 column can appear in 1 row!). */
 
         if (M->indices[sparse_pointer] == axis1[index_pointer]) {
-            // Apply the function to their data
-            (*f)(&(M->data[sparse_pointer]), &(indexer->data[index_pointer]));
-
-            // Only increment the index pointer
-            index_pointer += 1;
-
-            // Check for a new axis in the COO indexer
-            if (index_pointer >= indexer->nnz) {
-                break;
+            // Find the run of indexer values that are the same and apply
+            // them all at once as a segmented reduction, reusing the match
+            // for every value array.
+            run_end = index_pointer + 1;
+            while ((run_end < index_end) &&
+                   (axis1[run_end] == axis1[index_pointer])) {
+                run_end += 1;
             }
-            if (axis0[index_pointer] != axis0[index_pointer-1]) {
-                new_axis0 = 1;
+            for (j=0; j<values->n_data; j++) {
+                apply_segment(type, op,
+                              &(M_values->data[j][(long)sparse_pointer*M_values->stride]),
+                              values->data[j], values->stride,
+                              index_pointer, run_end);
             }
+
+            // Only increment the index pointer
+            index_pointer = run_end;
         } else if (M->indices[sparse_pointer] > axis1[index_pointer]) {
             // Need to increment index pointer
             index_pointer += 1;
-
-            // Check for a new axis in the COO indexer
-            if (index_pointer >= indexer->nnz) {
-                break;
-            }
-            if (axis0[index_pointer] != axis0[index_pointer-1]) {
-                new_axis0 = 1;
-            }
         } else {
             // Need to increment sparse pointer
             sparse_pointer += 1;
@@ -106,24 +154,46 @@ void process_row(int index_pointer, CS *M, COO *indexer, void (*f)(double *,
     }
 }
 
-void compressed_sparse_index_sorted(CS *M, COO *indexer,
-                             void (*f)(double *, double *),
-                             int n_threads) {
+static inline __attribute__((always_inline))
+void index_sorted_loop(CS *M, VALUES *M_values, COO *indexer, VALUES *values,
+                       OP *op, int *axis0, int *axis1, int *row_start,
+                       int total_rows, const int type) {
+    // Each thread processes a whole row (or column) of the indexer at a time
+    // so it owns the entries of M it updates.
+    int i;
+    #pragma omp parallel for
+    for (i=0; i<total_rows; i++) {
+        process_row(M, M_values, axis0[row_start[i]], axis1, row_start[i],
+                    row_start[i+1], values, op, type);
+    }
+}
+
+void compressed_sparse_index_sorted_multi(CS *M, VALUES *M_values,
+                                          COO *indexer, VALUES *values,
+                                          OP *op, int n_threads) {
     /*
     Note we can maybe split the indexer into separate chunks and
     perform our operations in parallel over the chunks.
     Inputs:
         M: A compressed sparse matrix in CSC or CSR form to get/set etc.
+        M_values: Value arrays sharing the sparsity pattern of M.
         index: A sparse matrix in COO form containing index into M.
                If M is CSC it is assumed to be ordered by (row, column) and
                if M is CSR it is assumed to be ordered by (column, row).
-        f: A function taking f(&M->data[x], &index->data[y]) and applies something to them.
+        values: Value arrays of the indexer, one for each of M_values.
+        op: The operation to apply between M_values and values.
+    Repeated values in the indexer are reduced together before being applied
+    so, as each row is handled by a single thread, no atomics are needed.
     */
-    int index_pointer = 0;
-
     int *axis0;
     int *axis1;
 
+    // Mapping the indexer to the stored triangle needs it sorting again.
+    if (M->symmetric != 0) {
+        symmetric_index_sorted(M, M_values, indexer, values, op, n_threads);
+        return;
+    }
+
     // Create view onto rows/cols of the COO matrx to make updates independent of
     // whether M is stored as a CSC or CSR.
     if (M->CSR == 1) {
@@ -153,7 +223,8 @@ void compressed_sparse_index_sorted(CS *M, COO *indexer,
     }
     // printf("\nTotal rows: %d", total_rows);
     // printf("\n");
-    int *row_start = malloc(total_rows*sizeof(int));
+    int *row_start = scratch_get(M->arena, SCRATCH_ROW_START,
+                                 (total_rows + 1)*sizeof(int));
     prev_row = -1;
     total_rows = 0;
     for (i=0; i<indexer->nnz; i++) {
@@ -164,6 +235,7 @@ void compressed_sparse_index_sorted(CS *M, COO *indexer,
             prev_row = axis0[i];
         }
     }
+    row_start[total_rows] = indexer->nnz;
 
 
     // Can parallelise the below for loop.
@@ -171,32 +243,233 @@ void compressed_sparse_index_sorted(CS *M, COO *indexer,
     if (n_threads != -1) {
         omp_set_num_threads(n_threads);
     }
-    #pragma omp parallel for
-    for (i=0; i<total_rows; i++) {
-        process_row(row_start[i], M, indexer, f, axis0, axis1);
+
+    // Dispatch to a loop with the operation compiled into it.
+    switch (op->type) {
+        case OP_GET:
+            index_sorted_loop(M, M_values, indexer, values, op, axis0,
+                              axis1, row_start, total_rows, OP_GET);
+            break;
+        case OP_SET:
+            index_sorted_loop(M, M_values, indexer, values, op, axis0,
+                              axis1, row_start, total_rows, OP_SET);
+            break;
+        case OP_ADD:
+            index_sorted_loop(M, M_values, indexer, values, op, axis0,
+                              axis1, row_start, total_rows, OP_ADD);
+            break;
+        case OP_MUL:
+            index_sorted_loop(M, M_values, indexer, values, op, axis0,
+                              axis1, row_start, total_rows, OP_MUL);
+            break;
+        case OP_MIN:
+            index_sorted_loop(M, M_values, indexer, values, op, axis0,
+                              axis1, row_start, total_rows, OP_MIN);
+            break;
+        case OP_MAX:
+            index_sorted_loop(M, M_values, indexer, values, op, axis0,
+                              axis1, row_start, total_rows, OP_MAX);
+            break;
+        case OP_AXPY_GET:
+            index_sorted_loop(M, M_values, indexer, values, op, axis0,
+                              axis1, row_start, total_rows, OP_AXPY_GET);
+            break;
+        case OP_AXPY_ADD:
+            index_sorted_loop(M, M_values, indexer, values, op, axis0,
+                              axis1, row_start, total_rows, OP_AXPY_ADD);
+            break;
     }
 
 
-    free(row_start);
+    scratch_put(M->arena, SCRATCH_ROW_START, row_start,
+                (total_rows + 1)*sizeof(int));
 }
 
+void compressed_sparse_index_sorted(CS *M, COO *indexer, OP *op,
+                                    int n_threads) {
+    // Apply op between M->data and indexer->data. See
+    // compressed_sparse_index_sorted_multi.
+    VALUES M_values = {&M->data, 1, 1};
+    VALUES values = {&indexer->data, 1, 1};
+    compressed_sparse_index_sorted_multi(M, &M_values, indexer, &values, op,
+                                         n_threads);
+}
 
+static inline __attribute__((always_inline))
+void index_pattern_loop(CS *M, VALUES *M_values, CS *P, VALUES *values,
+                        OP *op, const int type) {
+    // Each row (or column) of P is a sorted list of indices so merge it
+    // directly against the same row of M.
+    int i;
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (i=0; i<P->n_indptr-1; i++) {
+        process_row(M, M_values, i, P->indices, P->indptr[i], P->indptr[i+1],
+                    values, op, type);
+    }
+}
 
-void compressed_sparse_index(CS *M, COO *indexer,
-                             void (*f)(double *, double *), int search_type,
-                             int n_threads) {
+void compressed_sparse_index_pattern(CS *M, CS *P, OP *op, int n_threads) {
+    /*
+    Apply op between M and the entries of another compressed sparse matrix P
+    with the same shape and format, i.e. P acts as the indexer. This avoids
+    converting P to COO and keeps its row structure.
+    Inputs:
+        M: A compressed sparse matrix in CSC or CSR form to get/set etc.
+        P: A compressed sparse matrix in the same form as M with sorted
+           indices. Entries of P that are not stored in M are skipped.
+        op: The operation to apply between M->data and P->data, where
+            op->weights (if used) is indexed like P->data.
+    */
+    VALUES M_values = {&M->data, 1, 1};
+    VALUES values = {&P->data, 1, 1};
+
+    if (n_threads != -1) {
+        omp_set_num_threads(n_threads);
+    }
+
+    // Dispatch to a loop with the operation compiled into it.
+    switch (op->type) {
+        case OP_GET:
+            index_pattern_loop(M, &M_values, P, &values, op, OP_GET);
+            break;
+        case OP_SET:
+            index_pattern_loop(M, &M_values, P, &values, op, OP_SET);
+            break;
+        case OP_ADD:
+            index_pattern_loop(M, &M_values, P, &values, op, OP_ADD);
+            break;
+        case OP_MUL:
+            index_pattern_loop(M, &M_values, P, &values, op, OP_MUL);
+            break;
+        case OP_MIN:
+            index_pattern_loop(M, &M_values, P, &values, op, OP_MIN);
+            break;
+        case OP_MAX:
+            index_pattern_loop(M, &M_values, P, &values, op, OP_MAX);
+            break;
+        case OP_AXPY_GET:
+            index_pattern_loop(M, &M_values, P, &values, op, OP_AXPY_GET);
+            break;
+        case OP_AXPY_ADD:
+            index_pattern_loop(M, &M_values, P, &values, op, OP_AXPY_ADD);
+            break;
+    }
+}
+
+
+static inline long locate_offset(CS *M, int axis0, int axis1,
+                                 int search_type, long *hits, long *misses) {
+    // As find_offset but hot keys are usually in the cache of M (if it has
+    // one), otherwise search and remember where it was found.
+    long offset = -1;
+
+    symmetric_canonical(M, &axis0, &axis1);
+    if (M->cache != NULL) {
+        offset = cache_lookup(M->cache, M, axis0, axis1);
+    }
+    if (offset != -1) {
+        *hits += 1;
+        return offset;
+    }
+
+    offset = find_offset(M, axis0, axis1, search_type);
+    if (M->cache != NULL) {
+        *misses += 1;
+        if (offset != -1) {
+            cache_insert(M->cache, axis0, axis1, offset);
+        }
+    }
+    return offset;
+}
+
+void compressed_sparse_locate(CS *M, COO *indexer, long *offsets,
+                              int search_type, int n_threads) {
+    /*
+    Find where each entry of indexer is stored in M->data without applying
+    any operation.
+    Inputs:
+        M: A compressed sparse matrix in CSC or CSR form.
+        indexer: The entries to find in any order (indexer->data is unused).
+        offsets: Output of size indexer->nnz, set to the offset of each entry
+                 in M->data or -1 if it is not stored.
+    */
+    int *axis0 = M->CSR == 1 ? indexer->row : indexer->col;
+    int *axis1 = M->CSR == 1 ? indexer->col : indexer->row;
+    int index_pointer;
+    long hits = 0;
+    long misses = 0;
+
+    if (n_threads != -1) {
+        omp_set_num_threads(n_threads);
+    }
+
+    #pragma omp parallel for schedule(dynamic, 256) reduction(+:hits, misses)
+    for (index_pointer=0; index_pointer<indexer->nnz; index_pointer++) {
+        offsets[index_pointer] = locate_offset(M, axis0[index_pointer],
+                                               axis1[index_pointer],
+                                               search_type, &hits, &misses);
+    }
+
+    if (M->cache != NULL) {
+        M->cache->hits += hits;
+        M->cache->misses += misses;
+    }
+}
+
+static inline __attribute__((always_inline))
+void index_loop(CS *M, VALUES *M_values, COO *indexer, VALUES *values,
+                OP *op, int *axis0, int *axis1, int search_type,
+                const int type) {
+    int index_pointer;
+    long hits = 0;
+    long misses = 0;
+
+    #pragma omp parallel for schedule(dynamic) shared(M, indexer) \
+        reduction(+:hits, misses)
+    for (index_pointer=0; index_pointer<indexer->nnz; index_pointer++) {
+        // If we can guarantee all values in indexer exist in M then we can
+        // use our binary search for the current column value
+        //     axis1[index_pointer].
+        int j;
+        long offset = locate_offset(M, axis0[index_pointer],
+                                    axis1[index_pointer], search_type,
+                                    &hits, &misses);
+
+        // Skip values that are not in M rather than applying at start - 1.
+        if (offset == -1) {
+            continue;
+        }
+
+        // Now apply our operation at the correct index of every array.
+        for (j=0; j<values->n_data; j++) {
+            apply_entry(type, op, &(M_values->data[j][offset*M_values->stride]),
+                        &(values->data[j][(long)index_pointer*values->stride]),
+                        index_pointer);
+        }
+    }
+
+    if (M->cache != NULL) {
+        M->cache->hits += hits;
+        M->cache->misses += misses;
+    }
+}
+
+void compressed_sparse_index_multi(CS *M, VALUES *M_values, COO *indexer,
+                                   VALUES *values, OP *op, int search_type,
+                                   int n_threads) {
     /*
     Note we can maybe split the indexer into separate chunks and
     perform our operations in parallel over the chunks.
     Inputs:
         M: A compressed sparse matrix in CSC or CSR form to get/set etc.
+        M_values: Value arrays sharing the sparsity pattern of M.
         index: A sparse matrix in COO form containing index into M.
                If M is CSC it is assumed to be ordered by (row, column) and
                if M is CSR it is assumed to be ordered by (column, row).
-        f: A function taking f(&M->data[x], &index->data[y]) and applies something to them.
+        values: Value arrays of the indexer, one for each of M_values.
+        op: The operation to apply between M_values and values.
+    Each entry is only searched for once and then applied to every array.
     */
-    int index_pointer = 0;
-
     int *axis0;
     int *axis1;
 
@@ -216,53 +489,228 @@ void compressed_sparse_index(CS *M, COO *indexer,
         omp_set_num_threads(n_threads);
     }
 
-    #pragma omp parallel for schedule(dynamic) shared(M, indexer)
-    for (index_pointer=0; index_pointer<indexer->nnz; index_pointer++) {
-        // If we can guarantee all values in indexer exist in M then we can
-        // use our binary search for the current column value
-        //     axis1[index_pointer].
-        int idx;
-        int depth;
-        int start;
-        int n;
-        int x;
-
-        start = M->indptr[axis0[index_pointer]];
-        n = M->indptr[axis0[index_pointer]+1] - start;
-        x = axis1[index_pointer];
-        idx = get_first_occurence(&M->indices[start], n, x, &depth, search_type);
+    // Adds into a single array are bucketed by offset so they need no
+    // atomics and can be vectorised.
+    if (((op->type == OP_ADD) || (op->type == OP_AXPY_ADD)) &&
+        (values->n_data == 1) && (M_values->stride == 1) &&
+        (values->stride == 1)) {
+        compressed_sparse_add_scatter(M, M_values->data[0], indexer,
+                                      values->data[0], op, search_type,
+                                      n_threads);
+        return;
+    }
 
-        // Now apply our function at the correct index.
-        (*f)(&(M->data[start+idx]), &(indexer->data[index_pointer]));
-        // indexer->data[index_pointer] = M->data[start+idx];
+    // Dispatch to a loop with the operation compiled into it.
+    switch (op->type) {
+        case OP_GET:
+            index_loop(M, M_values, indexer, values, op, axis0, axis1,
+                       search_type, OP_GET);
+            break;
+        case OP_SET:
+            index_loop(M, M_values, indexer, values, op, axis0, axis1,
+                       search_type, OP_SET);
+            break;
+        case OP_ADD:
+            index_loop(M, M_values, indexer, values, op, axis0, axis1,
+                       search_type, OP_ADD);
+            break;
+        case OP_MUL:
+            index_loop(M, M_values, indexer, values, op, axis0, axis1,
+                       search_type, OP_MUL);
+            break;
+        case OP_MIN:
+            index_loop(M, M_values, indexer, values, op, axis0, axis1,
+                       search_type, OP_MIN);
+            break;
+        case OP_MAX:
+            index_loop(M, M_values, indexer, values, op, axis0, axis1,
+                       search_type, OP_MAX);
+            break;
+        case OP_AXPY_GET:
+            index_loop(M, M_values, indexer, values, op, axis0, axis1,
+                       search_type, OP_AXPY_GET);
+            break;
+        case OP_AXPY_ADD:
+            index_loop(M, M_values, indexer, values, op, axis0, axis1,
+                       search_type, OP_AXPY_ADD);
+            break;
     }
 }
 
-void get(double *x, double *y) {
-    // Copy x value into y
-    double temp;
-    #pragma omp atomic read
-    temp = *x;
+void compressed_sparse_index(CS *M, COO *indexer, OP *op, int search_type,
+                             int n_threads) {
+    // Apply op between M->data and indexer->data. See
+    // compressed_sparse_index_multi.
+    VALUES M_values = {&M->data, 1, 1};
+    VALUES values = {&indexer->data, 1, 1};
+    compressed_sparse_index_multi(M, &M_values, indexer, &values, op,
+                                  search_type, n_threads);
+}
 
-    #pragma omp atomic write
-    *y = temp;
+// Indexer entries (or rows of the sorted search) handed to a thread at a
+// time when indexing many matrices. Small enough to balance matrices of very
+// different sizes.
+#define BATCHED_CHUNK 64
+
+static inline int batched_axes(CS *M, int n_matrices, COO *indexer,
+                               int *matrix, int i, int *axis0, int *axis1) {
+    // Get the axes of indexer entry i in its own matrix, returning 0 if the
+    // matrix does not exist or the entry lies outside it.
+    CS *A;
+    if ((matrix[i] < 0) || (matrix[i] >= n_matrices)) {
+        return 0;
+    }
+    A = &M[matrix[i]];
+    *axis0 = A->CSR == 1 ? indexer->row[i] : indexer->col[i];
+    *axis1 = A->CSR == 1 ? indexer->col[i] : indexer->row[i];
+    return (*axis0 >= 0) && (*axis0 < A->n_indptr - 1);
 }
 
-void set(double *x, double *y) {
-    // Copy y value into x
-    // Note that sometimes the same entry gets multiple copies
-    double temp;
-    #pragma omp atomic read
-    temp = *y;
+static inline int batched_group_starts(CS *M, int n_matrices, COO *indexer,
+                                       int *matrix, int i) {
+    // Whether indexer entry i starts a new row (or column) of its matrix,
+    // for the sorted search.
+    int *axis0;
+    if ((i == 0) || (matrix[i] != matrix[i-1])) {
+        return 1;
+    }
+    if ((matrix[i] < 0) || (matrix[i] >= n_matrices)) {
+        return 0;
+    }
+    axis0 = M[matrix[i]].CSR == 1 ? indexer->row : indexer->col;
+    return axis0[i] != axis0[i-1];
+}
 
-    #pragma omp atomic write
-    *x = temp;
+static inline __attribute__((always_inline))
+void index_batched_loop(CS *M, int n_matrices, COO *indexer, int *matrix,
+                        OP *op, int search_type, int *group_start,
+                        int total_groups, const int type) {
+    // With the sorted search each thread merges a whole row (or column) of
+    // one matrix at a time, otherwise it searches for single entries. Either
+    // way the work is spread over every matrix at once.
+    int i;
+    if (search_type == -1) {
+        #pragma omp parallel for schedule(dynamic, BATCHED_CHUNK)
+        for (i=0; i<total_groups; i++) {
+            int axis0, axis1;
+            int start = group_start[i];
+            if (batched_axes(M, n_matrices, indexer, matrix, start, &axis0,
+                             &axis1)) {
+                CS *A = &M[matrix[start]];
+                VALUES M_values = {&A->data, 1, 1};
+                VALUES values = {&indexer->data, 1, 1};
+                process_row(A, &M_values, axis0,
+                            A->CSR == 1 ? indexer->col : indexer->row,
+                            start, group_start[i+1], &values, op, type);
+            }
+        }
+    } else {
+        #pragma omp parallel for schedule(dynamic, BATCHED_CHUNK)
+        for (i=0; i<indexer->nnz; i++) {
+            int axis0, axis1;
+            long offset;
+            if (!batched_axes(M, n_matrices, indexer, matrix, i, &axis0,
+                              &axis1)) {
+                continue;
+            }
+            offset = find_offset(&M[matrix[i]], axis0, axis1, search_type);
+            if (offset != -1) {
+                apply_entry(type, op, &(M[matrix[i]].data[offset]),
+                            &(indexer->data[i]), i);
+            }
+        }
+    }
 }
 
-void add(double *x, double *y) {
-    // Add x value into y
-    #pragma omp atomic
-    *x += *y;
+void compressed_sparse_index_batched(CS *M, int n_matrices, COO *indexer,
+                                     int *matrix, OP *op, int search_type,
+                                     int n_threads) {
+    /*
+    Apply op between many compressed sparse matrices and one indexer in a
+    single parallel region, rather than one call (and region) per matrix.
+    Inputs:
+        M: The n_matrices matrices, each in CSC or CSR form.
+        indexer: The entries to apply op to, where entry i is in matrix
+                 matrix[i]. Entries of matrices that do not exist, or that
+                 lie outside their matrix, are skipped.
+        matrix: The matrix of each entry of the indexer.
+        op: The operation to apply between the matrices and indexer->data.
+        search_type: As for compressed_sparse_index, or -1 for the sorted
+                     search where the indexer must be ordered by matrix
+                     and then as for compressed_sparse_index_sorted.
+    */
+    int i;
+    int total_groups = 0;
+    int *group_start = NULL;
+
+    if (search_type == -1) {
+        // Get where each row (or column) of each matrix starts in indexer,
+        // first counting them.
+        for (i=0; i<indexer->nnz; i++) {
+            if (batched_group_starts(M, n_matrices, indexer, matrix, i)) {
+                total_groups += 1;
+            }
+        }
+        group_start = malloc((total_groups + 1)*sizeof(int));
+        total_groups = 0;
+        for (i=0; i<indexer->nnz; i++) {
+            if (batched_group_starts(M, n_matrices, indexer, matrix, i)) {
+                group_start[total_groups] = i;
+                total_groups += 1;
+            }
+        }
+        group_start[total_groups] = indexer->nnz;
+    }
+
+    if (n_threads != -1) {
+        omp_set_num_threads(n_threads);
+    }
+
+    // Dispatch to a loop with the operation compiled into it.
+    switch (op->type) {
+        case OP_GET:
+            index_batched_loop(M, n_matrices, indexer, matrix, op,
+                               search_type, group_start, total_groups,
+                               OP_GET);
+            break;
+        case OP_SET:
+            index_batched_loop(M, n_matrices, indexer, matrix, op,
+                               search_type, group_start, total_groups,
+                               OP_SET);
+            break;
+        case OP_ADD:
+            index_batched_loop(M, n_matrices, indexer, matrix, op,
+                               search_type, group_start, total_groups,
+                               OP_ADD);
+            break;
+        case OP_MUL:
+            index_batched_loop(M, n_matrices, indexer, matrix, op,
+                               search_type, group_start, total_groups,
+                               OP_MUL);
+            break;
+        case OP_MIN:
+            index_batched_loop(M, n_matrices, indexer, matrix, op,
+                               search_type, group_start, total_groups,
+                               OP_MIN);
+            break;
+        case OP_MAX:
+            index_batched_loop(M, n_matrices, indexer, matrix, op,
+                               search_type, group_start, total_groups,
+                               OP_MAX);
+            break;
+        case OP_AXPY_GET:
+            index_batched_loop(M, n_matrices, indexer, matrix, op,
+                               search_type, group_start, total_groups,
+                               OP_AXPY_GET);
+            break;
+        case OP_AXPY_ADD:
+            index_batched_loop(M, n_matrices, indexer, matrix, op,
+                               search_type, group_start, total_groups,
+                               OP_AXPY_ADD);
+            break;
+    }
+
+    free(group_start);
 }
 
 int example_get() {
@@ -279,6 +727,11 @@ int example_get() {
     CS M;
     M.CSR = 1;
     M.n_indptr = 6;
+    M.learned = NULL;
+    M.cache = NULL;
+    M.filter = NULL;
+    M.arena = NULL;
+    M.symmetric = 0;
 
     M.indptr  = malloc(6*sizeof(int));
     M.indices = malloc(6*sizeof(int));
@@ -322,8 +775,9 @@ int example_get() {
     indexer.row[5] = 4; indexer.col[5] = 1;
     indexer.row[6] = 4; indexer.col[6] = 1;
 
-    compressed_sparse_index_sorted(&M, &indexer, get, n_threads);
-    compressed_sparse_index(&M, &indexer, get, search_type, n_threads);
+    OP op = {OP_GET, 1, 0, NULL};
+    compressed_sparse_index_sorted(&M, &indexer, &op, n_threads);
+    compressed_sparse_index(&M, &indexer, &op, search_type, n_threads);
 
     for (i=0; i<7; i++) {
         printf("\nindexer.data[%d] = %g", i, indexer.data[i]);
@@ -351,6 +805,11 @@ int example_add() {
     CS M;
     M.CSR = 1;
     M.n_indptr = 4;
+    M.learned = NULL;
+    M.cache = NULL;
+    M.filter = NULL;
+    M.arena = NULL;
+    M.symmetric = 0;
 
     M.indptr  = malloc(4*sizeof(int));
     M.indices = malloc(9*sizeof(int));
@@ -383,8 +842,9 @@ int example_add() {
     indexer.row[0] = 1; indexer.col[0] = 2; indexer.data[0] = 0.5;
     indexer.row[1] = 2; indexer.col[1] = 2; indexer.data[1] = 1.5;
 
-    compressed_sparse_index_sorted(&M, &indexer, add, n_threads);
-    compressed_sparse_index(&M, &indexer, add, search_type, n_threads);
+    OP op = {OP_ADD, 1, 0, NULL};
+    compressed_sparse_index_sorted(&M, &indexer, &op, n_threads);
+    compressed_sparse_index(&M, &indexer, &op, search_type, n_threads);
 
     for (i=0; i<9; i++) {
         printf("\nM.data[%d] = %g", i, M.data[i]);
@@ -449,6 +909,11 @@ int python_debugger() {
     // CSR object.
     CS M;
     M.CSR = 1;
+    M.learned = NULL;
+    M.cache = NULL;
+    M.filter = NULL;
+    M.arena = NULL;
+    M.symmetric = 0;
 
     //     indptr
     strcpy(fname, "tests/data/indptr.csv");
@@ -484,7 +949,8 @@ int python_debugger() {
     M.data = arr;
 
     // Run the program.
-    compressed_sparse_index(&M, &indexer, get, 2, n_threads);
+    OP op = {OP_GET, 1, 0, NULL};
+    compressed_sparse_index(&M, &indexer, &op, 2, n_threads);
 
     // Free indexer.
     free(indexer.row);
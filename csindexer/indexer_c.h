@@ -1,6 +1,11 @@
 #ifndef CSINDEXER_INDEXER_C_H_
 #define CSINDEXER_INDEXER_C_H_
 
+struct LEARNED;
+struct CACHE;
+struct FILTER;
+struct ARENA;
+
 typedef struct {
     // A compressed sparse matrix (can be CSR or CSC)
     int CSR;  // Whether sparse matrix is CSR (otherwise we assume it is CSC)
@@ -8,6 +13,13 @@ typedef struct {
     int *indices;
     double *data;
     int n_indptr;  // Length of indptr vector
+    struct LEARNED *learned;  // Learned index for search_type 3 (or NULL)
+    struct CACHE *cache;      // Cache of searched offsets (or NULL)
+    struct FILTER *filter;    // Filters rejecting missing indices (or NULL)
+    struct ARENA *arena;      // Where temporaries are kept (or NULL)
+    int symmetric;            // 1 if only axis0 <= axis1 is stored of a
+                              // symmetric matrix, -1 if only axis0 >= axis1
+                              // is and otherwise 0
 } CS;
 
 typedef struct {
@@ -18,13 +30,55 @@ typedef struct {
     int nnz;
 } COO;
 
-void compressed_sparse_index_sorted(CS *M, COO *indexer, void (*f)(double *, double *),
-                             int n_threads);
-void compressed_sparse_index(CS *M, COO *indexer,
-                             void (*f)(double *, double *),
-                             int search_type, int n_threads);
+// The operations that can be applied between an entry x of M and an entry y
+// of the indexer.
+enum {
+    OP_GET,       // y = x
+    OP_SET,       // x = y
+    OP_ADD,       // x += y
+    OP_MUL,       // x *= y
+    OP_MIN,       // x = min(x, y)
+    OP_MAX,       // x = max(x, y)
+    OP_AXPY_GET,  // y = alpha*x + beta*y
+    OP_AXPY_ADD   // x += alpha*y
+};
+
+typedef struct {
+    // An operation to apply between M and an indexer
+    int type;         // One of the OP_* values
+    double alpha;     // Weight of the axpy operations
+    double beta;      // Scale of the existing indexer value in OP_AXPY_GET
+    double *weights;  // Per-entry weights used instead of alpha (or NULL)
+} OP;
 
-void get(double *x, double *y);
-void add(double *x, double *y);
+typedef struct {
+    // Several value arrays sharing one sparsity pattern. Value j of entry k
+    // is data[j][k*stride] so both separate arrays (stride 1) and an
+    // interleaved block of n_data values per entry (stride n_data) are
+    // supported.
+    double **data;
+    int n_data;
+    int stride;
+} VALUES;
+
+int get_first_occurence(int arr[], int n, int x, int *depth, int search_type);
+long find_offset(CS *M, int axis0, int axis1, int search_type);
+void compressed_sparse_locate(CS *M, COO *indexer, long *offsets,
+                              int search_type, int n_threads);
+
+void compressed_sparse_index_sorted(CS *M, COO *indexer, OP *op,
+                                    int n_threads);
+void compressed_sparse_index(CS *M, COO *indexer, OP *op, int search_type,
+                             int n_threads);
+void compressed_sparse_index_sorted_multi(CS *M, VALUES *M_values,
+                                          COO *indexer, VALUES *values,
+                                          OP *op, int n_threads);
+void compressed_sparse_index_multi(CS *M, VALUES *M_values, COO *indexer,
+                                   VALUES *values, OP *op, int search_type,
+                                   int n_threads);
+void compressed_sparse_index_pattern(CS *M, CS *P, OP *op, int n_threads);
+void compressed_sparse_index_batched(CS *M, int n_matrices, COO *indexer,
+                                     int *matrix, OP *op, int search_type,
+                                     int n_threads);
 
 #endif  // CSINDEXER_INDEXER_C_H_
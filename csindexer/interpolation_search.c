@@ -86,6 +86,58 @@ int binarySearch(int arr[], int n, int x, int *depth) {
     return -1;
 }
 
+// Lower bound variant of the binary search above. Returns the index of the
+// first value in arr[0..n-1] that is greater than or equal to x, or n if
+// every value is smaller than x.
+int lowerBound(int arr[], int n, int x, int *depth) {
+    int lo = 0;
+    int hi = n;
+
+    *depth = 0;
+    while (lo < hi)
+    {
+        *depth += 1;
+
+        // Get middle index.
+        int pos = lo + (hi-lo)/2;
+
+        // Everything up to and including pos is too small.
+        if (arr[pos] < x)
+            lo = pos + 1;
+
+        // Otherwise pos is a candidate so keep it in range.
+        else
+            hi = pos;
+    }
+    return lo;
+}
+
+// Upper bound variant of the binary search above. Returns the index of the
+// first value in arr[0..n-1] that is strictly greater than x, or n if no
+// value is greater than x.
+int upperBound(int arr[], int n, int x, int *depth) {
+    int lo = 0;
+    int hi = n;
+
+    *depth = 0;
+    while (lo < hi)
+    {
+        *depth += 1;
+
+        // Get middle index.
+        int pos = lo + (hi-lo)/2;
+
+        // Everything up to and including pos is too small or equal.
+        if (arr[pos] <= x)
+            lo = pos + 1;
+
+        // Otherwise pos is a candidate so keep it in range.
+        else
+            hi = pos;
+    }
+    return lo;
+}
+
 // C program to implement joint interpolation and binary search.
 // If x is present in arr[0..n-1], then returns
 // index of it, else returns -1.
@@ -3,4 +3,6 @@
 int interpolationSearch(int arr[], int n, int x, int *depth);
 int binarySearch(int arr[], int n, int x, int *depth);
 int jointSearch(int arr[], int n, int x, int *depth);
+int lowerBound(int arr[], int n, int x, int *depth);
+int upperBound(int arr[], int n, int x, int *depth);
 #endif
@@ -0,0 +1,179 @@
+#include <stdlib.h>
+#include <math.h>
+#include <omp.h>
+#include "learned_index.h"
+#include "arena.h"
+#include "interpolation_search.h"
+
+static int fit_segments(int arr[], int n, int error, int *key, int *pos,
+                        double *slope) {
+    /*
+    Greedily cover arr[0..n-1] with as few linear segments as possible such
+    that every position is predicted within `error`. Each segment keeps the
+    range of slopes that satisfy all of its points so far (a shrinking cone)
+    and ends when that range becomes empty. If key is NULL the segments are
+    only counted. Returns the total segments.
+    */
+    int total = 0;
+    int start = 0;
+    int i;
+
+    while (start < n) {
+        // The cone is unbounded until a second distinct index is seen. This
+        // is tracked explicitly as -Ofast assumes there are no infinities.
+        int bounded = 0;
+        double lo = 0;
+        double hi = 0;
+        int k0 = arr[start];
+
+        for (i=start+1; i<n; i++) {
+            double dk = (double)arr[i] - k0;
+            double dp = i - start;
+            if (dk == 0) {
+                // Repeated indices can only be covered while the error
+                // allows it.
+                if (dp > error) break;
+                continue;
+            }
+            double seg_lo = (dp - error)/dk;
+            double seg_hi = (dp + error)/dk;
+            if (!bounded) {
+                lo = seg_lo;
+                hi = seg_hi;
+                bounded = 1;
+                continue;
+            }
+            if ((seg_lo > hi) || (seg_hi < lo)) {
+                break;
+            }
+            lo = seg_lo > lo ? seg_lo : lo;
+            hi = seg_hi < hi ? seg_hi : hi;
+        }
+
+        if (key != NULL) {
+            key[total] = k0;
+            pos[total] = start;
+            slope[total] = (lo + hi)/2;
+        }
+        total += 1;
+        start = i;
+    }
+
+    return total;
+}
+
+void learned_build(LEARNED *L, CS *M, int error, int min_length,
+                   int n_threads) {
+    /*
+    Build a learned index over the indices of M, which must be sorted within
+    each row (or column).
+    Inputs:
+        L: The learned index to build. Free it with learned_free.
+        M: A compressed sparse matrix in CSC or CSR form.
+        error: The largest distance of a prediction from the true position,
+               which bounds the final search.
+        min_length: Rows shorter than this are binary searched instead.
+    */
+    int i;
+    int n_rows = M->n_indptr - 1;
+    int *row_count = malloc(n_rows*sizeof(int));
+
+    L->n_indptr = M->n_indptr;
+    L->error = error;
+    L->min_length = min_length;
+    L->row_segment = malloc(M->n_indptr*sizeof(int));
+
+    if (n_threads != -1) {
+        omp_set_num_threads(n_threads);
+    }
+
+    // First count the segments of each row.
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (i=0; i<n_rows; i++) {
+        int start = M->indptr[i];
+        int n = M->indptr[i+1] - start;
+        row_count[i] = 0;
+        if (n >= min_length) {
+            row_count[i] = fit_segments(&M->indices[start], n, error, NULL,
+                                        NULL, NULL);
+        }
+    }
+
+    L->row_segment[0] = 0;
+    for (i=0; i<n_rows; i++) {
+        L->row_segment[i+1] = L->row_segment[i] + row_count[i];
+    }
+    L->key = malloc(L->row_segment[n_rows]*sizeof(int));
+    L->pos = malloc(L->row_segment[n_rows]*sizeof(int));
+    L->slope = malloc(L->row_segment[n_rows]*sizeof(double));
+    huge_advise(L->key, L->row_segment[n_rows]*sizeof(int));
+    huge_advise(L->pos, L->row_segment[n_rows]*sizeof(int));
+    huge_advise(L->slope, L->row_segment[n_rows]*sizeof(double));
+
+    // Then fit them.
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (i=0; i<n_rows; i++) {
+        int s = L->row_segment[i];
+        int start = M->indptr[i];
+        if (row_count[i] > 0) {
+            fit_segments(&M->indices[start], M->indptr[i+1] - start, error,
+                         &L->key[s], &L->pos[s], &L->slope[s]);
+        }
+    }
+
+    free(row_count);
+}
+
+void learned_free(LEARNED *L) {
+    free(L->row_segment);
+    free(L->key);
+    free(L->pos);
+    free(L->slope);
+}
+
+long learned_nbytes(LEARNED *L) {
+    // Total memory used by the models.
+    long n_segments = L->row_segment[L->n_indptr - 1];
+    return L->n_indptr*sizeof(int)
+           + n_segments*(2*sizeof(int) + sizeof(double));
+}
+
+int learned_search(LEARNED *L, int row, int arr[], int n, int x, int *depth) {
+    // Find the first occurence of x in arr[0..n-1], which is `row` of the
+    // matrix the index was built from, returning -1 if it is not there. The
+    // model of the row predicts the position and then only the error window
+    // around it is binary searched.
+    int s0 = L->row_segment[row];
+    int n_segments = L->row_segment[row+1] - s0;
+    int s, lo, hi, idx;
+    double predicted;
+
+    if (n_segments == 0) {
+        // No model for short rows.
+        return binarySearch(arr, n, x, depth);
+    }
+
+    // The segment covering x is the last starting at or before it.
+    s = upperBound(&L->key[s0], n_segments, x, depth) - 1;
+    if (s < 0) {
+        return -1;
+    }
+    s += s0;
+
+    // One extra either side covers any rounding in the prediction.
+    predicted = L->pos[s] + L->slope[s]*((double)x - L->key[s]);
+    predicted = predicted > n ? n : (predicted < 0 ? 0 : predicted);
+    lo = (int)floor(predicted) - L->error - 1;
+    hi = (int)ceil(predicted) + L->error + 2;
+    lo = lo < 0 ? 0 : lo;
+    hi = hi > n ? n : hi;
+    if (lo >= hi) {
+        return -1;
+    }
+
+    idx = lo + lowerBound(&arr[lo], hi - lo, x, depth);
+    if ((idx < hi) && (arr[idx] == x)) {
+        return idx;
+    }
+    return -1;
+}
@@ -0,0 +1,27 @@
+#ifndef CSINDEXER_LEARNED_INDEX_H_
+#define CSINDEXER_LEARNED_INDEX_H_
+
+#include "indexer_c.h"
+
+typedef struct LEARNED {
+    // Error bounded piecewise linear models of the indices of each long row
+    // (or column). Segment s predicts the position in its row of an index
+    // x >= key[s] as
+    //     pos[s] + slope[s]*(x - key[s])
+    // which is never more than `error` away from the true position.
+    int n_indptr;      // Length of indptr of the matrix
+    int error;         // Largest distance of a prediction from the truth
+    int min_length;    // Rows shorter than this have no model
+    int *row_segment;  // First segment of each row, size n_indptr
+    int *key;          // First index covered by each segment
+    int *pos;          // Position of key relative to the start of its row
+    double *slope;     // Change in position per index of each segment
+} LEARNED;
+
+void learned_build(LEARNED *L, CS *M, int error, int min_length,
+                   int n_threads);
+void learned_free(LEARNED *L);
+long learned_nbytes(LEARNED *L);
+int learned_search(LEARNED *L, int row, int arr[], int n, int x, int *depth);
+
+#endif  // CSINDEXER_LEARNED_INDEX_H_
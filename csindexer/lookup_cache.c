@@ -0,0 +1,31 @@
+#include <stdlib.h>
+#include <string.h>
+#include "lookup_cache.h"
+
+void cache_init(CACHE *C, long capacity) {
+    // Allocate an empty cache of at least `capacity` slots (and at least one
+    // set), rounded up to a power of 2 sets.
+    C->n_sets = 1;
+    while (C->n_sets*CACHE_WAYS < capacity) {
+        C->n_sets *= 2;
+    }
+    C->slots = calloc(C->n_sets*CACHE_WAYS, sizeof(uint64_t));
+    C->hits = 0;
+    C->misses = 0;
+}
+
+void cache_free(CACHE *C) {
+    free(C->slots);
+}
+
+void cache_clear(CACHE *C) {
+    // Empty the cache, for example after the structure of M changes, and
+    // reset the counters.
+    memset(C->slots, 0, C->n_sets*CACHE_WAYS*sizeof(uint64_t));
+    C->hits = 0;
+    C->misses = 0;
+}
+
+long cache_nbytes(CACHE *C) {
+    return C->n_sets*CACHE_WAYS*sizeof(uint64_t);
+}
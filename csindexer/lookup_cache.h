@@ -0,0 +1,97 @@
+/* A bounded cache from (axis0, axis1) keys to where they are stored in the
+ * data of a compressed sparse matrix, for query streams where a few keys make
+ * up most lookups. The lookups and inserts are static inline so they are
+ * compiled into the indexing loops. */
+#ifndef CSINDEXER_LOOKUP_CACHE_H_
+#define CSINDEXER_LOOKUP_CACHE_H_
+
+#include <stdint.h>
+#include "indexer_c.h"
+
+// Total slots in each set of the cache, which fill one 32 byte line.
+#define CACHE_WAYS 4
+
+typedef struct CACHE {
+    // A set associative table with CACHE_WAYS slots per set. A slot packs
+    //     offset << 32 | tag << 1 | referenced
+    // into a single word so it is always read and written whole, where tag
+    // is a hash of the key (never 0 so 0 is an empty slot). Slots are only
+    // hints as every hit is checked against indptr and indices, so racing
+    // threads, tag collisions and structure changes can never return a wrong
+    // offset.
+    long n_sets;      // Total sets, a power of 2
+    uint64_t *slots;  // Size n_sets*CACHE_WAYS
+    long hits;        // Lookups found in the cache
+    long misses;      // Lookups that had to search M
+} CACHE;
+
+void cache_init(CACHE *C, long capacity);
+void cache_free(CACHE *C);
+void cache_clear(CACHE *C);
+long cache_nbytes(CACHE *C);
+
+static inline uint64_t cache_hash(int axis0, int axis1) {
+    // Mix both halves of the key into every bit of the hash.
+    uint64_t h = ((uint64_t)(uint32_t)axis0 << 32) | (uint32_t)axis1;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline uint32_t cache_tag(uint64_t h) {
+    // The top 31 bits of the hash, shifted above the referenced bit.
+    return ((uint32_t)(h >> 33) << 1) | 2;
+}
+
+static inline long cache_lookup(CACHE *C, CS *M, int axis0, int axis1) {
+    // Return the offset of (axis0, axis1) in M->data if it is cached, or -1.
+    uint64_t h = cache_hash(axis0, axis1);
+    uint32_t tag = cache_tag(h);
+    uint64_t *set = &C->slots[(h & (C->n_sets - 1))*CACHE_WAYS];
+    int w;
+
+    for (w=0; w<CACHE_WAYS; w++) {
+        uint64_t slot = __atomic_load_n(&set[w], __ATOMIC_RELAXED);
+        if (((uint32_t)slot & ~1u) == tag) {
+            long offset = (long)(slot >> 32);
+            if ((offset >= M->indptr[axis0]) &&
+                (offset < M->indptr[axis0+1]) &&
+                (M->indices[offset] == axis1)) {
+                // Only write the referenced bit if it is not already set so
+                // hot keys stay read only.
+                if (!(slot & 1)) {
+                    __atomic_store_n(&set[w], slot | 1, __ATOMIC_RELAXED);
+                }
+                return offset;
+            }
+        }
+    }
+    return -1;
+}
+
+static inline void cache_insert(CACHE *C, int axis0, int axis1, long offset) {
+    // Cache the offset of (axis0, axis1), evicting with a CLOCK sweep over
+    // the set: the first slot not referenced since the last sweep is
+    // replaced and the referenced bits passed over are cleared.
+    uint64_t h = cache_hash(axis0, axis1);
+    uint64_t *set = &C->slots[(h & (C->n_sets - 1))*CACHE_WAYS];
+    uint64_t slot = ((uint64_t)offset << 32) | cache_tag(h);
+    int w;
+
+    for (w=0; w<CACHE_WAYS; w++) {
+        uint64_t old = __atomic_load_n(&set[w], __ATOMIC_RELAXED);
+        if (!(old & 1)) {
+            __atomic_store_n(&set[w], slot, __ATOMIC_RELAXED);
+            return;
+        }
+        __atomic_store_n(&set[w], old & ~(uint64_t)1, __ATOMIC_RELAXED);
+    }
+
+    // Every slot was referenced so replace the first.
+    __atomic_store_n(&set[0], slot, __ATOMIC_RELAXED);
+}
+
+#endif  // CSINDEXER_LOOKUP_CACHE_H_
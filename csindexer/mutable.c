@@ -0,0 +1,346 @@
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+#include "mutable.h"
+#include "operations.h"
+#include "interpolation_search.h"
+
+// Initial capacity of a delta buffer when its first entry is inserted.
+#define DELTA_MIN_CAPACITY 4
+
+typedef struct {
+    // An entry of an insert batch, sorted by (axis0, axis1, pos) so that
+    // repeated entries are applied in the order they were given.
+    int axis0;
+    int axis1;
+    int pos;
+} INSERT_ENTRY;
+
+static int compare_insert_entry(const void *a, const void *b) {
+    const INSERT_ENTRY *x = a;
+    const INSERT_ENTRY *y = b;
+    if (x->axis0 != y->axis0) return x->axis0 < y->axis0 ? -1 : 1;
+    if (x->axis1 != y->axis1) return x->axis1 < y->axis1 ? -1 : 1;
+    return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+void mutable_init(MCS *A, CS *M, long threshold) {
+    /*
+    Build a mutable matrix from a copy of M.
+    Inputs:
+        A: The mutable matrix to initialise. Free it with mutable_free.
+        M: A compressed sparse matrix in CSC or CSR form with sorted indices.
+        threshold: Compact once the delta buffers hold more entries than this.
+    */
+    int n_rows = M->n_indptr - 1;
+    int nnz = M->indptr[n_rows];
+
+    memset(&A->base, 0, sizeof(CS));
+    A->base.CSR = M->CSR;
+    A->base.n_indptr = M->n_indptr;
+    A->base.indptr = malloc(M->n_indptr*sizeof(int));
+    A->base.indices = malloc(nnz*sizeof(int));
+    A->base.data = malloc(nnz*sizeof(double));
+    memcpy(A->base.indptr, M->indptr, M->n_indptr*sizeof(int));
+    memcpy(A->base.indices, M->indices, nnz*sizeof(int));
+    memcpy(A->base.data, M->data, nnz*sizeof(double));
+
+    A->delta_len = calloc(n_rows, sizeof(int));
+    A->delta_cap = calloc(n_rows, sizeof(int));
+    A->delta_indices = calloc(n_rows, sizeof(int *));
+    A->delta_data = calloc(n_rows, sizeof(double *));
+    A->n_delta = 0;
+    A->threshold = threshold;
+}
+
+static void mutable_free_deltas(MCS *A) {
+    int i;
+    for (i=0; i<A->base.n_indptr-1; i++) {
+        free(A->delta_indices[i]);
+        free(A->delta_data[i]);
+        A->delta_indices[i] = NULL;
+        A->delta_data[i] = NULL;
+        A->delta_len[i] = 0;
+        A->delta_cap[i] = 0;
+    }
+    A->n_delta = 0;
+}
+
+void mutable_free(MCS *A) {
+    mutable_free_deltas(A);
+    free(A->delta_len);
+    free(A->delta_cap);
+    free(A->delta_indices);
+    free(A->delta_data);
+    free(A->base.indptr);
+    free(A->base.indices);
+    free(A->base.data);
+}
+
+static inline double *mutable_find(MCS *A, int axis0, int axis1,
+                                   int search_type) {
+    // Find the value of (axis0, axis1) in either the base matrix or the delta
+    // buffer of the row, returning NULL if it is in neither.
+    int depth;
+    int idx;
+    long offset = find_offset(&A->base, axis0, axis1, search_type);
+    if (offset != -1) {
+        return &(A->base.data[offset]);
+    }
+
+    // Delta buffers are small so a binary search is always used.
+    idx = binarySearch(A->delta_indices[axis0], A->delta_len[axis0], axis1,
+                       &depth);
+    if (idx != -1) {
+        return &(A->delta_data[axis0][idx]);
+    }
+    return NULL;
+}
+
+static int delta_insert(MCS *A, int axis0, int axis1, double value) {
+    // Insert (axis0, axis1) into the delta buffer of the row keeping it
+    // sorted, or overwrite its value if it is already there. Returns 1 if a
+    // new entry was added.
+    int depth;
+    int len = A->delta_len[axis0];
+    int *indices = A->delta_indices[axis0];
+    int pos = lowerBound(indices, len, axis1, &depth);
+
+    if ((pos < len) && (indices[pos] == axis1)) {
+        A->delta_data[axis0][pos] = value;
+        return 0;
+    }
+
+    // Grow the buffer geometrically so inserts are amortised O(1) copies.
+    if (len == A->delta_cap[axis0]) {
+        int cap = len < DELTA_MIN_CAPACITY ? DELTA_MIN_CAPACITY : 2*len;
+        A->delta_indices[axis0] = realloc(A->delta_indices[axis0],
+                                          cap*sizeof(int));
+        A->delta_data[axis0] = realloc(A->delta_data[axis0],
+                                       cap*sizeof(double));
+        A->delta_cap[axis0] = cap;
+        indices = A->delta_indices[axis0];
+    }
+
+    memmove(&indices[pos+1], &indices[pos], (len - pos)*sizeof(int));
+    memmove(&A->delta_data[axis0][pos+1], &A->delta_data[axis0][pos],
+            (len - pos)*sizeof(double));
+    indices[pos] = axis1;
+    A->delta_data[axis0][pos] = value;
+    A->delta_len[axis0] = len + 1;
+    return 1;
+}
+
+long mutable_insert(MCS *A, COO *entries, int n_threads) {
+    /*
+    Insert entries into A, setting the value of any that already exist.
+    Only the rows (or columns) of the batch are touched, so the cost depends
+    on the batch and not on the size of A, until compaction is triggered.
+    Inputs:
+        A: The mutable matrix to insert into.
+        entries: The (row, col, value) entries to insert in any order.
+    Returns the total new entries that were added.
+    */
+    int *axis0;
+    int *axis1;
+    int i;
+    int total_rows = 0;
+    long added = 0;
+
+    if (entries->nnz == 0) {
+        return 0;
+    }
+
+    if (A->base.CSR == 1) {
+        axis0 = entries->row;
+        axis1 = entries->col;
+    } else {
+        axis1 = entries->row;
+        axis0 = entries->col;
+    }
+
+    // Group the batch by row so each row is inserted into by one thread.
+    INSERT_ENTRY *batch = malloc(entries->nnz*sizeof(INSERT_ENTRY));
+    int *row_start = malloc((entries->nnz + 1)*sizeof(int));
+    for (i=0; i<entries->nnz; i++) {
+        batch[i].axis0 = axis0[i];
+        batch[i].axis1 = axis1[i];
+        batch[i].pos = i;
+    }
+    qsort(batch, entries->nnz, sizeof(INSERT_ENTRY), compare_insert_entry);
+    for (i=0; i<entries->nnz; i++) {
+        if ((i == 0) || (batch[i].axis0 != batch[i-1].axis0)) {
+            row_start[total_rows] = i;
+            total_rows += 1;
+        }
+    }
+    row_start[total_rows] = entries->nnz;
+
+    if (n_threads != -1) {
+        omp_set_num_threads(n_threads);
+    }
+
+    #pragma omp parallel for schedule(dynamic) reduction(+:added)
+    for (i=0; i<total_rows; i++) {
+        int k;
+        int depth;
+        int row = batch[row_start[i]].axis0;
+        int start = A->base.indptr[row];
+        int n = A->base.indptr[row+1] - start;
+        for (k=row_start[i]; k<row_start[i+1]; k++) {
+            double value = entries->data[batch[k].pos];
+            int idx = binarySearch(&A->base.indices[start], n,
+                                   batch[k].axis1, &depth);
+            if (idx != -1) {
+                A->base.data[start + idx] = value;
+            } else {
+                added += delta_insert(A, row, batch[k].axis1, value);
+            }
+        }
+    }
+
+    free(batch);
+    free(row_start);
+
+    A->n_delta += added;
+    if (A->n_delta > A->threshold) {
+        mutable_compact(A, n_threads);
+    }
+
+    return added;
+}
+
+static inline __attribute__((always_inline))
+void mutable_loop(MCS *A, COO *indexer, OP *op, int *axis0, int *axis1,
+                  int search_type, const int type) {
+    int index_pointer;
+
+    #pragma omp parallel for schedule(dynamic) shared(A, indexer)
+    for (index_pointer=0; index_pointer<indexer->nnz; index_pointer++) {
+        double *x = mutable_find(A, axis0[index_pointer],
+                                 axis1[index_pointer], search_type);
+
+        // Skip values that are not in A.
+        if (x == NULL) {
+            continue;
+        }
+
+        apply_entry(type, op, x, &(indexer->data[index_pointer]),
+                    index_pointer);
+    }
+}
+
+void mutable_index(MCS *A, COO *indexer, OP *op, int search_type,
+                   int n_threads) {
+    /*
+    As compressed_sparse_index but for a mutable matrix. Each entry is
+    searched for in the base matrix first and then in the (small) delta
+    buffer of its row.
+    Inputs:
+        A: The mutable matrix to get/set etc.
+        index: A sparse matrix in COO form containing index into A.
+        op: The operation to apply between A and index->data.
+    */
+    int *axis0;
+    int *axis1;
+
+    if (A->base.CSR == 1) {
+        axis0 = indexer->row;
+        axis1 = indexer->col;
+    } else {
+        axis1 = indexer->row;
+        axis0 = indexer->col;
+    }
+
+    if (n_threads != -1) {
+        omp_set_num_threads(n_threads);
+    }
+
+    // Dispatch to a loop with the operation compiled into it.
+    switch (op->type) {
+        case OP_GET:
+            mutable_loop(A, indexer, op, axis0, axis1, search_type, OP_GET);
+            break;
+        case OP_SET:
+            mutable_loop(A, indexer, op, axis0, axis1, search_type, OP_SET);
+            break;
+        case OP_ADD:
+            mutable_loop(A, indexer, op, axis0, axis1, search_type, OP_ADD);
+            break;
+        case OP_MUL:
+            mutable_loop(A, indexer, op, axis0, axis1, search_type, OP_MUL);
+            break;
+        case OP_MIN:
+            mutable_loop(A, indexer, op, axis0, axis1, search_type, OP_MIN);
+            break;
+        case OP_MAX:
+            mutable_loop(A, indexer, op, axis0, axis1, search_type, OP_MAX);
+            break;
+        case OP_AXPY_GET:
+            mutable_loop(A, indexer, op, axis0, axis1, search_type, OP_AXPY_GET);
+            break;
+        case OP_AXPY_ADD:
+            mutable_loop(A, indexer, op, axis0, axis1, search_type, OP_AXPY_ADD);
+            break;
+    }
+}
+
+void mutable_compact(MCS *A, int n_threads) {
+    /*
+    Merge the delta buffers into a new base matrix. Each row is merged
+    independently so this runs in parallel over rows.
+    */
+    int i;
+    int n_rows = A->base.n_indptr - 1;
+    int *indptr;
+    int *indices;
+    double *data;
+
+    if (A->n_delta == 0) {
+        return;
+    }
+
+    indptr = malloc(A->base.n_indptr*sizeof(int));
+    indptr[0] = 0;
+    for (i=0; i<n_rows; i++) {
+        indptr[i+1] = indptr[i] + A->base.indptr[i+1] - A->base.indptr[i]
+                      + A->delta_len[i];
+    }
+    indices = malloc(indptr[n_rows]*sizeof(int));
+    data = malloc(indptr[n_rows]*sizeof(double));
+
+    if (n_threads != -1) {
+        omp_set_num_threads(n_threads);
+    }
+
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (i=0; i<n_rows; i++) {
+        // Standard merge of the two sorted lists.
+        int b = A->base.indptr[i];
+        int b_end = A->base.indptr[i+1];
+        int d = 0;
+        int d_end = A->delta_len[i];
+        int out = indptr[i];
+        while ((b < b_end) || (d < d_end)) {
+            if ((d == d_end) ||
+                ((b < b_end) && (A->base.indices[b] < A->delta_indices[i][d]))) {
+                indices[out] = A->base.indices[b];
+                data[out] = A->base.data[b];
+                b += 1;
+            } else {
+                indices[out] = A->delta_indices[i][d];
+                data[out] = A->delta_data[i][d];
+                d += 1;
+            }
+            out += 1;
+        }
+    }
+
+    free(A->base.indptr);
+    free(A->base.indices);
+    free(A->base.data);
+    A->base.indptr = indptr;
+    A->base.indices = indices;
+    A->base.data = data;
+    mutable_free_deltas(A);
+}
@@ -0,0 +1,26 @@
+#ifndef CSINDEXER_MUTABLE_H_
+#define CSINDEXER_MUTABLE_H_
+
+#include "indexer_c.h"
+
+typedef struct {
+    // A compressed sparse matrix whose sparsity pattern can grow. New entries
+    // go into small sorted per-row (or column) delta buffers which are merged
+    // into the base matrix by compaction once they hold too many entries.
+    CS base;              // The compacted matrix (owned by this struct)
+    int *delta_len;       // Entries in the delta buffer of each row
+    int *delta_cap;       // Capacity of the delta buffer of each row
+    int **delta_indices;  // Sorted indices of the delta buffer of each row
+    double **delta_data;  // Values of the delta buffer of each row
+    long n_delta;         // Total entries over all delta buffers
+    long threshold;       // Compact once n_delta is larger than this
+} MCS;
+
+void mutable_init(MCS *A, CS *M, long threshold);
+void mutable_free(MCS *A);
+long mutable_insert(MCS *A, COO *entries, int n_threads);
+void mutable_index(MCS *A, COO *indexer, OP *op, int search_type,
+                   int n_threads);
+void mutable_compact(MCS *A, int n_threads);
+
+#endif  // CSINDEXER_MUTABLE_H_
@@ -0,0 +1,158 @@
+/* The operations that can be applied between the entries of a compressed
+ * sparse matrix and an indexer. These are all static inline so that every
+ * indexing loop gets its own copy of the operation compiled into it, rather
+ * than calling through a function pointer for every entry. */
+#ifndef CSINDEXER_OPERATIONS_H_
+#define CSINDEXER_OPERATIONS_H_
+
+#include "indexer_c.h"
+
+static inline double op_weight(OP *op, int i) {
+    // The weight of indexer entry i in the axpy operations.
+    if (op->weights == NULL) {
+        return op->alpha;
+    }
+    return op->weights[i];
+}
+
+static inline void atomic_min(double *x, double y) {
+    // OpenMP has no atomic min so use a compare and swap loop instead.
+    double old = *x;
+    while ((y < old) &&
+           !__atomic_compare_exchange(x, &old, &y, 0, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED)) {
+        // On failure old is reloaded so we just try again.
+    }
+}
+
+static inline void atomic_max(double *x, double y) {
+    // OpenMP has no atomic max so use a compare and swap loop instead.
+    double old = *x;
+    while ((y > old) &&
+           !__atomic_compare_exchange(x, &old, &y, 0, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED)) {
+        // On failure old is reloaded so we just try again.
+    }
+}
+
+static inline void apply_entry(const int type, OP *op, double *x, double *y,
+                               int i) {
+    // Apply the operation between x (in M) and y (entry i of the indexer).
+    // Other threads may be updating the same x so updates to it are atomic.
+    switch (type) {
+        case OP_GET:
+            *y = *x;
+            break;
+
+        case OP_SET:
+            // Note that sometimes the same entry gets multiple copies.
+            #pragma omp atomic write
+            *x = *y;
+            break;
+
+        case OP_ADD:
+            #pragma omp atomic
+            *x += *y;
+            break;
+
+        case OP_MUL:
+            #pragma omp atomic
+            *x *= *y;
+            break;
+
+        case OP_MIN:
+            atomic_min(x, *y);
+            break;
+
+        case OP_MAX:
+            atomic_max(x, *y);
+            break;
+
+        case OP_AXPY_GET:
+            *y = op_weight(op, i)*(*x) + op->beta*(*y);
+            break;
+
+        case OP_AXPY_ADD: {
+            double temp = op_weight(op, i)*(*y);
+            #pragma omp atomic
+            *x += temp;
+            break;
+        }
+    }
+}
+
+static inline void apply_segment(const int type, OP *op, double *x, double *y,
+                                 int stride, int lo, int hi) {
+    // Apply the operation between x (in M) and the run of indexer entries
+    // lo, ..., hi-1 which all point at x, where entry i is y[i*stride]. The
+    // run is reduced first so x is only written once. The caller must own x
+    // so no atomics are needed.
+    int i;
+    double temp;
+    double *yi;
+    switch (type) {
+        case OP_GET:
+            temp = *x;
+            for (i=lo; i<hi; i++) {
+                y[(long)i*stride] = temp;
+            }
+            break;
+
+        case OP_SET:
+            // The last copy wins as if they were applied in order.
+            *x = y[(long)(hi-1)*stride];
+            break;
+
+        case OP_ADD:
+            temp = 0;
+            for (i=lo; i<hi; i++) {
+                temp += y[(long)i*stride];
+            }
+            *x += temp;
+            break;
+
+        case OP_MUL:
+            temp = 1;
+            for (i=lo; i<hi; i++) {
+                temp *= y[(long)i*stride];
+            }
+            *x *= temp;
+            break;
+
+        case OP_MIN:
+            temp = *x;
+            for (i=lo; i<hi; i++) {
+                yi = &y[(long)i*stride];
+                temp = *yi < temp ? *yi : temp;
+            }
+            *x = temp;
+            break;
+
+        case OP_MAX:
+            temp = *x;
+            for (i=lo; i<hi; i++) {
+                yi = &y[(long)i*stride];
+                temp = *yi > temp ? *yi : temp;
+            }
+            *x = temp;
+            break;
+
+        case OP_AXPY_GET:
+            temp = *x;
+            for (i=lo; i<hi; i++) {
+                yi = &y[(long)i*stride];
+                *yi = op_weight(op, i)*temp + op->beta*(*yi);
+            }
+            break;
+
+        case OP_AXPY_ADD:
+            temp = 0;
+            for (i=lo; i<hi; i++) {
+                temp += op_weight(op, i)*y[(long)i*stride];
+            }
+            *x += temp;
+            break;
+    }
+}
+
+#endif  // CSINDEXER_OPERATIONS_H_
@@ -0,0 +1,440 @@
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+#include "packed_indices.h"
+#include "arena.h"
+#include "operations.h"
+#include "interpolation_search.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+static int bit_width(unsigned int x) {
+    // The number of bits needed to store x.
+    int w = 0;
+    while (x > 0) {
+        w += 1;
+        x >>= 1;
+    }
+    return w;
+}
+
+static inline int packed_block_length(CS *M, PACKED *P, int row, int block) {
+    // Total indices in `block` of `row`, only the last can be partial.
+    int n = M->indptr[row+1] - M->indptr[row];
+    int done = (block - P->row_block[row])*PACKED_BLOCK;
+    return n - done < PACKED_BLOCK ? n - done : PACKED_BLOCK;
+}
+
+// Whether the AVX2 decode may be used if the CPU supports it.
+static int simd_enabled = 1;
+
+void packed_set_simd(int enabled) {
+    simd_enabled = enabled;
+}
+
+int packed_simd(void) {
+    // Whether blocks are decoded with the AVX2 kernel.
+#if defined(__x86_64__)
+    return simd_enabled && __builtin_cpu_supports("avx2");
+#else
+    return 0;
+#endif
+}
+
+static inline int unpack_scalar(const unsigned char *in, int w, int j, int n,
+                                int *out) {
+    // Unpack deltas j to n - 1 of width w into out, one at a time with an
+    // 8 byte load and a shift each.
+    unsigned long mask = (1UL << w) - 1;
+    unsigned long word;
+    long bit;
+
+    for (; j<n; j++) {
+        bit = (long)j*w;
+        memcpy(&word, in + (bit >> 3), sizeof(word));
+        out[j] = (int)((word >> (bit & 7)) & mask);
+    }
+    return n;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static int unpack_avx2(const unsigned char *in, int w, int n, int *out) {
+    // Unpack the deltas of width w into out 8 at a time. Each lane gathers
+    // the 4 bytes starting at the first byte of its delta and shifts them by
+    // its own bit offset, so this needs w <= 25. Returns how many deltas
+    // were unpacked, the rest are left for unpack_scalar.
+    const __m256i width = _mm256_set1_epi32(w);
+    const __m256i mask = _mm256_set1_epi32((int)((1U << w) - 1));
+    const __m256i seven = _mm256_set1_epi32(7);
+    __m256i bit = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                                     width);
+    __m256i step = _mm256_slli_epi32(width, 3);
+    int j;
+
+    for (j=0; j+8<=n; j+=8) {
+        __m256i word = _mm256_i32gather_epi32((const int *)in,
+                                              _mm256_srli_epi32(bit, 3), 1);
+        word = _mm256_srlv_epi32(word, _mm256_and_si256(bit, seven));
+        _mm256_storeu_si256((__m256i *)&out[j],
+                            _mm256_and_si256(word, mask));
+        bit = _mm256_add_epi32(bit, step);
+    }
+    return j;
+}
+#endif
+
+static inline void packed_decode(PACKED *P, int block, int n, int *out) {
+    // Decode the n indices of `block` into out. The deltas are unpacked
+    // with AVX2 if it is enabled and they are narrow enough, otherwise one
+    // at a time, and then summed back into indices.
+    const unsigned char *in = P->packed + P->offset[block];
+    int w = P->bits[block];
+    int j = 0;
+
+    out[0] = P->first[block];
+#if defined(__x86_64__)
+    if ((w <= 25) && packed_simd()) {
+        j = unpack_avx2(in, w, n - 1, out + 1);
+    }
+#endif
+    unpack_scalar(in, w, j, n - 1, out + 1);
+    for (j=1; j<n; j++) {
+        out[j] += out[j-1];
+    }
+}
+
+void packed_build(PACKED *P, CS *M, int n_threads) {
+    /*
+    Pack the indices of M, which must be sorted within each row (or column).
+    Inputs:
+        P: The packed indices to build. Free them with packed_free.
+        M: A compressed sparse matrix in CSC or CSR form.
+    */
+    int i;
+    int n_rows = M->n_indptr - 1;
+    int n_blocks;
+
+    P->n_indptr = M->n_indptr;
+    P->row_block = malloc(M->n_indptr*sizeof(int));
+    P->row_block[0] = 0;
+    for (i=0; i<n_rows; i++) {
+        int n = M->indptr[i+1] - M->indptr[i];
+        P->row_block[i+1] = P->row_block[i] + (n + PACKED_BLOCK - 1)/PACKED_BLOCK;
+    }
+    n_blocks = P->row_block[n_rows];
+
+    P->first = malloc(n_blocks*sizeof(int));
+    P->bits = malloc(n_blocks*sizeof(unsigned char));
+    P->offset = malloc((n_blocks + 1)*sizeof(long));
+
+    if (n_threads != -1) {
+        omp_set_num_threads(n_threads);
+    }
+
+    // First find the bit width of every block.
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (i=0; i<n_rows; i++) {
+        int b, j;
+        for (b=P->row_block[i]; b<P->row_block[i+1]; b++) {
+            int lo = M->indptr[i] + (b - P->row_block[i])*PACKED_BLOCK;
+            int n = packed_block_length(M, P, i, b);
+            unsigned int largest = 0;
+            for (j=lo+1; j<lo+n; j++) {
+                unsigned int delta = M->indices[j] - M->indices[j-1];
+                largest = delta > largest ? delta : largest;
+            }
+            P->first[b] = M->indices[lo];
+            P->bits[b] = bit_width(largest);
+
+            // Store the packed size for now, rounded up to whole bytes.
+            P->offset[b+1] = ((long)(n - 1)*P->bits[b] + 7)/8;
+        }
+    }
+
+    // Then where each block is packed.
+    P->offset[0] = 0;
+    for (i=0; i<n_blocks; i++) {
+        P->offset[i+1] += P->offset[i];
+    }
+    P->packed_bytes = P->offset[n_blocks] + PACKED_PADDING;
+    P->packed = calloc(P->packed_bytes, 1);
+    huge_advise(P->packed, P->packed_bytes);
+
+    // And finally pack the deltas. Each block is packed into a local buffer
+    // first as the 8 byte writes would otherwise overlap the next block,
+    // which another thread may be packing.
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (i=0; i<n_rows; i++) {
+        unsigned char out[PACKED_BLOCK*sizeof(int) + PACKED_PADDING];
+        unsigned long word;
+        int b, j;
+        for (b=P->row_block[i]; b<P->row_block[i+1]; b++) {
+            int lo = M->indptr[i] + (b - P->row_block[i])*PACKED_BLOCK;
+            int n = packed_block_length(M, P, i, b);
+            memset(out, 0, sizeof(out));
+            for (j=1; j<n; j++) {
+                long bit = (long)(j - 1)*P->bits[b];
+                unsigned long delta = M->indices[lo+j] - M->indices[lo+j-1];
+                memcpy(&word, out + (bit >> 3), sizeof(word));
+                word |= delta << (bit & 7);
+                memcpy(out + (bit >> 3), &word, sizeof(word));
+            }
+            memcpy(P->packed + P->offset[b], out, P->offset[b+1] - P->offset[b]);
+        }
+    }
+}
+
+void packed_free(PACKED *P) {
+    free(P->row_block);
+    free(P->first);
+    free(P->bits);
+    free(P->offset);
+    free(P->packed);
+}
+
+long packed_nbytes(PACKED *P) {
+    // Total memory used by the packed indices, including the skip arrays.
+    long n_blocks = P->row_block[P->n_indptr - 1];
+    return P->n_indptr*sizeof(int)
+           + n_blocks*(sizeof(int) + sizeof(unsigned char) + sizeof(long))
+           + sizeof(long) + P->packed_bytes;
+}
+
+static inline long packed_find(CS *M, PACKED *P, int row, int x) {
+    // Find the position of x in `row` of M, returning -1 if it is not there.
+    // The skip array is binary searched so only one block is decoded.
+    int decoded[PACKED_BLOCK];
+    int depth;
+    int b0 = P->row_block[row];
+    int n_blocks = P->row_block[row+1] - b0;
+    int b, n, j;
+
+    if (n_blocks == 0) {
+        return -1;
+    }
+
+    // The last block starting at or before x.
+    b = upperBound(&P->first[b0], n_blocks, x, &depth) - 1;
+    if (b < 0) {
+        return -1;
+    }
+
+    n = packed_block_length(M, P, row, b0 + b);
+    packed_decode(P, b0 + b, n, decoded);
+    j = lowerBound(decoded, n, x, &depth);
+    if ((j == n) || (decoded[j] != x)) {
+        return -1;
+    }
+    return M->indptr[row] + (long)b*PACKED_BLOCK + j;
+}
+
+static inline __attribute__((always_inline))
+void packed_loop(CS *M, PACKED *P, COO *indexer, OP *op, int *axis0,
+                 int *axis1, const int type) {
+    int index_pointer;
+
+    #pragma omp parallel for schedule(dynamic) shared(M, indexer)
+    for (index_pointer=0; index_pointer<indexer->nnz; index_pointer++) {
+        long offset = packed_find(M, P, axis0[index_pointer],
+                                  axis1[index_pointer]);
+
+        // Skip values that are not in M.
+        if (offset == -1) {
+            continue;
+        }
+
+        apply_entry(type, op, &(M->data[offset]),
+                    &(indexer->data[index_pointer]), index_pointer);
+    }
+}
+
+void packed_sparse_index(CS *M, PACKED *P, COO *indexer, OP *op,
+                         int n_threads) {
+    /*
+    As compressed_sparse_index but searching the packed indices P of M, so
+    M->indices is never read.
+    */
+    int *axis0;
+    int *axis1;
+
+    if (M->CSR == 1) {
+        axis0 = indexer->row;
+        axis1 = indexer->col;
+    } else {
+        axis1 = indexer->row;
+        axis0 = indexer->col;
+    }
+
+    if (n_threads != -1) {
+        omp_set_num_threads(n_threads);
+    }
+
+    // Dispatch to a loop with the operation compiled into it.
+    switch (op->type) {
+        case OP_GET:
+            packed_loop(M, P, indexer, op, axis0, axis1, OP_GET);
+            break;
+        case OP_SET:
+            packed_loop(M, P, indexer, op, axis0, axis1, OP_SET);
+            break;
+        case OP_ADD:
+            packed_loop(M, P, indexer, op, axis0, axis1, OP_ADD);
+            break;
+        case OP_MUL:
+            packed_loop(M, P, indexer, op, axis0, axis1, OP_MUL);
+            break;
+        case OP_MIN:
+            packed_loop(M, P, indexer, op, axis0, axis1, OP_MIN);
+            break;
+        case OP_MAX:
+            packed_loop(M, P, indexer, op, axis0, axis1, OP_MAX);
+            break;
+        case OP_AXPY_GET:
+            packed_loop(M, P, indexer, op, axis0, axis1, OP_AXPY_GET);
+            break;
+        case OP_AXPY_ADD:
+            packed_loop(M, P, indexer, op, axis0, axis1, OP_AXPY_ADD);
+            break;
+    }
+}
+
+static inline __attribute__((always_inline))
+void process_packed_row(CS *M, PACKED *P, int row, int *axis1,
+                        int index_pointer, int index_end, double *values,
+                        OP *op, const int type) {
+    // As process_row, but walking the packed blocks of the row. Whole blocks
+    // before the next indexer value are skipped using the skip array and a
+    // block is only decoded once it may hold a match.
+    int decoded[PACKED_BLOCK];
+    int block = P->row_block[row];
+    int block_end = P->row_block[row+1];
+    int decoded_block = -1;
+    int n = 0;
+    int j = 0;
+    int x;
+    int run_end;
+    long offset;
+
+    while ((index_pointer < index_end) && (block < block_end)) {
+        x = axis1[index_pointer];
+
+        // Skip the blocks that end before x.
+        while ((block + 1 < block_end) && (P->first[block+1] <= x)) {
+            block += 1;
+        }
+        if (block != decoded_block) {
+            n = packed_block_length(M, P, row, block);
+            packed_decode(P, block, n, decoded);
+            decoded_block = block;
+            j = 0;
+        }
+
+        while ((j < n) && (decoded[j] < x)) {
+            j += 1;
+        }
+
+        if ((j < n) && (decoded[j] == x)) {
+            run_end = index_pointer + 1;
+            while ((run_end < index_end) && (axis1[run_end] == x)) {
+                run_end += 1;
+            }
+            offset = M->indptr[row]
+                     + (long)(block - P->row_block[row])*PACKED_BLOCK + j;
+            apply_segment(type, op, &(M->data[offset]), values, 1,
+                          index_pointer, run_end);
+            index_pointer = run_end;
+        } else {
+            // x is not stored in M.
+            index_pointer += 1;
+        }
+    }
+}
+
+static inline __attribute__((always_inline))
+void packed_sorted_loop(CS *M, PACKED *P, COO *indexer, OP *op, int *axis0,
+                        int *axis1, int *row_start, int total_rows,
+                        const int type) {
+    int i;
+    #pragma omp parallel for
+    for (i=0; i<total_rows; i++) {
+        process_packed_row(M, P, axis0[row_start[i]], axis1, row_start[i],
+                           row_start[i+1], indexer->data, op, type);
+    }
+}
+
+void packed_sparse_index_sorted(CS *M, PACKED *P, COO *indexer, OP *op,
+                                int n_threads) {
+    /*
+    As compressed_sparse_index_sorted but merging against the packed indices
+    P of M, so M->indices is never read.
+    */
+    int *axis0;
+    int *axis1;
+    int i;
+    int total_rows = 0;
+
+    if (M->CSR == 1) {
+        axis0 = indexer->row;
+        axis1 = indexer->col;
+    } else {
+        axis1 = indexer->row;
+        axis0 = indexer->col;
+    }
+
+    // Get where the rows start in indexer.
+    int *row_start = scratch_get(M->arena, SCRATCH_ROW_START,
+                                 (indexer->nnz + 1)*sizeof(int));
+    for (i=0; i<indexer->nnz; i++) {
+        if ((i == 0) || (axis0[i] != axis0[i-1])) {
+            row_start[total_rows] = i;
+            total_rows += 1;
+        }
+    }
+    row_start[total_rows] = indexer->nnz;
+
+    if (n_threads != -1) {
+        omp_set_num_threads(n_threads);
+    }
+
+    // Dispatch to a loop with the operation compiled into it.
+    switch (op->type) {
+        case OP_GET:
+            packed_sorted_loop(M, P, indexer, op, axis0, axis1, row_start,
+                               total_rows, OP_GET);
+            break;
+        case OP_SET:
+            packed_sorted_loop(M, P, indexer, op, axis0, axis1, row_start,
+                               total_rows, OP_SET);
+            break;
+        case OP_ADD:
+            packed_sorted_loop(M, P, indexer, op, axis0, axis1, row_start,
+                               total_rows, OP_ADD);
+            break;
+        case OP_MUL:
+            packed_sorted_loop(M, P, indexer, op, axis0, axis1, row_start,
+                               total_rows, OP_MUL);
+            break;
+        case OP_MIN:
+            packed_sorted_loop(M, P, indexer, op, axis0, axis1, row_start,
+                               total_rows, OP_MIN);
+            break;
+        case OP_MAX:
+            packed_sorted_loop(M, P, indexer, op, axis0, axis1, row_start,
+                               total_rows, OP_MAX);
+            break;
+        case OP_AXPY_GET:
+            packed_sorted_loop(M, P, indexer, op, axis0, axis1, row_start,
+                               total_rows, OP_AXPY_GET);
+            break;
+        case OP_AXPY_ADD:
+            packed_sorted_loop(M, P, indexer, op, axis0, axis1, row_start,
+                               total_rows, OP_AXPY_ADD);
+            break;
+    }
+
+    scratch_put(M->arena, SCRATCH_ROW_START, row_start,
+                (indexer->nnz + 1)*sizeof(int));
+}
@@ -0,0 +1,37 @@
+#ifndef CSINDEXER_PACKED_INDICES_H_
+#define CSINDEXER_PACKED_INDICES_H_
+
+#include "indexer_c.h"
+
+// Total indices in each packed block.
+#define PACKED_BLOCK 128
+
+// Padding after the packed deltas so a block can always be decoded with
+// 8 byte loads.
+#define PACKED_PADDING 8
+
+typedef struct {
+    // The indices of a compressed sparse matrix split into blocks of
+    // PACKED_BLOCK per row (or column). Each block stores its first index in
+    // a skip array and the differences between consecutive indices bit
+    // packed at the smallest width that holds them (frame of reference).
+    int n_indptr;           // Length of indptr of the matrix
+    int *row_block;         // First block of each row, size n_indptr
+    int *first;             // First index of each block (the skip array)
+    unsigned char *bits;    // Bit width of the deltas of each block
+    long *offset;           // Where each block starts in packed
+    unsigned char *packed;  // The bit packed deltas of all blocks
+    long packed_bytes;      // Size of packed
+} PACKED;
+
+void packed_set_simd(int enabled);
+int packed_simd(void);
+void packed_build(PACKED *P, CS *M, int n_threads);
+void packed_free(PACKED *P);
+long packed_nbytes(PACKED *P);
+void packed_sparse_index(CS *M, PACKED *P, COO *indexer, OP *op,
+                         int n_threads);
+void packed_sparse_index_sorted(CS *M, PACKED *P, COO *indexer, OP *op,
+                                int n_threads);
+
+#endif  // CSINDEXER_PACKED_INDICES_H_
@@ -0,0 +1,98 @@
+#include <stdlib.h>
+#include <omp.h>
+#include "pipeline.h"
+#include "operations.h"
+
+static inline __attribute__((always_inline))
+void apply_located_loop(CS *M, long *offsets, double *values, OP *op,
+                        int *run_start, int total_runs, const int type) {
+    // Each thread applies a whole run at a time so it owns the entry of M
+    // it updates.
+    int i;
+    #pragma omp parallel for schedule(dynamic, 256)
+    for (i=0; i<total_runs; i++) {
+        long offset = offsets[run_start[i]];
+        if (offset != -1) {
+            apply_segment(type, op, &(M->data[offset]), values, 1,
+                          run_start[i], run_start[i+1]);
+        }
+    }
+}
+
+void compressed_sparse_apply_located(CS *M, long *offsets, double *values,
+                                     OP *op, int n, int n_threads) {
+    /*
+    Apply op between M->data and values at offsets that have already been
+    found (see compressed_sparse_locate). This is the last stage of the
+    pipeline, after grouping and searching.
+    Inputs:
+        M: A compressed sparse matrix in CSC or CSR form to get/set etc.
+        offsets: Where each of the n entries is stored in M->data, or -1 if
+                 it is not stored. Equal offsets must be next to each other.
+        values: The n values of the indexer.
+        op: The operation to apply between M->data and values.
+    Runs of equal offsets are reduced in order before being applied so, as
+    each run is handled by a single thread, no atomics are needed.
+    */
+    int i;
+    int total_runs = 0;
+    int *run_start;
+
+    // Find where the runs start, first counting them.
+    for (i=0; i<n; i++) {
+        if ((i == 0) || (offsets[i] != offsets[i-1])) {
+            total_runs += 1;
+        }
+    }
+    run_start = malloc((total_runs + 1)*sizeof(int));
+    total_runs = 0;
+    for (i=0; i<n; i++) {
+        if ((i == 0) || (offsets[i] != offsets[i-1])) {
+            run_start[total_runs] = i;
+            total_runs += 1;
+        }
+    }
+    run_start[total_runs] = n;
+
+    if (n_threads != -1) {
+        omp_set_num_threads(n_threads);
+    }
+
+    // Dispatch to a loop with the operation compiled into it.
+    switch (op->type) {
+        case OP_GET:
+            apply_located_loop(M, offsets, values, op, run_start, total_runs,
+                               OP_GET);
+            break;
+        case OP_SET:
+            apply_located_loop(M, offsets, values, op, run_start, total_runs,
+                               OP_SET);
+            break;
+        case OP_ADD:
+            apply_located_loop(M, offsets, values, op, run_start, total_runs,
+                               OP_ADD);
+            break;
+        case OP_MUL:
+            apply_located_loop(M, offsets, values, op, run_start, total_runs,
+                               OP_MUL);
+            break;
+        case OP_MIN:
+            apply_located_loop(M, offsets, values, op, run_start, total_runs,
+                               OP_MIN);
+            break;
+        case OP_MAX:
+            apply_located_loop(M, offsets, values, op, run_start, total_runs,
+                               OP_MAX);
+            break;
+        case OP_AXPY_GET:
+            apply_located_loop(M, offsets, values, op, run_start, total_runs,
+                               OP_AXPY_GET);
+            break;
+        case OP_AXPY_ADD:
+            apply_located_loop(M, offsets, values, op, run_start, total_runs,
+                               OP_AXPY_ADD);
+            break;
+    }
+
+    free(run_start);
+}
@@ -0,0 +1,9 @@
+#ifndef CSINDEXER_PIPELINE_H_
+#define CSINDEXER_PIPELINE_H_
+
+#include "indexer_c.h"
+
+void compressed_sparse_apply_located(CS *M, long *offsets, double *values,
+                                     OP *op, int n, int n_threads);
+
+#endif  // CSINDEXER_PIPELINE_H_
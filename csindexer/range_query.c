@@ -0,0 +1,230 @@
+#include <stdlib.h>
+#include <omp.h>
+#include "range_query.h"
+#include "interpolation_search.h"
+
+// Total segments handed to a thread at a time. A segment is a single row (or
+// column for CSC) of a single window and costs two binary searches, so chunks
+// are large enough to amortise the scheduling but small enough to balance
+// windows of very different sizes.
+#define SEGMENT_CHUNK 256
+
+static void window_axes(CS *M, WINDOWS *windows, int k, int *lo0, int *hi0,
+                        int *lo1, int *hi1) {
+    // Get the bounds of window `k` along the compressed axis (axis0) and the
+    // indices axis (axis1) of M.
+    if (M->CSR == 1) {
+        *lo0 = windows->r0[k]; *hi0 = windows->r1[k];
+        *lo1 = windows->c0[k]; *hi1 = windows->c1[k];
+    } else {
+        *lo0 = windows->c0[k]; *hi0 = windows->c1[k];
+        *lo1 = windows->r0[k]; *hi1 = windows->r1[k];
+    }
+}
+
+static long *window_segments(CS *M, WINDOWS *windows) {
+    // Flatten the windows into segments so we can parallelise over the rows
+    // of all windows at once. Returns seg_ptr of size windows->n + 1 where
+    // the segments of window k are seg_ptr[k], ..., seg_ptr[k+1] - 1.
+    int k;
+    int lo0, hi0, lo1, hi1;
+    long *seg_ptr = malloc((windows->n + 1)*sizeof(long));
+
+    seg_ptr[0] = 0;
+    for (k=0; k<windows->n; k++) {
+        window_axes(M, windows, k, &lo0, &hi0, &lo1, &hi1);
+        if ((hi0 > lo0) && (hi1 > lo1)) {
+            seg_ptr[k+1] = seg_ptr[k] + hi0 - lo0;
+        } else {
+            // An empty window has no segments at all.
+            seg_ptr[k+1] = seg_ptr[k];
+        }
+    }
+
+    return seg_ptr;
+}
+
+static int find_window(long *seg_ptr, int n, long t) {
+    // Binary search for the window containing segment t i.e. the k with
+    //     seg_ptr[k] <= t < seg_ptr[k+1].
+    int lo = 0;
+    int hi = n - 1;
+    while (lo < hi) {
+        int pos = lo + (hi - lo + 1)/2;
+        if (seg_ptr[pos] <= t)
+            lo = pos;
+        else
+            hi = pos - 1;
+    }
+    return lo;
+}
+
+static void segment_bounds(CS *M, int axis0, int lo1, int hi1, int *lo,
+                           int *hi) {
+    // Find the stored entries of M along axis0 whose index lies in
+    // [lo1, hi1), returning them as the data range [lo, hi).
+    int depth;
+    int start = M->indptr[axis0];
+    int n = M->indptr[axis0+1] - start;
+
+    *lo = start + lowerBound(&M->indices[start], n, lo1, &depth);
+
+    // Only the remainder of the row can contain the upper bound.
+    *hi = *lo + upperBound(&M->indices[*lo], start + n - *lo, hi1 - 1, &depth);
+}
+
+static void range_reduce(CS *M, WINDOWS *windows, int *count, double *sum,
+                         int n_threads) {
+    /*
+    Reduce each window of M to a count of stored entries and/or their sum.
+    Inputs:
+        M: A compressed sparse matrix in CSC or CSR form.
+        windows: The rectangles to reduce over. Windows must lie within M.
+        count: Output of size windows->n for the counts (or NULL).
+        sum: Output of size windows->n for the sums (or NULL).
+    */
+    int k;
+    long c;
+    long *seg_ptr = window_segments(M, windows);
+    long total = seg_ptr[windows->n];
+    long n_chunks = (total + SEGMENT_CHUNK - 1)/SEGMENT_CHUNK;
+
+    for (k=0; k<windows->n; k++) {
+        if (count != NULL) count[k] = 0;
+        if (sum != NULL) sum[k] = 0;
+    }
+
+    if (n_threads != -1) {
+        omp_set_num_threads(n_threads);
+    }
+
+    #pragma omp parallel for schedule(dynamic)
+    for (c=0; c<n_chunks; c++) {
+        long t = c*SEGMENT_CHUNK;
+        long t_end = t + SEGMENT_CHUNK < total ? t + SEGMENT_CHUNK : total;
+        int k = find_window(seg_ptr, windows->n, t);
+
+        while (t < t_end) {
+            int lo0, hi0, lo1, hi1, lo, hi, j;
+            int local_count = 0;
+            double local_sum = 0;
+            long seg_end;
+
+            // Skip over any empty windows.
+            while (seg_ptr[k+1] <= t) {
+                k += 1;
+            }
+            window_axes(M, windows, k, &lo0, &hi0, &lo1, &hi1);
+
+            // Accumulate locally so each window is only written once per
+            // chunk.
+            seg_end = seg_ptr[k+1] < t_end ? seg_ptr[k+1] : t_end;
+            for (; t<seg_end; t++) {
+                segment_bounds(M, lo0 + (int)(t - seg_ptr[k]), lo1, hi1,
+                               &lo, &hi);
+                local_count += hi - lo;
+                if (sum != NULL) {
+                    for (j=lo; j<hi; j++) {
+                        local_sum += M->data[j];
+                    }
+                }
+            }
+
+            if (count != NULL) {
+                #pragma omp atomic
+                count[k] += local_count;
+            }
+            if (sum != NULL) {
+                #pragma omp atomic
+                sum[k] += local_sum;
+            }
+        }
+    }
+
+    free(seg_ptr);
+}
+
+void compressed_sparse_range_count(CS *M, WINDOWS *windows, int *count,
+                                   int n_threads) {
+    // Count the stored entries of M inside each window.
+    range_reduce(M, windows, count, NULL, n_threads);
+}
+
+void compressed_sparse_range_sum(CS *M, WINDOWS *windows, double *sum,
+                                 int n_threads) {
+    // Sum the stored entries of M inside each window.
+    range_reduce(M, windows, NULL, sum, n_threads);
+}
+
+void compressed_sparse_range_extract(CS *M, WINDOWS *windows, int *row,
+                                     int *col, double *data, int n_threads) {
+    /*
+    Extract the stored entries of M inside each window in COO form. The
+    entries of window k are written after those of windows 0, ..., k-1 and
+    within a window they are ordered by (row, column) for CSR and by
+    (column, row) for CSC.
+    Inputs:
+        M: A compressed sparse matrix in CSC or CSR form.
+        windows: The rectangles to extract. Windows must lie within M.
+        row, col, data: Outputs sized to the total count over all windows
+                        (see compressed_sparse_range_count).
+    */
+    int *axis0_out;
+    int *axis1_out;
+    long t;
+    long *seg_ptr = window_segments(M, windows);
+    long total = seg_ptr[windows->n];
+
+    // Bounds of each segment in M->data and where it starts in the output.
+    int *seg_lo = malloc(total*sizeof(int));
+    int *seg_hi = malloc(total*sizeof(int));
+    long *seg_out = malloc((total + 1)*sizeof(long));
+
+    if (M->CSR == 1) {
+        axis0_out = row;
+        axis1_out = col;
+    } else {
+        axis0_out = col;
+        axis1_out = row;
+    }
+
+    if (n_threads != -1) {
+        omp_set_num_threads(n_threads);
+    }
+
+    // First find the bounds of every segment.
+    #pragma omp parallel for schedule(dynamic, SEGMENT_CHUNK)
+    for (t=0; t<total; t++) {
+        int lo0, hi0, lo1, hi1;
+        int k = find_window(seg_ptr, windows->n, t);
+        window_axes(M, windows, k, &lo0, &hi0, &lo1, &hi1);
+        segment_bounds(M, lo0 + (int)(t - seg_ptr[k]), lo1, hi1,
+                       &seg_lo[t], &seg_hi[t]);
+    }
+
+    // Then where each segment is written to.
+    seg_out[0] = 0;
+    for (t=0; t<total; t++) {
+        seg_out[t+1] = seg_out[t] + seg_hi[t] - seg_lo[t];
+    }
+
+    // And finally copy them out.
+    #pragma omp parallel for schedule(dynamic, SEGMENT_CHUNK)
+    for (t=0; t<total; t++) {
+        int lo0, hi0, lo1, hi1, j;
+        int k = find_window(seg_ptr, windows->n, t);
+        long out = seg_out[t];
+        window_axes(M, windows, k, &lo0, &hi0, &lo1, &hi1);
+        for (j=seg_lo[t]; j<seg_hi[t]; j++) {
+            axis0_out[out] = lo0 + (int)(t - seg_ptr[k]);
+            axis1_out[out] = M->indices[j];
+            data[out] = M->data[j];
+            out += 1;
+        }
+    }
+
+    free(seg_lo);
+    free(seg_hi);
+    free(seg_out);
+    free(seg_ptr);
+}
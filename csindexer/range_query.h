@@ -0,0 +1,24 @@
+#ifndef CSINDEXER_RANGE_QUERY_H_
+#define CSINDEXER_RANGE_QUERY_H_
+
+#include "indexer_c.h"
+
+typedef struct {
+    // A batch of rectangular windows [r0, r1) x [c0, c1) into a sparse matrix.
+    // Rows and columns always refer to the matrix, independent of whether it
+    // is stored as CSR or CSC.
+    int *r0;
+    int *r1;
+    int *c0;
+    int *c1;
+    int n;  // Total windows.
+} WINDOWS;
+
+void compressed_sparse_range_count(CS *M, WINDOWS *windows, int *count,
+                                   int n_threads);
+void compressed_sparse_range_sum(CS *M, WINDOWS *windows, double *sum,
+                                 int n_threads);
+void compressed_sparse_range_extract(CS *M, WINDOWS *windows, int *row,
+                                     int *col, double *data, int n_threads);
+
+#endif  // CSINDEXER_RANGE_QUERY_H_
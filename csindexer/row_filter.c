@@ -0,0 +1,86 @@
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+#include "row_filter.h"
+#include "arena.h"
+
+void filter_build(FILTER *F, CS *M, int bits_per_entry, int n_threads) {
+    /*
+    Build a filter for each row (or column) of M.
+    Inputs:
+        F: The filter to build. Free it with filter_free.
+        M: A compressed sparse matrix in CSC or CSR form.
+        bits_per_entry: The size of the Bloom filters per stored index. More
+                        bits reject more of the indices that are not stored.
+    */
+    int i;
+    int n_rows = M->n_indptr - 1;
+
+    F->n_indptr = M->n_indptr;
+    F->word_ptr = malloc(M->n_indptr*sizeof(long));
+    F->base = malloc((n_rows > 0 ? n_rows : 1)*sizeof(int));
+
+    // k = bits_per_entry*ln(2) minimises false positives, and at most 5
+    // hashes fit in the 32 bits of hash not used to pick the word.
+    F->n_hashes = (int)(0.693*bits_per_entry + 0.5);
+    F->n_hashes = F->n_hashes < 1 ? 1 : (F->n_hashes > 5 ? 5 : F->n_hashes);
+
+    // First size the filter of each row and pick its kind.
+    F->word_ptr[0] = 0;
+    for (i=0; i<n_rows; i++) {
+        int start = M->indptr[i];
+        int n = M->indptr[i+1] - start;
+        long n_words = 0;
+        // A Bloom filter unless the row fits in a bitmap. Empty rows are
+        // never tested but get a base too so saved filters are reproducible.
+        F->base[i] = -1;
+        if (n > 0) {
+            long span = (long)M->indices[start + n - 1] - M->indices[start] + 1;
+            n_words = ((long)n*bits_per_entry + 63)/64;
+            if (span <= 64*n_words) {
+                n_words = (span + 63)/64;
+                F->base[i] = M->indices[start];
+            }
+        }
+        F->word_ptr[i+1] = F->word_ptr[i] + n_words;
+    }
+    F->words = calloc(F->word_ptr[n_rows] > 0 ? F->word_ptr[n_rows] : 1,
+                      sizeof(uint64_t));
+    huge_advise(F->words, F->word_ptr[n_rows]*sizeof(uint64_t));
+
+    if (n_threads != -1) {
+        omp_set_num_threads(n_threads);
+    }
+
+    // Then fill them in. Each row has its own words so there are no races.
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (i=0; i<n_rows; i++) {
+        int j;
+        long start = F->word_ptr[i];
+        long n_words = F->word_ptr[i+1] - start;
+        for (j=M->indptr[i]; j<M->indptr[i+1]; j++) {
+            int x = M->indices[j];
+            if (F->base[i] != -1) {
+                long bit = (long)x - F->base[i];
+                F->words[start + bit/64] |= (uint64_t)1 << (bit % 64);
+            } else {
+                uint64_t h = filter_hash(i, x);
+                F->words[start + (long)(((h >> 32)*(uint64_t)n_words) >> 32)]
+                    |= filter_mask(h, F->n_hashes);
+            }
+        }
+    }
+}
+
+void filter_free(FILTER *F) {
+    free(F->word_ptr);
+    free(F->base);
+    free(F->words);
+}
+
+long filter_nbytes(FILTER *F) {
+    // Total memory used by the filters.
+    long n_rows = F->n_indptr - 1;
+    return F->n_indptr*sizeof(long) + n_rows*sizeof(int)
+           + F->word_ptr[n_rows]*sizeof(uint64_t);
+}
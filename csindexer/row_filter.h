@@ -0,0 +1,78 @@
+/* Per row (or column) filters over the indices of a compressed sparse matrix
+ * that reject most indices that are not stored with a single memory access,
+ * so searches for missing entries can be skipped. */
+#ifndef CSINDEXER_ROW_FILTER_H_
+#define CSINDEXER_ROW_FILTER_H_
+
+#include <stdint.h>
+#include "indexer_c.h"
+
+typedef struct FILTER {
+    // Each row has a run of 64 bit words which is either
+    //     a bitmap: bit x - base[row] is set for every stored index x, used
+    //               when the indices of the row span no more bits than the
+    //               Bloom filter would need.
+    //     a blocked Bloom filter (base[row] == -1): an index sets n_hashes
+    //               bits of a single word so a test is one memory access.
+    // Rows without stored entries have no words and reject everything.
+    int n_indptr;      // Length of indptr of the matrix
+    int n_hashes;      // Bits set per index in the Bloom filters
+    long *word_ptr;    // First word of each row, size n_indptr
+    int *base;         // Index of bit 0 of each bitmap or -1 for Bloom
+    uint64_t *words;
+} FILTER;
+
+void filter_build(FILTER *F, CS *M, int bits_per_entry, int n_threads);
+void filter_free(FILTER *F);
+long filter_nbytes(FILTER *F);
+
+static inline uint64_t filter_hash(int row, int x) {
+    // Mix the row into the hash so rows do not collide on the same words.
+    uint64_t h = ((uint64_t)(uint32_t)row << 32) | (uint32_t)x;
+    h ^= h >> 31;
+    h *= 0x7fb5d329728ea185ULL;
+    h ^= h >> 27;
+    h *= 0x81dadef4bc2dd44dULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline uint64_t filter_mask(uint64_t h, int n_hashes) {
+    // The bits of a Bloom word set by an index, 6 bits of the hash each.
+    uint64_t mask = 0;
+    int i;
+    for (i=0; i<n_hashes; i++) {
+        mask |= (uint64_t)1 << ((h >> (6*i)) & 63);
+    }
+    return mask;
+}
+
+static inline int filter_maybe_contains(FILTER *F, int row, int x) {
+    // Returns 0 if x is definitely not stored in row, otherwise 1.
+    long start = F->word_ptr[row];
+    long n_words = F->word_ptr[row+1] - start;
+    uint64_t h;
+    uint64_t mask;
+    long bit;
+
+    if (n_words == 0) {
+        return 0;
+    }
+
+    if (F->base[row] != -1) {
+        bit = (long)x - F->base[row];
+        if ((bit < 0) || (bit >= 64*n_words)) {
+            return 0;
+        }
+        return (F->words[start + bit/64] >> (bit % 64)) & 1;
+    }
+
+    // The word is picked by the top 32 bits of the hash (without a modulo)
+    // and the bits within it by the rest.
+    h = filter_hash(row, x);
+    mask = filter_mask(h, F->n_hashes);
+    return (F->words[start + (long)(((h >> 32)*(uint64_t)n_words) >> 32)]
+            & mask) == mask;
+}
+
+#endif  // CSINDEXER_ROW_FILTER_H_
@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+#include "scatter_add.h"
+#include "arena.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Whether the AVX-512 kernel may be used if the CPU supports it.
+static int simd_enabled = 1;
+
+void scatter_add_set_simd(int enabled) {
+    simd_enabled = enabled;
+}
+
+int scatter_add_simd(void) {
+    // Whether the AVX-512 kernel is used, which needs the foundation and
+    // conflict detection instructions.
+#if defined(__x86_64__)
+    return simd_enabled && __builtin_cpu_supports("avx512f")
+           && __builtin_cpu_supports("avx512cd");
+#else
+    return 0;
+#endif
+}
+
+static void add_scalar(double *x, long *offsets, double *y, double *weights,
+                       double alpha, long n) {
+    // x[offsets[i]] += w_i*y[i] for every i with an offset other than -1,
+    // where w_i is weights[i] or alpha if there are no weights.
+    long i;
+    for (i=0; i<n; i++) {
+        if (offsets[i] != -1) {
+            x[offsets[i]] += (weights == NULL ? alpha : weights[i])*y[i];
+        }
+    }
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx512f,avx512cd")))
+static void add_avx512(double *x, long *offsets, double *y, double *weights,
+                       double alpha, long n) {
+    // As add_scalar, 8 entries at a time. Entries of a vector with the same
+    // offset are found with a conflict detection and each one accumulates
+    // the values of the earlier ones, so the last of them holds the sum.
+    // Scatters write the lanes in order so it is the last that is stored.
+    const __m512i missing = _mm512_set1_epi64(-1);
+    const __m512i one = _mm512_set1_epi64(1);
+    const __m512i top = _mm512_set1_epi64(63);
+    const __m512d alpha_v = _mm512_set1_pd(alpha);
+    long i;
+
+    for (i=0; i+8<=n; i+=8) {
+        __m512i idx = _mm512_loadu_si512((void *)&offsets[i]);
+        __mmask8 valid = _mm512_cmpneq_epi64_mask(idx, missing);
+        __m512d w = weights == NULL ? alpha_v : _mm512_loadu_pd(&weights[i]);
+        __m512d v = _mm512_mul_pd(w, _mm512_loadu_pd(&y[i]));
+        __m512d sum = v;
+        __m512d old;
+
+        // Bit k of lane j is set if lane k < j has the same offset. Lanes
+        // that are missing never conflict.
+        __m512i conflicts = _mm512_and_si512(
+            _mm512_maskz_conflict_epi64(valid, idx),
+            _mm512_set1_epi64(valid));
+        __mmask8 todo = _mm512_test_epi64_mask(conflicts, conflicts);
+
+        // Add the earlier lanes one at a time, highest first.
+        while (todo) {
+            __m512i k = _mm512_sub_epi64(top, _mm512_lzcnt_epi64(conflicts));
+            sum = _mm512_mask_add_pd(sum, todo, sum,
+                                     _mm512_permutexvar_pd(k, v));
+            conflicts = _mm512_mask_andnot_epi64(conflicts, todo,
+                                                 _mm512_sllv_epi64(one, k),
+                                                 conflicts);
+            todo = _mm512_test_epi64_mask(conflicts, conflicts);
+        }
+
+        old = _mm512_mask_i64gather_pd(_mm512_setzero_pd(), valid, idx, x, 8);
+        _mm512_mask_i64scatter_pd(x, valid, idx, _mm512_add_pd(old, sum), 8);
+    }
+
+    add_scalar(x, &offsets[i], &y[i], weights == NULL ? NULL : &weights[i],
+               alpha, n - i);
+}
+#endif
+
+static void add_kernel(double *x, long *offsets, double *y, double *weights,
+                       double alpha, long n, int simd) {
+#if defined(__x86_64__)
+    if (simd) {
+        add_avx512(x, offsets, y, weights, alpha, n);
+        return;
+    }
+#endif
+    add_scalar(x, offsets, y, weights, alpha, n);
+}
+
+void compressed_sparse_add_scatter(CS *M, double *x, COO *indexer, double *y,
+                                   OP *op, int search_type, int n_threads) {
+    /*
+    Add (OP_ADD) or weighted add (OP_AXPY_ADD) the values y of indexer to the
+    values x of M without atomics. The offset of every entry is found first
+    and the entries are then split into buckets of disjoint ranges of x so
+    each bucket is only added to by one thread.
+    Inputs:
+        M: A compressed sparse matrix in CSC or CSR form.
+        x: Values of M, like M->data.
+        indexer: The entries to add to in any order.
+        y: Values of the indexer.
+        op: The operation, either OP_ADD or OP_AXPY_ADD.
+    */
+    long nnz = indexer->nnz;
+    long M_nnz = M->indptr[M->n_indptr - 1];
+    long *offsets = scratch_get(M->arena, SCRATCH_OFFSETS, nnz*sizeof(long));
+    double alpha = op->type == OP_AXPY_ADD ? op->alpha : 1;
+    double *weights = op->type == OP_AXPY_ADD ? op->weights : NULL;
+    int simd = scatter_add_simd();
+    int n_chunks;
+    int n_buckets;
+    int c, b;
+    long total;
+    long *count;
+    long *bucket_ptr;
+    long *bucket_offsets;
+    double *bucket_values;
+
+    compressed_sparse_locate(M, indexer, offsets, search_type, n_threads);
+
+    n_chunks = omp_get_max_threads();
+    if ((n_chunks == 1) || (M_nnz == 0)) {
+        add_kernel(x, offsets, y, weights, alpha, nnz, simd);
+        scratch_put(M->arena, SCRATCH_OFFSETS, offsets, nnz*sizeof(long));
+        return;
+    }
+    n_buckets = n_chunks*SCATTER_BUCKETS_PER_THREAD;
+
+    // Count the entries of each chunk of the indexer in each bucket.
+    count = scratch_get(M->arena, SCRATCH_COUNTS,
+                        (long)n_chunks*n_buckets*sizeof(long));
+    memset(count, 0, (long)n_chunks*n_buckets*sizeof(long));
+    #pragma omp parallel for schedule(static, 1)
+    for (c=0; c<n_chunks; c++) {
+        long i;
+        long *chunk_count = &count[(long)c*n_buckets];
+        for (i=nnz*c/n_chunks; i<nnz*(c+1)/n_chunks; i++) {
+            if (offsets[i] != -1) {
+                chunk_count[offsets[i]*n_buckets/M_nnz] += 1;
+            }
+        }
+    }
+
+    // Turn the counts into where each chunk writes to each bucket.
+    bucket_ptr = scratch_get(M->arena, SCRATCH_BUCKET_PTR,
+                             (n_buckets + 1)*sizeof(long));
+    total = 0;
+    for (b=0; b<n_buckets; b++) {
+        bucket_ptr[b] = total;
+        for (c=0; c<n_chunks; c++) {
+            long temp = count[(long)c*n_buckets + b];
+            count[(long)c*n_buckets + b] = total;
+            total += temp;
+        }
+    }
+    bucket_ptr[n_buckets] = total;
+
+    // Write out the offsets and the weighted values of each bucket.
+    bucket_offsets = scratch_get(M->arena, SCRATCH_BUCKET_OFFSETS,
+                                 total*sizeof(long));
+    bucket_values = scratch_get(M->arena, SCRATCH_BUCKET_VALUES,
+                                total*sizeof(double));
+    #pragma omp parallel for schedule(static, 1)
+    for (c=0; c<n_chunks; c++) {
+        long i;
+        long *chunk_pos = &count[(long)c*n_buckets];
+        for (i=nnz*c/n_chunks; i<nnz*(c+1)/n_chunks; i++) {
+            if (offsets[i] != -1) {
+                long pos = chunk_pos[offsets[i]*n_buckets/M_nnz]++;
+                bucket_offsets[pos] = offsets[i];
+                bucket_values[pos] = weights == NULL ? alpha*y[i]
+                                                     : weights[i]*y[i];
+            }
+        }
+    }
+
+    // And add each bucket in by a single thread.
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (b=0; b<n_buckets; b++) {
+        add_kernel(x, &bucket_offsets[bucket_ptr[b]],
+                   &bucket_values[bucket_ptr[b]], NULL, 1,
+                   bucket_ptr[b+1] - bucket_ptr[b], simd);
+    }
+
+    scratch_put(M->arena, SCRATCH_OFFSETS, offsets, nnz*sizeof(long));
+    scratch_put(M->arena, SCRATCH_COUNTS, count,
+                (long)n_chunks*n_buckets*sizeof(long));
+    scratch_put(M->arena, SCRATCH_BUCKET_PTR, bucket_ptr,
+                (n_buckets + 1)*sizeof(long));
+    scratch_put(M->arena, SCRATCH_BUCKET_OFFSETS, bucket_offsets,
+                total*sizeof(long));
+    scratch_put(M->arena, SCRATCH_BUCKET_VALUES, bucket_values,
+                total*sizeof(double));
+}
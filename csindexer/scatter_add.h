@@ -0,0 +1,15 @@
+#ifndef CSINDEXER_SCATTER_ADD_H_
+#define CSINDEXER_SCATTER_ADD_H_
+
+#include "indexer_c.h"
+
+// Buckets of offsets per thread, so a few hot entries do not leave a single
+// thread with all of the work.
+#define SCATTER_BUCKETS_PER_THREAD 8
+
+void scatter_add_set_simd(int enabled);
+int scatter_add_simd(void);
+void compressed_sparse_add_scatter(CS *M, double *x, COO *indexer, double *y,
+                                   OP *op, int search_type, int n_threads);
+
+#endif  // CSINDEXER_SCATTER_ADD_H_
@@ -0,0 +1,413 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sidecar.h"
+
+static uint64_t hash_bytes(const void *data, long n, uint64_t h) {
+    // A fast 64 bit hash of n bytes, continuing from h. It is only used to
+    // spot corrupt files and changed matrices, not against an adversary.
+    const unsigned char *p = data;
+    uint64_t word;
+    long i;
+
+    h ^= (uint64_t)n*0xff51afd7ed558ccdULL;
+    for (i=0; i+8<=n; i+=8) {
+        memcpy(&word, p + i, sizeof(word));
+        h = (h ^ word)*0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    if (i < n) {
+        word = 0;
+        memcpy(&word, p + i, n - i);
+        h = (h ^ word)*0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+static uint64_t matrix_fingerprint(CS *M) {
+    // A cheap key of the sparsity pattern of M from its shape, indptr and an
+    // evenly spaced sample of its indices.
+    long nnz = M->indptr[M->n_indptr - 1];
+    long samples = nnz < SIDECAR_SAMPLES ? nnz : SIDECAR_SAMPLES;
+    int64_t shape[3] = {M->CSR, M->n_indptr, nnz};
+    int sample[SIDECAR_SAMPLES];
+    uint64_t h;
+    long k;
+
+    h = hash_bytes(shape, sizeof(shape), 0);
+    h = hash_bytes(M->indptr, M->n_indptr*sizeof(int), h);
+    for (k=0; k<samples; k++) {
+        sample[k] = M->indices[k*nnz/samples];
+    }
+    return hash_bytes(sample, samples*sizeof(int), h);
+}
+
+static uint64_t matrix_content(CS *M) {
+    // A key of the whole sparsity pattern of M.
+    long nnz = M->indptr[M->n_indptr - 1];
+    return hash_bytes(M->indices, nnz*sizeof(int), matrix_fingerprint(M));
+}
+
+static long align(long offset) {
+    return (offset + SIDECAR_ALIGN - 1)/SIDECAR_ALIGN*SIDECAR_ALIGN;
+}
+
+static int pointers_valid(const int *ptr, long n, long last) {
+    // Whether an indptr like array of n entries starts at 0, never decreases
+    // and ends at last, so every run it describes lies inside its section.
+    long i;
+    if ((ptr[0] != 0) || (ptr[n-1] != last)) {
+        return 0;
+    }
+    for (i=1; i<n; i++) {
+        if (ptr[i] < ptr[i-1]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int long_pointers_valid(const long *ptr, long n, long last) {
+    // As pointers_valid for an array of longs.
+    long i;
+    if ((ptr[0] != 0) || (ptr[n-1] != last)) {
+        return 0;
+    }
+    for (i=1; i<n; i++) {
+        if (ptr[i] < ptr[i-1]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int sidecar_write(const char *path, int kind, CS *M, int32_t *params,
+                         void **sections, long *bytes, int n_sections) {
+    // Write the sections to a temporary file of our own, flush it to disk
+    // and then move it to path, so a reader never sees a partly written
+    // sidecar and concurrent writers never write to the same file.
+    static const char zeros[SIDECAR_ALIGN] = {0};
+    SIDECAR_HEADER header;
+    char *tmp = malloc(strlen(path) + 8);
+    long offset = align(sizeof(header));
+    FILE *f;
+    int fd;
+    int ok;
+    int s;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SIDECAR_MAGIC, sizeof(header.magic));
+    header.version = SIDECAR_VERSION;
+    header.kind = kind;
+    header.endian = 0x01020304;
+    memcpy(header.params, params, sizeof(header.params));
+    header.fingerprint = matrix_fingerprint(M);
+    header.content = matrix_content(M);
+    header.n_sections = n_sections;
+    for (s=0; s<n_sections; s++) {
+        header.offset[s] = offset;
+        header.bytes[s] = bytes[s];
+        header.checksum = hash_bytes(sections[s], bytes[s], header.checksum);
+        offset = align(offset + bytes[s]);
+    }
+    header.file_bytes = offset;
+
+    sprintf(tmp, "%s.XXXXXX", path);
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        free(tmp);
+        return SIDECAR_IO_ERROR;
+    }
+    f = fdopen(fd, "wb");
+    if (f == NULL) {
+        close(fd);
+        remove(tmp);
+        free(tmp);
+        return SIDECAR_IO_ERROR;
+    }
+    ok = fchmod(fd, 0644) == 0;
+    ok = ok && (fwrite(&header, sizeof(header), 1, f) == 1);
+    ok = ok && (fwrite(zeros, 1, header.offset[0] - sizeof(header), f)
+                == header.offset[0] - sizeof(header));
+    for (s=0; s<n_sections; s++) {
+        long padding = align(bytes[s]) - bytes[s];
+        ok = ok && ((long)fwrite(sections[s], 1, bytes[s], f) == bytes[s]);
+        ok = ok && ((long)fwrite(zeros, 1, padding, f) == padding);
+    }
+    ok = ok && (fflush(f) == 0) && (fsync(fd) == 0);
+    ok = (fclose(f) == 0) && ok;
+    ok = ok && (rename(tmp, path) == 0);
+    if (!ok) {
+        remove(tmp);
+    }
+    free(tmp);
+    return ok ? SIDECAR_OK : SIDECAR_IO_ERROR;
+}
+
+static int sidecar_map(const char *path, int kind, CS *M, int32_t *params,
+                       int n_params, int n_sections, int verify,
+                       void **sections, long *bytes, MAPPED *map) {
+    /*
+    Map the sidecar at path and check it is a sidecar of this kind built
+    from M with the first n_params settings given. This is cheap, reading
+    only the header, indptr and a sample of the indices of M. With verify
+    every section is checksummed and all of M compared as well.
+    */
+    SIDECAR_HEADER *header;
+    struct stat info;
+    int status = SIDECAR_OK;
+    int fd = open(path, O_RDONLY);
+    int s;
+
+    map->addr = NULL;
+    map->length = 0;
+    if (fd < 0) {
+        return SIDECAR_IO_ERROR;
+    }
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return SIDECAR_IO_ERROR;
+    }
+    if (info.st_size < (long)sizeof(*header)) {
+        close(fd);
+        return SIDECAR_BAD_FORMAT;
+    }
+    map->addr = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map->addr == MAP_FAILED) {
+        map->addr = NULL;
+        return SIDECAR_IO_ERROR;
+    }
+    map->length = info.st_size;
+    header = map->addr;
+
+    if ((memcmp(header->magic, SIDECAR_MAGIC, sizeof(header->magic)) != 0)
+        || (header->version != SIDECAR_VERSION)
+        || (header->kind != (uint32_t)kind)
+        || (header->endian != 0x01020304)
+        || (header->n_sections != (uint64_t)n_sections)
+        || (header->file_bytes != (uint64_t)info.st_size)) {
+        status = SIDECAR_BAD_FORMAT;
+    }
+    for (s=0; (status == SIDECAR_OK) && (s<n_sections); s++) {
+        if ((header->offset[s] % SIDECAR_ALIGN != 0)
+            || (header->offset[s] < sizeof(*header))
+            || (header->offset[s] + header->bytes[s]
+                > (uint64_t)info.st_size)) {
+            status = SIDECAR_BAD_FORMAT;
+        }
+    }
+
+    if ((status == SIDECAR_OK)
+        && ((memcmp(header->params, params, n_params*sizeof(int32_t)) != 0)
+            || (header->fingerprint != matrix_fingerprint(M)))) {
+        status = SIDECAR_WRONG_MATRIX;
+    }
+
+    if ((status == SIDECAR_OK) && verify) {
+        uint64_t checksum = 0;
+        for (s=0; s<n_sections; s++) {
+            checksum = hash_bytes((char *)map->addr + header->offset[s],
+                                  header->bytes[s], checksum);
+        }
+        if (checksum != header->checksum) {
+            status = SIDECAR_BAD_CHECKSUM;
+        } else if (header->content != matrix_content(M)) {
+            status = SIDECAR_WRONG_MATRIX;
+        }
+    }
+
+    if (status != SIDECAR_OK) {
+        sidecar_unmap(map);
+        return status;
+    }
+    for (s=0; s<n_sections; s++) {
+        sections[s] = (char *)map->addr + header->offset[s];
+        bytes[s] = header->bytes[s];
+    }
+    return SIDECAR_OK;
+}
+
+void sidecar_unmap(MAPPED *map) {
+    if (map->addr != NULL) {
+        munmap(map->addr, map->length);
+    }
+    map->addr = NULL;
+    map->length = 0;
+}
+
+int sidecar_save_learned(LEARNED *L, CS *M, const char *path) {
+    long n_segments = L->row_segment[L->n_indptr - 1];
+    int32_t params[SIDECAR_PARAMS] = {L->n_indptr, L->error, L->min_length};
+    void *sections[4] = {L->row_segment, L->key, L->pos, L->slope};
+    long bytes[4] = {L->n_indptr*sizeof(int), n_segments*sizeof(int),
+                     n_segments*sizeof(int), n_segments*sizeof(double)};
+    return sidecar_write(path, SIDECAR_LEARNED, M, params, sections, bytes,
+                         4);
+}
+
+int sidecar_load_learned(LEARNED *L, CS *M, const char *path, int error,
+                         int min_length, int verify, MAPPED *map) {
+    // Point L into the sidecar at path if it holds a learned index of M with
+    // the same error and min_length. Free it with sidecar_unmap.
+    int32_t params[SIDECAR_PARAMS] = {M->n_indptr, error, min_length};
+    void *sections[4];
+    long bytes[4];
+    long n_segments;
+    int status = sidecar_map(path, SIDECAR_LEARNED, M, params, 3, 4, verify,
+                             sections, bytes, map);
+    if (status != SIDECAR_OK) {
+        return status;
+    }
+
+    // The sizes of the sections must agree with each other, and the
+    // segments of each row lie inside them.
+    n_segments = bytes[1]/sizeof(int);
+    if ((bytes[0] != M->n_indptr*(long)sizeof(int))
+        || (bytes[1] != n_segments*(long)sizeof(int)) || (bytes[2] != bytes[1])
+        || (bytes[3] != n_segments*(long)sizeof(double))
+        || !pointers_valid(sections[0], M->n_indptr, n_segments)) {
+        sidecar_unmap(map);
+        return SIDECAR_BAD_FORMAT;
+    }
+
+    L->n_indptr = M->n_indptr;
+    L->error = error;
+    L->min_length = min_length;
+    L->row_segment = sections[0];
+    L->key = sections[1];
+    L->pos = sections[2];
+    L->slope = sections[3];
+    return SIDECAR_OK;
+}
+
+int sidecar_save_filter(FILTER *F, CS *M, int bits_per_entry,
+                        const char *path) {
+    int n_rows = F->n_indptr - 1;
+    int32_t params[SIDECAR_PARAMS] = {F->n_indptr, bits_per_entry,
+                                      F->n_hashes};
+    void *sections[3] = {F->word_ptr, F->base, F->words};
+    long bytes[3] = {F->n_indptr*sizeof(long), n_rows*sizeof(int),
+                     F->word_ptr[n_rows]*sizeof(uint64_t)};
+    return sidecar_write(path, SIDECAR_FILTER, M, params, sections, bytes, 3);
+}
+
+int sidecar_load_filter(FILTER *F, CS *M, const char *path,
+                        int bits_per_entry, int verify, MAPPED *map) {
+    // Point F into the sidecar at path if it holds a filter of M with the
+    // same bits_per_entry. Free it with sidecar_unmap.
+    int n_rows = M->n_indptr - 1;
+    int32_t params[SIDECAR_PARAMS] = {M->n_indptr, bits_per_entry};
+    void *sections[3];
+    long bytes[3];
+    int n_hashes;
+    int status = sidecar_map(path, SIDECAR_FILTER, M, params, 2, 3, verify,
+                             sections, bytes, map);
+    if (status != SIDECAR_OK) {
+        return status;
+    }
+
+    // The words of each row must lie inside the words section.
+    n_hashes = ((SIDECAR_HEADER *)map->addr)->params[2];
+    if ((bytes[0] != M->n_indptr*(long)sizeof(long))
+        || (bytes[1] != n_rows*(long)sizeof(int))
+        || (bytes[2] % sizeof(uint64_t) != 0)
+        || !long_pointers_valid(sections[0], M->n_indptr,
+                                bytes[2]/sizeof(uint64_t))
+        || (n_hashes < 1) || (n_hashes > 5)) {
+        sidecar_unmap(map);
+        return SIDECAR_BAD_FORMAT;
+    }
+
+    F->n_indptr = M->n_indptr;
+    F->n_hashes = n_hashes;
+    F->word_ptr = sections[0];
+    F->base = sections[1];
+    F->words = sections[2];
+    return SIDECAR_OK;
+}
+
+int sidecar_save_packed(PACKED *P, CS *M, const char *path) {
+    long n_blocks = P->row_block[P->n_indptr - 1];
+    int32_t params[SIDECAR_PARAMS] = {P->n_indptr};
+    void *sections[5] = {P->row_block, P->first, P->bits, P->offset,
+                         P->packed};
+    long bytes[5] = {P->n_indptr*sizeof(int), n_blocks*sizeof(int),
+                     n_blocks*sizeof(unsigned char),
+                     (n_blocks + 1)*sizeof(long), P->packed_bytes};
+    return sidecar_write(path, SIDECAR_PACKED, M, params, sections, bytes, 5);
+}
+
+int sidecar_load_packed(PACKED *P, CS *M, const char *path, int verify,
+                        MAPPED *map) {
+    // Point P into the sidecar at path if it holds the packed indices of M.
+    // Free them with sidecar_unmap.
+    int32_t params[SIDECAR_PARAMS] = {M->n_indptr};
+    void *sections[5];
+    long bytes[5];
+    long n_blocks;
+    int *row_block;
+    unsigned char *bits;
+    long *offset;
+    long i;
+    int status = sidecar_map(path, SIDECAR_PACKED, M, params, 1, 5, verify,
+                             sections, bytes, map);
+    if (status != SIDECAR_OK) {
+        return status;
+    }
+
+    n_blocks = bytes[1]/sizeof(int);
+    if ((bytes[0] != M->n_indptr*(long)sizeof(int))
+        || (bytes[1] != n_blocks*(long)sizeof(int))
+        || (bytes[2] != n_blocks*(long)sizeof(unsigned char))
+        || (bytes[3] != (n_blocks + 1)*(long)sizeof(long))
+        || !pointers_valid(sections[0], M->n_indptr, n_blocks)
+        || !long_pointers_valid(sections[3], n_blocks + 1,
+                                bytes[4] - PACKED_PADDING)) {
+        sidecar_unmap(map);
+        return SIDECAR_BAD_FORMAT;
+    }
+
+    // Every row must have as many blocks as its length needs, so a block
+    // never decodes more than PACKED_BLOCK indices, and every block must be
+    // packed at most 32 bits wide into exactly the bytes it needs.
+    row_block = sections[0];
+    bits = sections[2];
+    offset = sections[3];
+    for (i=0; (status == SIDECAR_OK) && (i<M->n_indptr - 1); i++) {
+        int n = M->indptr[i+1] - M->indptr[i];
+        int b;
+        if (row_block[i+1] - row_block[i]
+            != (n + PACKED_BLOCK - 1)/PACKED_BLOCK) {
+            status = SIDECAR_BAD_FORMAT;
+        }
+        for (b=row_block[i]; (status == SIDECAR_OK) && (b<row_block[i+1]);
+             b++) {
+            int length = n - (b - row_block[i])*PACKED_BLOCK;
+            length = length < PACKED_BLOCK ? length : PACKED_BLOCK;
+            if ((bits[b] > 32)
+                || (offset[b+1] - offset[b]
+                    != ((long)(length - 1)*bits[b] + 7)/8)) {
+                status = SIDECAR_BAD_FORMAT;
+            }
+        }
+    }
+    if (status != SIDECAR_OK) {
+        sidecar_unmap(map);
+        return status;
+    }
+
+    P->n_indptr = M->n_indptr;
+    P->row_block = sections[0];
+    P->first = sections[1];
+    P->bits = sections[2];
+    P->offset = sections[3];
+    P->packed = sections[4];
+    P->packed_bytes = bytes[4];
+    return SIDECAR_OK;
+}
@@ -0,0 +1,72 @@
+/* Sidecar files holding the search structures built from a matrix, so a new
+ * process can map them straight from disk rather than building them again.
+ * A file is versioned, checksummed and keyed to the sparsity pattern of the
+ * matrix it was built from. */
+#ifndef CSINDEXER_SIDECAR_H_
+#define CSINDEXER_SIDECAR_H_
+
+#include <stdint.h>
+#include "indexer_c.h"
+#include "learned_index.h"
+#include "row_filter.h"
+#include "packed_indices.h"
+
+#define SIDECAR_MAGIC "CSIDXSC"
+#define SIDECAR_VERSION 1
+#define SIDECAR_SECTIONS 8
+#define SIDECAR_PARAMS 4
+#define SIDECAR_ALIGN 64
+
+// Indices of the matrix sampled into its fingerprint.
+#define SIDECAR_SAMPLES 4096
+
+// What a file holds.
+enum {
+    SIDECAR_LEARNED = 1,
+    SIDECAR_FILTER,
+    SIDECAR_PACKED
+};
+
+// Results of saving and loading.
+enum {
+    SIDECAR_OK = 0,
+    SIDECAR_IO_ERROR = -1,       // Could not read or write the file
+    SIDECAR_BAD_FORMAT = -2,     // Not a sidecar of this version and kind
+    SIDECAR_WRONG_MATRIX = -3,   // Built from another matrix or settings
+    SIDECAR_BAD_CHECKSUM = -4    // The contents are corrupt
+};
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t kind;
+    uint32_t endian;                   // 0x01020304 as written
+    int32_t params[SIDECAR_PARAMS];    // Settings of the structure
+    uint64_t fingerprint;              // Cheap key of the matrix
+    uint64_t content;                  // Key of all indices of the matrix
+    uint64_t checksum;                 // Of every section
+    uint64_t file_bytes;
+    uint64_t n_sections;
+    uint64_t offset[SIDECAR_SECTIONS];  // Where each section starts
+    uint64_t bytes[SIDECAR_SECTIONS];   // Size of each section
+} SIDECAR_HEADER;
+
+typedef struct {
+    // A sidecar mapped into memory, which the loaded structure points into.
+    void *addr;
+    long length;
+} MAPPED;
+
+int sidecar_save_learned(LEARNED *L, CS *M, const char *path);
+int sidecar_load_learned(LEARNED *L, CS *M, const char *path, int error,
+                         int min_length, int verify, MAPPED *map);
+int sidecar_save_filter(FILTER *F, CS *M, int bits_per_entry,
+                        const char *path);
+int sidecar_load_filter(FILTER *F, CS *M, const char *path,
+                        int bits_per_entry, int verify, MAPPED *map);
+int sidecar_save_packed(PACKED *P, CS *M, const char *path);
+int sidecar_load_packed(PACKED *P, CS *M, const char *path, int verify,
+                        MAPPED *map);
+void sidecar_unmap(MAPPED *map);
+
+#endif  // CSINDEXER_SIDECAR_H_
@@ -0,0 +1,274 @@
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+#include "snapshot.h"
+#include "operations.h"
+
+void snapshot_init(SNAPSHOT *S, CS *M, int page_shift) {
+    /*
+    Build a snapshot matrix from a copy of M.
+    Inputs:
+        S: The snapshot matrix to initialise. Free it with snapshot_free.
+        M: A compressed sparse matrix in CSC or CSR form.
+        page_shift: Pages hold 1 << page_shift values. Writes copy every
+                    page they touch so smaller pages suit sparse batches.
+    */
+    long p;
+    long page_size = 1L << page_shift;
+
+    S->nnz = M->indptr[M->n_indptr - 1];
+    memset(&S->base, 0, sizeof(CS));
+    S->base.CSR = M->CSR;
+    S->base.n_indptr = M->n_indptr;
+    S->base.indptr = malloc(M->n_indptr*sizeof(int));
+    S->base.indices = malloc((S->nnz > 0 ? S->nnz : 1)*sizeof(int));
+    memcpy(S->base.indptr, M->indptr, M->n_indptr*sizeof(int));
+    memcpy(S->base.indices, M->indices, S->nnz*sizeof(int));
+
+    S->page_shift = page_shift;
+    S->n_pages = (S->nnz + page_size - 1) >> page_shift;
+    S->table = malloc((S->n_pages > 0 ? S->n_pages : 1)*sizeof(double *));
+    for (p=0; p<S->n_pages; p++) {
+        long n = S->nnz - (p << page_shift);
+        n = n < page_size ? n : page_size;
+        S->table[p] = malloc(page_size*sizeof(double));
+        memcpy(S->table[p], &M->data[p << page_shift], n*sizeof(double));
+    }
+
+    S->epoch = 1;
+    memset(S->readers, 0, sizeof(S->readers));
+    S->retired = NULL;
+    S->n_retired = 0;
+    omp_init_lock(&S->write_lock);
+}
+
+static void free_retired(RETIRED *R) {
+    long p;
+    for (p=0; p<R->n_pages; p++) {
+        free(R->pages[p]);
+    }
+    free(R->pages);
+    free(R->table);
+    free(R);
+}
+
+void snapshot_free(SNAPSHOT *S) {
+    // There must be no readers or writers left.
+    long p;
+    while (S->retired != NULL) {
+        RETIRED *next = S->retired->next;
+        free_retired(S->retired);
+        S->retired = next;
+    }
+    for (p=0; p<S->n_pages; p++) {
+        free(S->table[p]);
+    }
+    free(S->table);
+    free(S->base.indptr);
+    free(S->base.indices);
+    omp_destroy_lock(&S->write_lock);
+}
+
+static long *reader_enter(SNAPSHOT *S, double ***table) {
+    // Claim a reader slot in the current epoch and get the page table to
+    // read from, which stays valid until reader_exit.
+    long epoch = __atomic_load_n(&S->epoch, __ATOMIC_SEQ_CST);
+    long zero = 0;
+    int slot = 0;
+
+    while (!__atomic_compare_exchange_n(
+                &S->readers[slot*SNAPSHOT_SLOT_STRIDE], &zero, epoch, 0,
+                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        // Try the next slot, waiting only if all of them are taken.
+        zero = 0;
+        slot = (slot + 1) % SNAPSHOT_READERS;
+        epoch = __atomic_load_n(&S->epoch, __ATOMIC_SEQ_CST);
+    }
+
+    *table = __atomic_load_n(&S->table, __ATOMIC_SEQ_CST);
+    return &S->readers[slot*SNAPSHOT_SLOT_STRIDE];
+}
+
+static void reader_exit(long *slot) {
+    __atomic_store_n(slot, 0, __ATOMIC_RELEASE);
+}
+
+static void reclaim(SNAPSHOT *S) {
+    // Free the page tables that no reader can still hold, which are those
+    // retired in or before the epoch of the oldest reader. Only called by
+    // the writer holding the lock.
+    long oldest = __atomic_load_n(&S->epoch, __ATOMIC_SEQ_CST);
+    RETIRED **R = &S->retired;
+    int slot;
+
+    for (slot=0; slot<SNAPSHOT_READERS; slot++) {
+        long epoch = __atomic_load_n(&S->readers[slot*SNAPSHOT_SLOT_STRIDE],
+                                     __ATOMIC_SEQ_CST);
+        if ((epoch != 0) && (epoch < oldest)) {
+            oldest = epoch;
+        }
+    }
+
+    while (*R != NULL) {
+        if ((*R)->epoch <= oldest) {
+            RETIRED *next = (*R)->next;
+            free_retired(*R);
+            *R = next;
+            S->n_retired -= 1;
+        } else {
+            R = &(*R)->next;
+        }
+    }
+}
+
+static inline __attribute__((always_inline))
+void snapshot_loop(SNAPSHOT *S, double **table, long *offsets, COO *indexer,
+                   OP *op, const int type) {
+    // Apply op between the values of table and the indexer, at the offsets
+    // already found for it.
+    long i;
+    long mask = (1L << S->page_shift) - 1;
+
+    #pragma omp parallel for schedule(dynamic, 256)
+    for (i=0; i<indexer->nnz; i++) {
+        long offset = offsets[i];
+        if (offset != -1) {
+            apply_entry(type, op, &table[offset >> S->page_shift][offset & mask],
+                        &indexer->data[i], i);
+        }
+    }
+}
+
+static void snapshot_apply(SNAPSHOT *S, double **table, long *offsets,
+                           COO *indexer, OP *op) {
+    // Dispatch to a loop with the operation compiled into it.
+    switch (op->type) {
+        case OP_GET:
+            snapshot_loop(S, table, offsets, indexer, op, OP_GET);
+            break;
+        case OP_SET:
+            snapshot_loop(S, table, offsets, indexer, op, OP_SET);
+            break;
+        case OP_ADD:
+            snapshot_loop(S, table, offsets, indexer, op, OP_ADD);
+            break;
+        case OP_MUL:
+            snapshot_loop(S, table, offsets, indexer, op, OP_MUL);
+            break;
+        case OP_MIN:
+            snapshot_loop(S, table, offsets, indexer, op, OP_MIN);
+            break;
+        case OP_MAX:
+            snapshot_loop(S, table, offsets, indexer, op, OP_MAX);
+            break;
+        case OP_AXPY_GET:
+            snapshot_loop(S, table, offsets, indexer, op, OP_AXPY_GET);
+            break;
+        case OP_AXPY_ADD:
+            snapshot_loop(S, table, offsets, indexer, op, OP_AXPY_ADD);
+            break;
+    }
+}
+
+static void snapshot_write(SNAPSHOT *S, long *offsets, COO *indexer, OP *op) {
+    // Apply a whole batch to copies of the pages it touches and publish them
+    // together.
+    long i, p;
+    long n_replaced = 0;
+    long page_size = 1L << S->page_shift;
+    double **old_table;
+    double **new_table;
+    char *touched;
+    RETIRED *R;
+
+    omp_set_lock(&S->write_lock);
+    old_table = S->table;
+    new_table = malloc((S->n_pages > 0 ? S->n_pages : 1)*sizeof(double *));
+    memcpy(new_table, old_table, S->n_pages*sizeof(double *));
+
+    // Copy every page the batch touches.
+    touched = calloc(S->n_pages > 0 ? S->n_pages : 1, sizeof(char));
+    for (i=0; i<indexer->nnz; i++) {
+        if (offsets[i] != -1) {
+            touched[offsets[i] >> S->page_shift] = 1;
+        }
+    }
+    for (p=0; p<S->n_pages; p++) {
+        n_replaced += touched[p];
+    }
+
+    R = malloc(sizeof(RETIRED));
+    R->pages = malloc((n_replaced > 0 ? n_replaced : 1)*sizeof(double *));
+    R->n_pages = 0;
+    for (p=0; p<S->n_pages; p++) {
+        if (touched[p]) {
+            R->pages[R->n_pages++] = old_table[p];
+            new_table[p] = malloc(page_size*sizeof(double));
+        }
+    }
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (p=0; p<S->n_pages; p++) {
+        if (touched[p]) {
+            memcpy(new_table[p], old_table[p], page_size*sizeof(double));
+        }
+    }
+
+    // Nobody else can see the copies yet.
+    snapshot_apply(S, new_table, offsets, indexer, op);
+
+    // Publish before moving to the next epoch so a reader that starts in the
+    // new epoch only ever sees the new table.
+    __atomic_store_n(&S->table, new_table, __ATOMIC_SEQ_CST);
+    R->epoch = __atomic_add_fetch(&S->epoch, 1, __ATOMIC_SEQ_CST);
+    R->table = old_table;
+    R->next = S->retired;
+    S->retired = R;
+    S->n_retired += 1;
+
+    reclaim(S);
+    omp_unset_lock(&S->write_lock);
+    free(touched);
+}
+
+void snapshot_index(SNAPSHOT *S, COO *indexer, OP *op, int search_type,
+                    int n_threads) {
+    /*
+    Apply op between S and indexer. The get operations (OP_GET and
+    OP_AXPY_GET) read a single snapshot of S and any other operation is
+    applied as a single batch, so a get running at the same time as it sees
+    either none or all of it. Entries that are not stored are skipped.
+    Inputs:
+        S: A snapshot matrix.
+        indexer: The entries to apply op to in any order.
+        op: The operation to apply.
+    */
+    long *offsets = malloc((indexer->nnz > 0 ? indexer->nnz : 1)*sizeof(long));
+
+    compressed_sparse_locate(&S->base, indexer, offsets, search_type,
+                             n_threads);
+
+    if ((op->type == OP_GET) || (op->type == OP_AXPY_GET)) {
+        double **table;
+        long *slot = reader_enter(S, &table);
+        snapshot_apply(S, table, offsets, indexer, op);
+        reader_exit(slot);
+    } else {
+        snapshot_write(S, offsets, indexer, op);
+    }
+
+    free(offsets);
+}
+
+void snapshot_read(SNAPSHOT *S, double *out) {
+    // Copy a single snapshot of all values of S to out, of size S->nnz.
+    long p;
+    double **table;
+    long *slot = reader_enter(S, &table);
+
+    for (p=0; p<S->n_pages; p++) {
+        long n = S->nnz - (p << S->page_shift);
+        n = n < (1L << S->page_shift) ? n : (1L << S->page_shift);
+        memcpy(&out[p << S->page_shift], table[p], n*sizeof(double));
+    }
+    reader_exit(slot);
+}
@@ -0,0 +1,50 @@
+#ifndef CSINDEXER_SNAPSHOT_H_
+#define CSINDEXER_SNAPSHOT_H_
+
+#include <omp.h>
+#include "indexer_c.h"
+
+// Most readers that can hold a snapshot at the same time. A reader waits for
+// a free slot if there are more.
+#define SNAPSHOT_READERS 64
+
+// Readers are spread over cache lines so they do not share one.
+#define SNAPSHOT_SLOT_STRIDE 8
+
+typedef struct RETIRED {
+    // A page table replaced by a write, with the pages only it used, which
+    // are freed once no reader can still hold it.
+    long epoch;            // Readers from before this epoch may hold it
+    double **table;
+    double **pages;
+    long n_pages;
+    struct RETIRED *next;
+} RETIRED;
+
+typedef struct {
+    // A compressed sparse matrix whose values are split into pages, read
+    // through a page table. Writers copy every page a batch touches, apply
+    // the whole batch to the copies and then publish a new page table with a
+    // single atomic store (read-copy-update), so readers always see the
+    // values before or after a batch and never a mix. Readers never take a
+    // lock: they announce the epoch they started in so replaced pages are
+    // only freed once every reader that could see them has finished.
+    CS base;            // The matrix (owned by this struct, data unused)
+    long nnz;           // Total stored entries
+    int page_shift;     // Each page holds 1 << page_shift values
+    long n_pages;
+    double **table;     // The published page table
+    long epoch;         // Incremented by every publish
+    long readers[SNAPSHOT_READERS*SNAPSHOT_SLOT_STRIDE];  // Epochs or 0
+    RETIRED *retired;   // Replaced page tables waiting to be freed
+    long n_retired;
+    omp_lock_t write_lock;  // Writers are applied one batch at a time
+} SNAPSHOT;
+
+void snapshot_init(SNAPSHOT *S, CS *M, int page_shift);
+void snapshot_free(SNAPSHOT *S);
+void snapshot_index(SNAPSHOT *S, COO *indexer, OP *op, int search_type,
+                    int n_threads);
+void snapshot_read(SNAPSHOT *S, double *out);
+
+#endif  // CSINDEXER_SNAPSHOT_H_
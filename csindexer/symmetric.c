@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+#include "symmetric.h"
+#include "arena.h"
+
+static int compare_keys(const void *a, const void *b) {
+    long x = *(const long *)a;
+    long y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+void symmetric_index_sorted(CS *M, VALUES *M_values, COO *indexer,
+                            VALUES *values, OP *op, int n_threads) {
+    /*
+    The sorted search of a symmetric M. Mapping entries to the stored
+    triangle moves them to other rows (or columns) so the indexer is sorted
+    again first, keeping repeated entries in the order they were given.
+    Inputs:
+        As compressed_sparse_index_sorted_multi, where the indexer is sorted
+        as usual before the entries are mapped to the stored triangle.
+    */
+    int n = indexer->nnz;
+    int n_stored = 0;
+    int n_axis0 = M->n_indptr - 1;
+    int n_data = values->n_data;
+    long axes_bytes = 2L*n*sizeof(int);
+    long ptr_bytes = (n_axis0 + 1L)*sizeof(int);
+    long keys_bytes = (long)n*sizeof(long);
+    long perm_bytes = (long)n*sizeof(int);
+    long values_bytes = n_data*sizeof(double *)
+                        + (n_data + 1L)*n*sizeof(double);
+    // The mapped indices, which are replaced by the sorted ones once the
+    // keys are built.
+    int *axis0 = scratch_get(M->arena, SCRATCH_SYMMETRIC_AXES, axes_bytes);
+    int *axis1 = axis0 + n;
+    int *row_ptr = scratch_get(M->arena, SCRATCH_SYMMETRIC_PTR, ptr_bytes);
+    long *keys = scratch_get(M->arena, SCRATCH_SYMMETRIC_KEYS, keys_bytes);
+    int *perm = scratch_get(M->arena, SCRATCH_SYMMETRIC_PERM, perm_bytes);
+    // The pointers to each gathered value array, then the values of every
+    // entry together (stride n_data) and then the weights.
+    double **data = scratch_get(M->arena, SCRATCH_SYMMETRIC_VALUES,
+                                values_bytes);
+    double *gathered = (double *)(data + n_data);
+    double *weights = gathered + (long)n_data*n;
+    int *sorted0 = axis0;
+    int *sorted1 = axis1;
+    VALUES sorted_values = {data, n_data, n_data};
+    COO sorted_indexer;
+    OP sorted_op = *op;
+    CS A = *M;
+    int i, j;
+
+    if (n_threads != -1) {
+        omp_set_num_threads(n_threads);
+    }
+
+    #pragma omp parallel for
+    for (i=0; i<n; i++) {
+        axis0[i] = M->CSR == 1 ? indexer->row[i] : indexer->col[i];
+        axis1[i] = M->CSR == 1 ? indexer->col[i] : indexer->row[i];
+        symmetric_canonical(M, &axis0[i], &axis1[i]);
+
+        // Entries outside M cannot be stored so are left out.
+        if ((axis0[i] < 0) || (axis0[i] >= n_axis0) || (axis1[i] < 0)) {
+            axis0[i] = -1;
+        }
+    }
+
+    // A stable counting sort by axis0.
+    memset(row_ptr, 0, ptr_bytes);
+    for (i=0; i<n; i++) {
+        if (axis0[i] != -1) {
+            row_ptr[axis0[i] + 1] += 1;
+            n_stored += 1;
+        }
+    }
+    for (i=0; i<n_axis0; i++) {
+        row_ptr[i+1] += row_ptr[i];
+    }
+    for (i=0; i<n; i++) {
+        if (axis0[i] != -1) {
+            keys[row_ptr[axis0[i]]] = ((long)axis1[i] << 32) | i;
+            row_ptr[axis0[i]] += 1;
+        }
+    }
+
+    // Then each row by axis1 and where the entry was, unless it is already
+    // in order (as are the rows with no mapped entries).
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (i=0; i<n_axis0; i++) {
+        int k;
+        int start = i == 0 ? 0 : row_ptr[i-1];
+        int end = row_ptr[i];
+        for (k=start+1; k<end; k++) {
+            if (keys[k] < keys[k-1]) {
+                qsort(&keys[start], end - start, sizeof(long), compare_keys);
+                break;
+            }
+        }
+        for (k=start; k<end; k++) {
+            perm[k] = (int)(keys[k] & 0xffffffff);
+            sorted0[k] = i;
+            sorted1[k] = (int)(keys[k] >> 32);
+        }
+    }
+
+    // Gather the values (and weights) into the new order.
+    for (j=0; j<n_data; j++) {
+        data[j] = gathered + j;
+    }
+    #pragma omp parallel for private(j)
+    for (i=0; i<n_stored; i++) {
+        for (j=0; j<n_data; j++) {
+            data[j][(long)i*n_data] =
+                values->data[j][(long)perm[i]*values->stride];
+        }
+        if (op->weights != NULL) {
+            weights[i] = op->weights[perm[i]];
+        }
+    }
+    if (op->weights != NULL) {
+        sorted_op.weights = weights;
+    }
+
+    sorted_indexer.row = M->CSR == 1 ? sorted0 : sorted1;
+    sorted_indexer.col = M->CSR == 1 ? sorted1 : sorted0;
+    sorted_indexer.data = NULL;
+    sorted_indexer.nnz = n_stored;
+    A.symmetric = 0;
+    compressed_sparse_index_sorted_multi(&A, M_values, &sorted_indexer,
+                                         &sorted_values, &sorted_op,
+                                         n_threads);
+
+    // Write back any results in the original order.
+    if ((op->type == OP_GET) || (op->type == OP_AXPY_GET)) {
+        #pragma omp parallel for private(j)
+        for (i=0; i<n_stored; i++) {
+            for (j=0; j<n_data; j++) {
+                values->data[j][(long)perm[i]*values->stride] =
+                    data[j][(long)i*n_data];
+            }
+        }
+    }
+
+    scratch_put(M->arena, SCRATCH_SYMMETRIC_AXES, axis0, axes_bytes);
+    scratch_put(M->arena, SCRATCH_SYMMETRIC_PTR, row_ptr, ptr_bytes);
+    scratch_put(M->arena, SCRATCH_SYMMETRIC_KEYS, keys, keys_bytes);
+    scratch_put(M->arena, SCRATCH_SYMMETRIC_PERM, perm, perm_bytes);
+    scratch_put(M->arena, SCRATCH_SYMMETRIC_VALUES, data, values_bytes);
+}
@@ -0,0 +1,28 @@
+/* Symmetric matrices that store only one triangle. Every lookup is mapped to
+ * the stored triangle first, so (i, j) and (j, i) are the same entry. */
+#ifndef CSINDEXER_SYMMETRIC_H_
+#define CSINDEXER_SYMMETRIC_H_
+
+#include "indexer_c.h"
+
+static inline void symmetric_canonical(CS *M, int *axis0, int *axis1) {
+    // Swap the axes if (axis0, axis1) lies in the triangle that is not
+    // stored. Entries whose axis1 is outside M (negative ones included) are
+    // not stored either way and are left alone, so an axis0 inside M never
+    // becomes one outside indptr.
+    int temp;
+    if ((M->symmetric == 0) || (*axis1 < 0) || (*axis1 >= M->n_indptr - 1)) {
+        return;
+    }
+    if (((M->symmetric == 1) && (*axis0 > *axis1)) ||
+        ((M->symmetric == -1) && (*axis0 < *axis1))) {
+        temp = *axis0;
+        *axis0 = *axis1;
+        *axis1 = temp;
+    }
+}
+
+void symmetric_index_sorted(CS *M, VALUES *M_values, COO *indexer,
+                            VALUES *values, OP *op, int n_threads);
+
+#endif  // CSINDEXER_SYMMETRIC_H_
@@ -3,6 +3,8 @@ import scipy as sp
 import scipy.sparse
 from contexttimer import Timer
 import pytest
+import threading
+import asyncio
 
 from csindexer import indexer as csindexer
 
@@ -274,3 +276,1049 @@ def test_add_large(SEARCH_TYPE, large_matrix):
         assert(np.all((M_copy_cy.data - M_copy_py.data)**2 < 1e-6))
         assert(np.all((M_copy_cy.indptr - M_copy_py.indptr)**2 < 1e-6))
         assert(np.all((M_copy_cy.indices - M_copy_py.indices)**2 < 1e-6))
+
+
+@pytest.mark.parametrize("OPERATION", ['count', 'sum', 'extract'])
+def test_range_query(OPERATION, small_matrix, large_matrix):
+    print('\nRange query (%s):' % OPERATION)
+
+    for matrices, n_windows in [(small_matrix['M'], 20),
+                                (large_matrix['M'], 500)]:
+        for key in matrices:
+            print('\n%s matrix' % key)
+            M = matrices[key]
+            rows, cols = M.shape
+
+            # Random windows, some of which are empty or hang off the edge.
+            r0 = np.random.randint(0, rows, n_windows)
+            c0 = np.random.randint(0, cols, n_windows)
+            r1 = r0 + np.random.randint(0, max(rows//10, 3), n_windows)
+            c1 = c0 + np.random.randint(0, max(cols//10, 3), n_windows)
+
+            with Timer() as t:
+                out = csindexer.range_query(M, r0, r1, c0, c1, OPERATION,
+                                            N_THREADS, True)
+            print('\tCython time to query: %s' % t.elapsed)
+
+            with Timer() as t:
+                windows = [M[r0[k]:r1[k], c0[k]:c1[k]].tocoo()
+                           for k in range(n_windows)]
+            print('\tPython time to slice: %s' % t.elapsed)
+
+            for k, window in enumerate(windows):
+                if OPERATION == 'count':
+                    assert(out[k] == window.nnz)
+                elif OPERATION == 'sum':
+                    assert((out[k] - window.data.sum())**2 < 1e-6)
+                else:
+                    window_ptr, row, col, data = out
+                    lo, hi = window_ptr[k], window_ptr[k+1]
+                    got = sp.sparse.coo_matrix(
+                        (data[lo:hi], (row[lo:hi], col[lo:hi])),
+                        shape=M.shape).tocsr()[r0[k]:r1[k], c0[k]:c1[k]]
+                    assert(hi - lo == window.nnz)
+                    assert(abs(got - window).sum() < 1e-6)
+
+
+def data_positions(M, row, col):
+    # The position in M.data of each (row, col) according to scipy.
+    M_pos = M.copy()
+    M_pos.data = np.arange(M.nnz, dtype=np.float64)
+    return np.squeeze(np.array(M_pos[row, col])).astype(np.int64)
+
+
+@pytest.mark.parametrize("SEARCH_TYPE", ['binary', 'interpolation', 'joint',
+                                         'learned', 'sorted'])
+@pytest.mark.parametrize("OPERATION", ['get', 'set', 'add', 'multiply', 'min',
+                                       'max', 'axpy_get', 'axpy_add',
+                                       'axpy_get_weighted',
+                                       'axpy_add_weighted'])
+def test_operations(OPERATION, SEARCH_TYPE, large_matrix):
+    print('\nOperation %s (%s):' % (OPERATION, SEARCH_TYPE))
+    M = large_matrix['M']
+    indexer = large_matrix['indexer']
+    alpha, beta = 0.5, 2.0
+
+    for key in M:
+        row, col, data = indexer['row'], indexer['col'], indexer['data']
+        if OPERATION == 'set':
+            # Only a single copy of each entry so the result is well defined.
+            _, unique_idx = np.unique(row.astype(np.int64)*M[key].shape[1] + col,
+                                      return_index=True)
+            row, col, data = row[unique_idx], col[unique_idx], data[unique_idx]
+
+        if SEARCH_TYPE == 'sorted':
+            if key == 'CSR':
+                sort_idx = np.lexsort((col, row))
+            else:
+                sort_idx = np.lexsort((row, col))
+        else:
+            sort_idx = np.arange(row.size)
+        row, col, data = row[sort_idx], col[sort_idx], data[sort_idx]
+        weights = np.random.rand(row.size)
+
+        operation = OPERATION.replace('_weighted', '')
+        w = weights if OPERATION.endswith('_weighted') else alpha
+
+        learned_index = None
+        if SEARCH_TYPE == 'learned':
+            learned_index = csindexer.LearnedIndex(M[key], n_threads=N_THREADS)
+
+        M_cy = M[key].copy()
+        data_cy = data.copy()
+        csindexer.apply(M_cy, row, col, data_cy, operation, SEARCH_TYPE,
+                        N_THREADS, False, alpha=alpha, beta=beta,
+                        weights=weights if OPERATION.endswith('_weighted')
+                        else None, learned_index=learned_index)
+        if OPERATION.endswith('_weighted'):
+            # Strided weights would be read as if contiguous so are refused.
+            with pytest.raises(ValueError):
+                csindexer.apply(M[key].copy(), row, col, data.copy(),
+                                operation, SEARCH_TYPE, N_THREADS, False,
+                                weights=np.repeat(weights, 2)[::2],
+                                learned_index=learned_index)
+        if SEARCH_TYPE == 'learned':
+            # The models are never fitted within a lookup.
+            with pytest.raises(Exception):
+                csindexer.apply(M[key].copy(), row, col, data.copy(),
+                                operation, SEARCH_TYPE, N_THREADS, False)
+
+        pos = data_positions(M[key], row, col)
+        M_py = M[key].data.copy()
+        data_py = data.copy()
+        if operation == 'get':
+            data_py = M_py[pos]
+        elif operation == 'set':
+            M_py[pos] = data
+        elif operation == 'add':
+            np.add.at(M_py, pos, data)
+        elif operation == 'multiply':
+            np.multiply.at(M_py, pos, data)
+        elif operation == 'min':
+            np.minimum.at(M_py, pos, data)
+        elif operation == 'max':
+            np.maximum.at(M_py, pos, data)
+        elif operation == 'axpy_get':
+            data_py = w*M_py[pos] + beta*data
+        elif operation == 'axpy_add':
+            np.add.at(M_py, pos, w*data)
+
+        assert(np.all((M_cy.data - M_py)**2 < 1e-6))
+        assert(np.all((data_cy - data_py)**2 < 1e-6))
+
+
+@pytest.mark.parametrize("SEARCH_TYPE", ['binary', 'sorted'])
+@pytest.mark.parametrize("LAYOUT", ['list', 'block'])
+@pytest.mark.parametrize("OPERATION", ['get', 'add'])
+def test_apply_multi(OPERATION, LAYOUT, SEARCH_TYPE, large_matrix):
+    print('\nMulti-value %s (%s, %s):' % (OPERATION, LAYOUT, SEARCH_TYPE))
+    M = large_matrix['M']
+    indexer = large_matrix['indexer']
+    k = 3
+
+    for key in M:
+        row, col = indexer['row'], indexer['col']
+        if SEARCH_TYPE == 'sorted':
+            if key == 'CSR':
+                sort_idx = np.lexsort((col, row))
+            else:
+                sort_idx = np.lexsort((row, col))
+        else:
+            sort_idx = np.arange(row.size)
+        row, col = row[sort_idx], col[sort_idx]
+
+        M_values = np.random.rand(M[key].nnz, k)
+        values = np.random.rand(row.size, k)
+        M_values_py = M_values.copy()
+        values_py = values.copy()
+        if LAYOUT == 'list':
+            # Columns of a 2d array are strided and must be rejected.
+            with pytest.raises(ValueError):
+                csindexer.apply_multi(M[key], [M_values[:, 0]], row, col,
+                                      [values[:, 0]], OPERATION, SEARCH_TYPE,
+                                      N_THREADS, False)
+            M_values = [M_values[:, j].copy() for j in range(k)]
+            values = [values[:, j].copy() for j in range(k)]
+
+        with Timer() as t:
+            csindexer.apply_multi(M[key], M_values, row, col, values,
+                                  OPERATION, SEARCH_TYPE, N_THREADS, False)
+        print('\tCython time for %d arrays: %s' % (k, t.elapsed))
+
+        pos = data_positions(M[key], row, col)
+        if OPERATION == 'get':
+            values_py = M_values_py[pos]
+        else:
+            np.add.at(M_values_py, pos, values_py)
+
+        if LAYOUT == 'list':
+            M_values = np.stack(M_values, axis=1)
+            values = np.stack(values, axis=1)
+
+        assert(np.all((M_values - M_values_py)**2 < 1e-6))
+        assert(np.all((values - values_py)**2 < 1e-6))
+
+
+@pytest.mark.parametrize("OPERATION", ['get', 'add'])
+def test_apply_pattern(OPERATION, large_matrix):
+    print('\nPattern %s:' % OPERATION)
+    M = large_matrix['M']
+    indexer = large_matrix['indexer']
+
+    for key in M:
+        print('\n%s matrix' % key)
+        # A mask that half overlaps M.
+        rows, cols = M[key].shape
+        n_miss = indexer['row'].size
+        P = sp.sparse.coo_matrix(
+            (np.random.rand(2*n_miss),
+             (np.concatenate([indexer['row'],
+                              np.random.randint(0, rows, n_miss)]),
+              np.concatenate([indexer['col'],
+                              np.random.randint(0, cols, n_miss)]))),
+            shape=M[key].shape).asformat(key.lower())
+        P.sum_duplicates()
+        if OPERATION == 'get':
+            P.data[:] = 0
+
+        M_cy = M[key].copy()
+        P_cy = P.copy()
+        with Timer() as t:
+            csindexer.apply_pattern(M_cy, P_cy, OPERATION, N_THREADS, True)
+        print('\tCython time: %s' % t.elapsed)
+
+        if OPERATION == 'get':
+            P_coo = P.tocoo()
+            true = np.squeeze(np.array(M[key][P_coo.row, P_coo.col]))
+            assert(np.all((P_cy.data - true)**2 < 1e-6))
+        else:
+            mask = M[key].astype(bool).multiply(P).asformat(key.lower())
+            true = M[key] + mask
+            assert(abs(M_cy - true).sum() < 1e-6)
+
+
+@pytest.mark.parametrize("SEARCH_TYPE", ['binary', 'interpolation', 'joint', 'sorted'])
+@pytest.mark.parametrize("OPERATION", ['get', 'add'])
+def test_apply_block(OPERATION, SEARCH_TYPE):
+    print('\nBlock %s (%s):' % (OPERATION, SEARCH_TYPE))
+    R, C = 4, 8
+    M = sp.sparse.rand(2000//R, 4000//C, density=0.01, format='csr')
+    M = sp.sparse.kron(M, np.random.rand(R, C) + 0.1).tobsr(blocksize=(R, C))
+    M.sort_indices()
+
+    # Index entries inside stored blocks, including repeats.
+    M_coo = M.tocoo()
+    idx = np.random.choice(M.nnz, 20000, replace=True)
+    row = M_coo.row[idx].astype(np.int32)
+    col = M_coo.col[idx].astype(np.int32)
+    if SEARCH_TYPE == 'sorted':
+        sort_idx = np.lexsort((col, row))
+        row, col = row[sort_idx], col[sort_idx]
+    data = np.random.rand(row.size)
+
+    M_cy = M.copy()
+    data_cy = data.copy()
+    with Timer() as t:
+        csindexer.apply(M_cy, row, col, data_cy, OPERATION, SEARCH_TYPE,
+                        N_THREADS, True)
+    print('\tCython time: %s' % t.elapsed)
+
+    M_csr = M.tocsr()
+    if OPERATION == 'get':
+        true = np.squeeze(np.array(M_csr[row, col]))
+        assert(np.all((data_cy - true)**2 < 1e-6))
+    else:
+        M_csr += sp.sparse.coo_matrix((data, (row, col)), shape=M.shape)
+        assert(abs(M_cy.tocsr() - M_csr).sum() < 1e-6)
+
+
+def test_apply_block_unsupported():
+    M = sp.sparse.rand(50, 50, density=0.1, format='csr')
+    M = M.tobsr(blocksize=(5, 5))
+    row = np.array([0, 1], dtype=np.int32)
+    col = np.array([0, 1], dtype=np.int32)
+    data = np.zeros(2)
+
+    # Options of apply that only apply to CSR and CSC are refused.
+    with pytest.raises(Exception):
+        csindexer.apply(M, row, col, data, 'get', 'binary', N_THREADS,
+                        False, symmetric='upper')
+    with pytest.raises(Exception):
+        csindexer.apply(M, row, col, data, 'get', 'binary', N_THREADS,
+                        False, cache=csindexer.LookupCache(16))
+    with pytest.raises(Exception):
+        csindexer.apply(M, row, col, data, 'get', 'learned', N_THREADS,
+                        False)
+
+    # The sorted search needs sorted indices.
+    M.has_sorted_indices = False
+    with pytest.raises(Exception):
+        csindexer.apply(M, row, col, data, 'get', 'sorted', N_THREADS,
+                        False)
+
+
+@pytest.mark.parametrize("THRESHOLD", [10**9, 1000])
+def test_mutable_matrix(THRESHOLD, large_matrix):
+    print('\nMutable matrix (threshold %d):' % THRESHOLD)
+    M = large_matrix['M']
+    indexer = large_matrix['indexer']
+
+    for key in M:
+        print('\n%s matrix' % key)
+        rows, cols = M[key].shape
+        M_py = M[key].tolil()
+        A = csindexer.MutableMatrix(M[key], threshold=THRESHOLD)
+
+        # Insert batches of new entries mixed with existing ones.
+        for batch in range(5):
+            n = 2000
+            row = np.concatenate([np.random.randint(0, rows, n),
+                                  indexer['row'][:n]]).astype(np.int32)
+            col = np.concatenate([np.random.randint(0, cols, n),
+                                  indexer['col'][:n]]).astype(np.int32)
+            data = np.random.rand(row.size)
+            with Timer() as t:
+                A.insert(row, col, data, N_THREADS)
+            print('\tCython time to insert: %s' % t.elapsed)
+            for r, c, d in zip(row, col, data):
+                M_py[r, c] = d
+
+        assert(A.nnz == M_py.nnz)
+        if THRESHOLD < 10**9:
+            assert(A.n_delta <= THRESHOLD)
+
+        # Lookups see both the base matrix and the delta buffers.
+        M_py = M_py.asformat(key.lower())
+        data_cy = np.zeros(row.size)
+        A.apply(row, col, data_cy, 'get', 'binary', N_THREADS, True)
+        true = np.squeeze(np.array(M_py[row, col]))
+        assert(np.all((data_cy - true)**2 < 1e-6))
+
+        A.apply(row, col, np.ones(row.size), 'add', 'binary', N_THREADS,
+                False)
+        M_py += sp.sparse.coo_matrix((np.ones(row.size), (row, col)),
+                                     shape=M_py.shape)
+        assert(abs(A.to_scipy() - M_py).sum() < 1e-6)
+        assert(A.n_delta == 0)
+
+
+@pytest.mark.parametrize("SEARCH_TYPE", ['binary', 'sorted'])
+@pytest.mark.parametrize("OPERATION", ['get', 'add'])
+def test_packed_indices(OPERATION, SEARCH_TYPE, large_matrix):
+    print('\nPacked indices %s (%s):' % (OPERATION, SEARCH_TYPE))
+    M = large_matrix['M']
+    indexer = large_matrix['indexer']
+
+    # A matrix with long rows as well so rows span several blocks.
+    dense_rows = sp.sparse.rand(50, 40000, density=0.05, format='csr')
+    M = dict(M, STACKED=sp.sparse.vstack([M['CSR'], dense_rows]).tocsr())
+
+    for key in M:
+        print('\n%s matrix' % key)
+        M_cy = M[key].copy()
+        M_cy.sort_indices()
+        with Timer() as t:
+            P = csindexer.PackedIndices(M_cy, N_THREADS)
+        print('\tTime to pack: %s (compression ratio %.2f)'
+              % (t.elapsed, P.compression_ratio))
+        assert(P.compression_ratio > 1)
+
+        # Index stored entries and some that are not stored.
+        row = np.concatenate([indexer['row'],
+                              np.random.randint(0, 40000, 1000)])
+        col = np.concatenate([indexer['col'],
+                              np.random.randint(0, 40000, 1000)])
+        if key == 'STACKED':
+            coo = dense_rows.tocoo()
+            row = np.concatenate([row, coo.row + 40000])
+            col = np.concatenate([col, coo.col])
+        if SEARCH_TYPE == 'sorted':
+            if key == 'CSC':
+                sort_idx = np.lexsort((row, col))
+            else:
+                sort_idx = np.lexsort((col, row))
+            row, col = row[sort_idx], col[sort_idx]
+        row, col = row.astype(np.int32), col.astype(np.int32)
+        data = np.random.rand(row.size)
+
+        data_cy = data.copy()
+        M_py = M_cy.copy()
+        with Timer() as t:
+            P.apply(row, col, data_cy, OPERATION, SEARCH_TYPE, N_THREADS,
+                    True)
+        print('\tCython time: %s' % t.elapsed)
+
+        if OPERATION == 'get':
+            # Entries that are not stored are left untouched.
+            true = np.squeeze(np.array(M_py[row, col]))
+            stored = np.squeeze(np.array(M_py.astype(bool)[row, col]))
+            true[~stored] = data[~stored]
+            assert(np.all((data_cy - true)**2 < 1e-6))
+        else:
+            M_py += M_py.astype(bool).multiply(
+                sp.sparse.coo_matrix((data, (row, col)), shape=M_py.shape))
+            assert(abs(M_cy - M_py).sum() < 1e-6)
+
+
+@pytest.mark.parametrize("SIMD", [False, True])
+def test_packed_decode(SIMD):
+    print('\nPacked decode (simd %s):' % SIMD)
+    # Rows of every length up to a few blocks, each with one large gap so
+    # there are deltas of every width up to 31 bits.
+    n_rows = 400
+    cols = []
+    for i in range(n_rows):
+        deltas = np.random.randint(1, 4, i % 300 + 1)
+        deltas[deltas.size//2] = 2**(i % 31)
+        cols.append(np.cumsum(deltas))
+    row = np.repeat(np.arange(n_rows), [c.size for c in cols])
+    col = np.concatenate(cols)
+    M = sp.sparse.csr_matrix((np.random.rand(row.size), (row, col)),
+                             shape=(n_rows, 2**31 - 1))
+    M.sort_indices()
+
+    csindexer.set_simd(SIMD)
+    try:
+        P = csindexer.PackedIndices(M, N_THREADS)
+        if SIMD:
+            print('\tAVX2 available: %s' % P.simd)
+        else:
+            assert(not P.simd)
+
+        coo = M.tocoo()
+        row, col = coo.row.astype(np.int32), coo.col.astype(np.int32)
+        data = np.zeros(row.size)
+        P.apply(row, col, data, 'get', 'binary', N_THREADS, False)
+        assert(np.all(data == coo.data))
+    finally:
+        csindexer.set_simd(True)
+
+
+@pytest.mark.parametrize("ERROR", [0, 4, 32])
+@pytest.mark.parametrize("OPERATION", ['get', 'add'])
+def test_learned_index(OPERATION, ERROR):
+    print('\nLearned index %s (error %d):' % (OPERATION, ERROR))
+    # Long rows with clustered columns, which interpolation search handles
+    # badly, alongside short rows that have no model.
+    n_rows, n_cols = 200, 200000
+    lengths = np.minimum((10*np.random.pareto(1.0, n_rows)).astype(int) + 1,
+                         20000)
+    row = np.repeat(np.arange(n_rows), lengths)
+    centres = np.random.randint(0, n_cols, row.size)
+    col = np.clip(centres//1000*1000 + np.random.randint(0, 50, row.size)**2,
+                  0, n_cols - 1)
+    M = {}
+    M['CSR'] = sp.sparse.csr_matrix((np.random.rand(row.size), (row, col)),
+                                    shape=(n_rows, n_cols))
+    M['CSC'] = M['CSR'].T.tocsc()
+
+    for key in M:
+        M_cy = M[key].copy()
+        M_cy.sort_indices()
+        with Timer() as t:
+            L = csindexer.LearnedIndex(M_cy, error=ERROR, min_length=16,
+                                       n_threads=N_THREADS)
+        print('\t%s: %d segments in %d bytes (%s)'
+              % (key, L.n_segments, L.nbytes, t.elapsed))
+        if key == 'CSR' and ERROR == 32:
+            # Far smaller than a hash index over the entries.
+            assert(L.nbytes < 4*M_cy.nnz)
+
+        # Index stored entries and some that are not stored.
+        coo = M_cy.tocoo()
+        idx = np.random.choice(coo.nnz, 10000)
+        shape = M_cy.shape
+        r = np.concatenate([coo.row[idx],
+                            np.random.randint(0, shape[0], 10000)])
+        c = np.concatenate([coo.col[idx],
+                            np.random.randint(0, shape[1], 10000)])
+        r, c = r.astype(np.int32), c.astype(np.int32)
+        data = np.random.rand(r.size)
+
+        data_cy = data.copy()
+        M_py = M_cy.copy()
+        csindexer.apply(M_cy, r, c, data_cy, OPERATION, 'learned', N_THREADS,
+                        False, learned_index=L)
+
+        if OPERATION == 'get':
+            true = np.squeeze(np.array(M_py[r, c]))
+            stored = np.squeeze(np.array(M_py.astype(bool)[r, c]))
+            true[~stored] = data[~stored]
+            assert(np.all((data_cy - true)**2 < 1e-6))
+        else:
+            M_py += M_py.astype(bool).multiply(
+                sp.sparse.coo_matrix((data, (r, c)), shape=shape))
+            assert(abs(M_cy - M_py).sum() < 1e-6)
+
+
+@pytest.mark.parametrize("SEARCH_TYPE", ['binary', 'interpolation'])
+@pytest.mark.parametrize("OPERATION", ['get', 'add'])
+def test_lookup_cache(OPERATION, SEARCH_TYPE, large_matrix):
+    print('\nLookup cache %s (%s):' % (OPERATION, SEARCH_TYPE))
+    M = large_matrix['M']
+
+    for key in M:
+        # A Zipf skewed indexer over the stored entries and some misses.
+        coo = M[key].tocoo()
+        idx = (np.random.zipf(1.5, 100000) - 1) % coo.nnz
+        row = np.concatenate([coo.row[idx], np.random.randint(0, 40000, 1000)])
+        col = np.concatenate([coo.col[idx], np.random.randint(0, 40000, 1000)])
+        row, col = row.astype(np.int32), col.astype(np.int32)
+
+        cache = csindexer.LookupCache(4096)
+        assert(cache.capacity == 4096)
+        M_cy = M[key].copy()
+        M_py = M[key].copy()
+        for i in range(3):
+            data = np.random.rand(row.size)
+            data_cy, data_py = data.copy(), data.copy()
+            with Timer() as t:
+                csindexer.apply(M_cy, row, col, data_cy, OPERATION,
+                                SEARCH_TYPE, N_THREADS, False, cache=cache)
+            print('\tCall %d: %s (hit rate %.2f)'
+                  % (i, t.elapsed, cache.hit_rate))
+            csindexer.apply(M_py, row, col, data_py, OPERATION, SEARCH_TYPE,
+                            N_THREADS, False)
+            assert(np.all((M_cy.data - M_py.data)**2 < 1e-6))
+            assert(np.all((data_cy - data_py)**2 < 1e-6))
+        assert(cache.hits + cache.misses == 3*row.size)
+        assert(cache.hit_rate > 0.5)
+
+        # A stale cache is never wrong after the structure changes.
+        M_new = M[key].copy()
+        M_new.data[:] = 1
+        M_new = (M_new + sp.sparse.eye(40000, format=key.lower())).asformat(
+            key.lower())
+        M_new.sort_indices()
+        data_cy, data_py = np.zeros(row.size), np.zeros(row.size)
+        csindexer.apply(M_new, row, col, data_cy, 'get', SEARCH_TYPE,
+                        N_THREADS, False, cache=cache)
+        csindexer.apply(M_new, row, col, data_py, 'get', SEARCH_TYPE,
+                        N_THREADS, False)
+        assert(np.all(data_cy == data_py))
+
+        cache.clear()
+        assert(cache.hits == 0 and cache.misses == 0)
+
+
+@pytest.mark.parametrize("FILTER", [False, True])
+@pytest.mark.parametrize("SEARCH_TYPE", ['binary', 'interpolation', 'learned'])
+def test_contains(SEARCH_TYPE, FILTER, large_matrix):
+    print('\nContains (%s, filter %s):' % (SEARCH_TYPE, FILTER))
+    M = large_matrix['M']
+    indexer = large_matrix['indexer']
+
+    # A matrix with dense clustered rows as well so some rows get bitmaps.
+    dense_rows = sp.sparse.random(50, 40000, density=0.001, format='csr')
+    dense_rows = dense_rows + sp.sparse.csr_matrix(
+        (np.ones(50*500), (np.repeat(np.arange(50), 500),
+                           np.tile(np.arange(1000, 1500), 50))),
+        shape=(50, 40000))
+    M = dict(M, STACKED=sp.sparse.vstack([M['CSR'], dense_rows]).tocsr())
+
+    for key in M:
+        M_cy = M[key].copy()
+        M_cy.sort_indices()
+        row_filter = None
+        if FILTER:
+            row_filter = csindexer.RowFilter(M_cy, n_threads=N_THREADS)
+            print('\t%s: filter of %d bytes' % (key, row_filter.nbytes))
+        learned_index = None
+        if SEARCH_TYPE == 'learned':
+            learned_index = csindexer.LearnedIndex(M_cy, n_threads=N_THREADS)
+
+        # Mostly entries that are not stored, some outside M, and the rest
+        # stored.
+        shape = M_cy.shape
+        n_miss = 9*indexer['row'].size
+        row = np.concatenate([indexer['row'],
+                              np.random.randint(-10, shape[0] + 10, n_miss),
+                              40000 + np.arange(50)])
+        col = np.concatenate([indexer['col'],
+                              np.random.randint(-10, shape[1] + 10, n_miss),
+                              np.full(50, 1200)])
+
+        with Timer() as t:
+            mask, offsets = csindexer.contains(M_cy, row, col, SEARCH_TYPE,
+                                               N_THREADS, return_offsets=True,
+                                               learned_index=learned_index,
+                                               row_filter=row_filter)
+        print('\t%s: %s' % (key, t.elapsed))
+
+        inside = ((row >= 0) & (row < shape[0]) &
+                  (col >= 0) & (col < shape[1]))
+        stored = np.zeros(row.size, dtype=bool)
+        stored[inside] = np.squeeze(np.array(
+            M_cy.astype(bool)[row[inside], col[inside]]))
+        assert(np.all(mask == stored))
+        assert(np.all(offsets[~stored] == -1))
+        pos = data_positions(M_cy, row[stored], col[stored])
+        assert(np.all(offsets[stored] == pos))
+
+
+@pytest.mark.parametrize("N", [1, N_THREADS])
+@pytest.mark.parametrize("SIMD", [False, True])
+@pytest.mark.parametrize("OPERATION", ['add', 'axpy_add', 'axpy_add_weighted'])
+def test_scatter_add(OPERATION, SIMD, N, large_matrix):
+    print('\nScatter %s (simd %s, %d threads):' % (OPERATION, SIMD, N))
+    M = large_matrix['M']
+    csindexer.set_simd(SIMD)
+    if SIMD:
+        print('\tAVX-512 available: %s' % csindexer.simd_enabled())
+    else:
+        assert(not csindexer.simd_enabled())
+
+    try:
+        for key in M:
+            # Many copies of a few entries so vectors have conflicts, as well
+            # as entries that are not stored.
+            coo = M[key].tocoo()
+            idx = np.random.choice(coo.nnz, 20)[np.random.randint(0, 20,
+                                                                  100000)]
+            row = np.concatenate([coo.row[idx],
+                                  np.random.randint(0, 40000, 1000)])
+            col = np.concatenate([coo.col[idx],
+                                  np.random.randint(0, 40000, 1000)])
+            row, col = row.astype(np.int32), col.astype(np.int32)
+            data = np.random.rand(row.size)
+            weights = np.random.rand(row.size)
+
+            operation = OPERATION.replace('_weighted', '')
+            w = weights if OPERATION.endswith('_weighted') else 0.5
+
+            M_cy = M[key].copy()
+            csindexer.apply(M_cy, row, col, data.copy(), operation, 'binary',
+                            N, False, alpha=0.5,
+                            weights=weights if OPERATION.endswith('_weighted')
+                            else None)
+
+            stored = np.squeeze(np.array(M[key].astype(bool)[row, col]))
+            pos = data_positions(M[key], row[stored], col[stored])
+            M_py = M[key].data.copy()
+            if operation == 'add':
+                np.add.at(M_py, pos, data[stored])
+            else:
+                np.add.at(M_py, pos, (w*data)[stored])
+            assert(np.all((M_cy.data - M_py)**2 < 1e-6))
+    finally:
+        csindexer.set_simd(True)
+
+
+@pytest.mark.parametrize("PAGE_SHIFT", [4, 12])
+def test_snapshot_matrix(PAGE_SHIFT, large_matrix):
+    print('\nSnapshot matrix (page shift %d):' % PAGE_SHIFT)
+    M = large_matrix['M']['CSR'].copy()
+    M.data[:] = 0
+    coo = M.tocoo()
+    row, col = coo.row.astype(np.int32), coo.col.astype(np.int32)
+    S = csindexer.SnapshotMatrix(M, PAGE_SHIFT)
+    n_writes = 20
+    errors = []
+
+    # Every write adds 1 to every stored entry, so a consistent read has
+    # the same value everywhere and never goes backwards.
+    def write():
+        for i in range(n_writes):
+            S.apply(row, col, np.ones(row.size), 'add', 'binary', 2, False)
+
+    def read():
+        last = 0
+        while S.epoch <= n_writes:
+            data = np.full(row.size, -1.0)
+            S.apply(row, col, data, 'get', 'binary', 2, False)
+            if not (np.all(data == data[0]) and data[0] >= last):
+                errors.append((data.min(), data.max(), last))
+                return
+            last = data[0]
+
+    threads = ([threading.Thread(target=write)] +
+               [threading.Thread(target=read) for i in range(3)])
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    assert(errors == [])
+
+    M_py = S.to_scipy()
+    assert(np.all(M_py.data == n_writes))
+    assert(S.epoch == n_writes + 1)
+
+    # Other operations and entries that are not stored, against scipy.
+    data = np.random.rand(row.size)
+    S.apply(row, col, data.copy(), 'set', 'binary', N_THREADS, False)
+    S.apply(np.zeros(10, dtype=np.int32), np.arange(10, dtype=np.int32),
+            np.ones(10), 'add', 'interpolation', N_THREADS, False)
+    M_py.data[data_positions(M, row, col)] = data
+    stored = np.array(large_matrix['M']['CSR'][0, :10].todense()).ravel() != 0
+    if stored.any():
+        M_py.data[data_positions(M, np.zeros(stored.sum(), dtype=np.int32),
+                                 np.arange(10)[stored])] += 1
+    assert(np.all(S.to_scipy().data == M_py.data))
+    assert(S.n_retired == 0)
+
+
+@pytest.mark.parametrize("HUGE_PAGES", [False, True])
+@pytest.mark.parametrize("SEARCH_TYPE", ['binary', 'sorted'])
+def test_scratch_arena(SEARCH_TYPE, HUGE_PAGES, large_matrix):
+    print('\nScratch arena (%s, huge pages %s):' % (SEARCH_TYPE, HUGE_PAGES))
+    M = large_matrix['M']['CSR']
+    indexer = large_matrix['indexer']
+    row, col = indexer['row'], indexer['col']
+    if SEARCH_TYPE == 'sorted':
+        sort_idx = np.lexsort((col, row))
+        row, col = row[sort_idx], col[sort_idx]
+
+    arena = csindexer.ScratchArena(HUGE_PAGES)
+    M_cy = M.copy()
+    M_py = M.copy()
+    for i in range(3):
+        # Later calls are smaller so never need to grow the buffers.
+        n = row.size >> i
+        data = np.random.rand(n)
+        csindexer.apply(M_cy, row[:n], col[:n], data, 'add', SEARCH_TYPE,
+                        N_THREADS, False, arena=arena)
+        csindexer.apply(M_py, row[:n], col[:n], data, 'add', SEARCH_TYPE,
+                        N_THREADS, False)
+        if i == 0:
+            n_grows = arena.n_grows
+            reserved = arena.reserved_bytes
+        assert(np.all((M_cy.data - M_py.data)**2 < 1e-6))
+    print('\tPeak %d bytes, reserved %d (%d huge)'
+          % (arena.peak_bytes, arena.reserved_bytes, arena.huge_page_bytes))
+
+    assert(arena.n_grows == n_grows)
+    assert(arena.reserved_bytes == reserved)
+    assert(0 < arena.peak_bytes <= arena.reserved_bytes)
+    if not HUGE_PAGES:
+        assert(arena.huge_page_bytes == 0)
+
+    arena.release()
+    assert(arena.reserved_bytes == 0 and arena.huge_page_bytes == 0)
+
+
+@pytest.mark.parametrize("OPERATION", ['set', 'add', 'multiply', 'max',
+                                       'axpy_add'])
+def test_pipeline(OPERATION, large_matrix):
+    print('\nPipeline (%s):' % OPERATION)
+    M = large_matrix['M']
+    indexer = large_matrix['indexer']
+
+    for key in M:
+        # Small batches that all overlap, alternating with gets so the order
+        # the batches are applied in matters.
+        M_cy = M[key].copy()
+        M_py = M[key].copy()
+        batches = []
+        for k in range(20):
+            idx = np.random.choice(indexer['row'].size, 1000)
+            operation = OPERATION if k % 2 == 0 else 'get'
+            batches.append((indexer['row'][idx], indexer['col'][idx],
+                            np.random.rand(idx.size), operation))
+
+        with Timer() as t:
+            with csindexer.Pipeline(n_threads=N_THREADS,
+                                    max_pending=2) as pipeline:
+                futures = [pipeline.submit(M_cy, row, col, data.copy(),
+                                           operation, alpha=0.5)
+                           for row, col, data, operation in batches]
+                results = [future.result() for future in futures]
+        print('\t%s pipeline time: %s' % (key, t.elapsed))
+
+        # Repeated entries are applied in order, as for the sorted search.
+        for (row, col, data, operation), result in zip(batches, results):
+            if key == 'CSR':
+                sort_idx = np.lexsort((col, row))
+            else:
+                sort_idx = np.lexsort((row, col))
+            data = data[sort_idx]
+            csindexer.apply(M_py, row[sort_idx], col[sort_idx], data,
+                            operation, 'sorted', N_THREADS, False, alpha=0.5)
+            if operation == 'get':
+                assert(np.all((result[sort_idx] - data)**2 < 1e-6))
+        assert(np.all((M_cy.data - M_py.data)**2 < 1e-6))
+
+    # Entries that are not stored (or lie outside M) are skipped.
+    M_cy = M['CSR'].copy()
+    row = np.array([-1, 0, M_cy.shape[0]], dtype=np.int32)
+    col = np.array([0, M_cy.shape[1], 0], dtype=np.int32)
+    csindexer.submit(M_cy, row, col, np.ones(3), OPERATION).result()
+    assert(np.all(M_cy.data == M['CSR'].data))
+
+    # Errors are raised by the future and do not stop later batches.
+    with csindexer.Pipeline() as pipeline:
+        future = pipeline.submit(M_cy, row, col, np.ones(3), 'divide')
+        with pytest.raises(Exception):
+            future.result()
+        future = pipeline.submit(M_cy, row, col, np.ones(3), 'axpy_add',
+                                 weights=np.ones(2))
+        with pytest.raises(Exception):
+            future.result()
+        assert(pipeline.submit(M_cy, row, col, np.ones(3),
+                               'get').result().size == 3)
+
+    # And batches can be awaited from asyncio.
+    async def run(pipeline):
+        data = np.zeros(indexer['row'].size)
+        return await pipeline.submit_async(M_cy, indexer['row'],
+                                           indexer['col'], data, 'get')
+    with csindexer.Pipeline() as pipeline:
+        result = asyncio.run(run(pipeline))
+    expected = np.zeros(result.size)
+    csindexer.apply(M_cy, indexer['row'], indexer['col'], expected, 'get',
+                    'binary', N_THREADS, False)
+    assert(np.all(result == expected))
+
+
+@pytest.mark.parametrize("SEARCH_TYPE", ['binary', 'interpolation', 'sorted'])
+@pytest.mark.parametrize("OPERATION", ['get', 'add', 'set'])
+def test_apply_batched(SEARCH_TYPE, OPERATION):
+    print('\nApply batched (%s, %s):' % (SEARCH_TYPE, OPERATION))
+    n_matrices = 2000
+    matrices = []
+    for m in range(n_matrices):
+        # Mostly tiny matrices with a few much larger ones.
+        size = 1000 if m % 500 == 0 else np.random.randint(1, 30)
+        A = sp.sparse.random(size, size + 3, density=0.2, format='csr')
+        matrices.append(A if m % 2 == 0 else A.tocsc())
+
+    # A handful of stored entries of every matrix, plus some that are not
+    # stored or lie outside the matrices.
+    ids, rows, cols = [], [], []
+    for m, A in enumerate(matrices):
+        coo = A.tocoo()
+        if coo.nnz > 0:
+            idx = np.random.choice(coo.nnz, 5)
+            ids.append(np.full(idx.size, m))
+            rows.append(coo.row[idx])
+            cols.append(coo.col[idx])
+    ids.append(np.array([0, 1, -1, n_matrices]))
+    rows.append(np.array([0, matrices[1].shape[0], 0, 0]))
+    cols.append(np.array([matrices[0].shape[1], 0, 0, 0]))
+    ids = np.concatenate(ids).astype(np.int32)
+    rows = np.concatenate(rows).astype(np.int32)
+    cols = np.concatenate(cols).astype(np.int32)
+    data = np.random.rand(ids.size)
+
+    if SEARCH_TYPE == 'sorted':
+        # By matrix and then within each matrix as for apply.
+        csr = np.array([A.getformat() == 'csr' for A in matrices])
+        in_range = (ids >= 0) & (ids < n_matrices)
+        is_csr = np.where(in_range, csr[np.clip(ids, 0, n_matrices - 1)],
+                          True)
+        axis0 = np.where(is_csr, rows, cols)
+        axis1 = np.where(is_csr, cols, rows)
+        sort_idx = np.lexsort((axis1, axis0, ids))
+        ids, rows, cols = ids[sort_idx], rows[sort_idx], cols[sort_idx]
+        data = data[sort_idx]
+
+    expected = [A.copy() for A in matrices]
+    expected_data = data.copy()
+    with Timer() as t:
+        for m, A in enumerate(expected):
+            select = np.flatnonzero(ids == m)
+            if select.size > 0:
+                values = expected_data[select]
+                csindexer.apply(A, rows[select], cols[select], values,
+                                OPERATION, SEARCH_TYPE, N_THREADS, False)
+                expected_data[select] = values
+    print('\tPer matrix apply time: %s' % t.elapsed)
+
+    # As a list of matrices.
+    actual = [A.copy() for A in matrices]
+    actual_data = data.copy()
+    batch = csindexer.MatrixBatch(actual)
+    assert(len(batch) == n_matrices)
+    with Timer() as t:
+        csindexer.apply_batched(batch, ids, rows, cols, actual_data,
+                                OPERATION, SEARCH_TYPE, N_THREADS, False)
+    print('\tBatched apply time: %s' % t.elapsed)
+    assert(np.all((actual_data - expected_data)**2 < 1e-6))
+    for A, B in zip(actual, expected):
+        assert(np.all((A.data - B.data)**2 < 1e-6))
+
+    # And as concatenated arrays, with every matrix in the same format.
+    actual = [A.tocsr() for A in matrices]
+    expected = [A.copy() for A in actual]
+    csindexer.apply_batched(expected, ids, rows, cols, data.copy(),
+                            OPERATION, 'binary', N_THREADS, False)
+    indptr = np.concatenate([A.indptr for A in actual])
+    indices = np.concatenate([A.indices for A in actual])
+    concatenated = np.concatenate([A.data for A in actual])
+    indptr_offsets = np.cumsum([0] + [A.indptr.size for A in actual])
+    data_offsets = np.cumsum([0] + [A.nnz for A in actual])
+    batch = csindexer.MatrixBatch.from_arrays(indptr, indices, concatenated,
+                                              indptr_offsets, data_offsets)
+    csindexer.apply_batched(batch, ids, rows, cols, data.copy(), OPERATION,
+                            'binary', N_THREADS, False)
+    assert(np.all((concatenated -
+                   np.concatenate([A.data for A in expected]))**2 < 1e-6))
+
+    with pytest.raises(Exception):
+        csindexer.MatrixBatch.from_arrays(indptr, indices, concatenated,
+                                          indptr_offsets, data_offsets[:-1])
+
+
+@pytest.mark.parametrize("TRIANGLE", ['upper', 'lower'])
+@pytest.mark.parametrize("SEARCH_TYPE", ['binary', 'joint', 'sorted'])
+def test_symmetric(SEARCH_TYPE, TRIANGLE):
+    print('\nSymmetric (%s, %s):' % (SEARCH_TYPE, TRIANGLE))
+    S = sp.sparse.random(3000, 3000, density=0.002, format='csr')
+    A = (S + S.T).tocsr()
+    triangle = sp.sparse.triu if TRIANGLE == 'upper' else sp.sparse.tril
+
+    # Stored entries of A from both triangles, with repeats.
+    coo = A.tocoo()
+    idx = np.random.choice(coo.nnz, 20000)
+    row, col = coo.row[idx], coo.col[idx]
+
+    arena = csindexer.ScratchArena()
+    for key in ['CSR', 'CSC']:
+        fmt = key.lower()
+        T = triangle(A, format=fmt)
+        print('\t%s stores %d of %d entries' % (key, T.nnz, A.nnz))
+        if SEARCH_TYPE == 'sorted':
+            sort_idx = (np.lexsort((col, row)) if key == 'CSR' else
+                        np.lexsort((row, col)))
+        else:
+            sort_idx = np.arange(row.size)
+        r, c = row[sort_idx], col[sort_idx]
+
+        # Gets see the full matrix.
+        data = np.zeros(r.size)
+        csindexer.apply(T, r, c, data, 'get', SEARCH_TYPE, N_THREADS, False,
+                        symmetric=TRIANGLE)
+        assert(np.all(data == np.asarray(A[r, c]).ravel()))
+
+        # And adds from both triangles land in the single stored entry.
+        data = np.random.rand(r.size)
+        T_cy = T.copy()
+        csindexer.apply(T_cy, r, c, data, 'add', SEARCH_TYPE, N_THREADS,
+                        False, arena=arena, symmetric=TRIANGLE)
+        lo, hi = np.minimum(r, c), np.maximum(r, c)
+        if TRIANGLE == 'upper':
+            added = sp.sparse.coo_matrix((data, (lo, hi)), shape=A.shape)
+        else:
+            added = sp.sparse.coo_matrix((data, (hi, lo)), shape=A.shape)
+        T_py = (T + added).asformat(fmt)
+        T_py.sort_indices()
+        assert(np.all(T_cy.indices == T_py.indices))
+        assert(np.all((T_cy.data - T_py.data)**2 < 1e-6))
+
+        # Indices outside M are not stored in either triangle and must not
+        # be mapped to a row (or column) outside M.
+        inside = np.array([3, 5, 2999], dtype=np.int32)
+        outside = np.array([50000000, -1, 3000], dtype=np.int32)
+        r, c = (inside, outside) if key == 'CSR' else (outside, inside)
+        data = np.full(3, 7.0)
+        csindexer.apply(T, r, c, data, 'get', SEARCH_TYPE, N_THREADS, False,
+                        symmetric=TRIANGLE)
+        assert(np.all(data == 7.0))
+
+        mask = csindexer.contains(T, col, row, symmetric=TRIANGLE)
+        assert(np.all(mask))
+        mask = csindexer.contains(T, [-1, 0, 3000], [0, 3000, 0],
+                                  symmetric=TRIANGLE)
+        assert(not np.any(mask))
+
+    with pytest.raises(Exception):
+        csindexer.apply(S[:, :10], row[:1], col[:1], np.zeros(1), 'get',
+                        'binary', N_THREADS, False, symmetric='upper')
+
+
+@pytest.mark.parametrize("STRUCTURE", ['learned', 'filter', 'packed'])
+def test_sidecar(STRUCTURE, tmp_path):
+    print('\nSidecar (%s):' % STRUCTURE)
+    build = {'learned': lambda M, **kwargs: csindexer.LearnedIndex(
+                 M, min_length=8, **kwargs),
+             'filter': csindexer.RowFilter,
+             'packed': csindexer.PackedIndices}[STRUCTURE]
+
+    def lookups(M, structure):
+        # The offsets found for stored and missing entries with structure.
+        coo = M.tocoo()
+        row = np.concatenate([coo.row, np.arange(1000) % M.shape[0]])
+        col = np.concatenate([coo.col, np.arange(1000)*7 % M.shape[1]])
+        if STRUCTURE == 'packed':
+            data = np.full(row.size, -1.0)
+            structure.apply(row.astype(np.int32), col.astype(np.int32), data,
+                            'get', 'binary', N_THREADS, False)
+            return data
+        if STRUCTURE == 'learned':
+            return csindexer.contains(M, row, col, 'learned', N_THREADS, True,
+                                      learned_index=structure)[1]
+        return csindexer.contains(M, row, col, 'binary', N_THREADS, True,
+                                  row_filter=structure)[1]
+
+    for fmt in ['csr', 'csc']:
+        M = sp.sparse.random(2000, 1500, density=0.01, format=fmt)
+        M.data = np.arange(M.nnz, dtype=np.float64)
+        path = str(tmp_path / ('M.%s.%s' % (fmt, STRUCTURE)))
+
+        # The first process builds and saves, the next just maps the file.
+        with Timer() as t:
+            built = build(M, sidecar=path)
+        print('\t%s build time: %s' % (fmt, t.elapsed))
+        with Timer() as t:
+            mapped = build(M, sidecar=path)
+        print('\t%s map time: %s' % (fmt, t.elapsed))
+        assert(not built.mapped and mapped.mapped)
+        assert(build(M, sidecar=path, verify=True).mapped)
+        assert(np.all(lookups(M, mapped) == lookups(M, built)))
+        assert(mapped.nbytes == built.nbytes)
+
+        # Another matrix of the same shape and size is rebuilt over it.
+        other = M.copy()
+        other.indices = (other.indices + 1) % other.shape[fmt == 'csr']
+        other.sort_indices()
+        assert(not build(other, sidecar=path).mapped)
+        assert(build(other, sidecar=path).mapped)
+        assert(not build(M, sidecar=path).mapped)
+
+        # As are different settings.
+        if STRUCTURE == 'learned':
+            assert(not csindexer.LearnedIndex(M, error=16, min_length=8,
+                                              sidecar=path).mapped)
+        elif STRUCTURE == 'filter':
+            assert(not csindexer.RowFilter(M, bits_per_entry=6,
+                                           sidecar=path).mapped)
+
+        # A corrupt file is caught by verify, a truncated one always.
+        built.save(path, M)
+        with open(path, 'r+b') as f:
+            # Just after the header, inside the first section.
+            f.seek(512)
+            byte = f.read(1)
+            f.seek(512)
+            f.write(bytes([byte[0] ^ 0xff]))
+        assert(not build(M, sidecar=path, verify=True).mapped)
+
+        # As is one whose row pointers run past its sections, even without
+        # verify.
+        with open(path, 'r+b') as f:
+            f.seek(512)
+            f.write(b'\x7f\x7f\x7f\x7f')
+        assert(not build(M, sidecar=path).mapped)
+        with open(path, 'r+b') as f:
+            f.truncate(100)
+        assert(not build(M, sidecar=path).mapped)
+        assert(build(M, sidecar=path).mapped)
+
+    # Only an explicit save raises if the sidecar cannot be written.
+    with pytest.raises(Exception):
+        built.save(str(tmp_path / 'missing' / 'M'), M)
+    with pytest.warns(UserWarning):
+        unsaved = build(M, sidecar=str(tmp_path / 'missing' / 'M'))
+    assert(np.all(lookups(M, unsaved) == lookups(M, built)))
+
+    # No temporary files are left behind.
+    assert(sorted(p.name for p in tmp_path.iterdir())
+           == ['M.csc.%s' % STRUCTURE, 'M.csr.%s' % STRUCTURE])
+
+    # Saving the same matrix twice gives the same file, empty rows included.
+    M = sp.sparse.random(2000, 1500, density=0.0005, format='csr')
+    M.sort_indices()
+    first, second = str(tmp_path / 'first'), str(tmp_path / 'second')
+    build(M).save(first, M)
+    build(M).save(second, M)
+    with open(first, 'rb') as f, open(second, 'rb') as g:
+        assert(f.read() == g.read())
@@ -7,6 +7,8 @@ import matplotlib.pyplot as plt
 import os
 import argparse
 import itertools
+import csv
+import json
 from contexttimer import Timer
 
 from csindexer import indexer as csindexer
@@ -20,6 +22,7 @@ parser = argparse.ArgumentParser(description="Endpoint for running tests on"
                                              " the compressed sparse indexer.")
 parser.add_argument('dependent',
                     type=str,
+                    nargs='?',
                     default='rows',
                     help="The varaible to use on the x-axis when plotting"
                          " against time.")
@@ -77,6 +80,59 @@ parser.add_argument('--operation',
                     nargs='+',
                     default=['get'],
                     help="Whether to use a get or add operation.")
+parser.add_argument('--row-distribution',
+                    type=str,
+                    nargs='+',
+                    default=['uniform'],
+                    help="How the non-zeros are spread over the rows, either"
+                         " uniform or powerlaw (row lengths follow a Pareto"
+                         " distribution with shape --row-alpha).")
+parser.add_argument('--row-alpha',
+                    type=float,
+                    default=1.2,
+                    help="Shape of the powerlaw row lengths (smaller is more"
+                         " skewed).")
+parser.add_argument('--col-distribution',
+                    type=str,
+                    nargs='+',
+                    default=['uniform'],
+                    help="How the columns of each row are chosen, either"
+                         " uniform or clustered (around a few random centres"
+                         " per row).")
+parser.add_argument('--query-distribution',
+                    type=str,
+                    nargs='+',
+                    default=['uniform'],
+                    help="How the indexer picks non-zeros, either uniform or"
+                         " zipf (with exponent --zipf-s, so a few entries"
+                         " make up most of the indexer).")
+parser.add_argument('--zipf-s',
+                    type=float,
+                    default=1.2,
+                    help="Exponent of the zipf query distribution.")
+parser.add_argument('--miss-rate',
+                    type=float,
+                    nargs='+',
+                    default=[0.0],
+                    help="Fraction of the indexer that are random coordinates"
+                         " (almost always not stored in the matrix).")
+parser.add_argument('--scaling',
+                    type=str,
+                    default=None,
+                    help="Instead of plotting, run a strong (fixed"
+                         " --n-indexers) or weak (--n-indexers per thread)"
+                         " scaling sweep over --n-threads for every other"
+                         " configuration and report the parallel"
+                         " efficiency, ns/lookup and GB/s.")
+parser.add_argument('--repeats',
+                    type=int,
+                    default=1,
+                    help="Times to repeat each timing, keeping the fastest.")
+parser.add_argument('--report',
+                    type=str,
+                    default=None,
+                    help="File to write the scaling report to, as CSV or"
+                         " JSON depending on the extension.")
 parser.add_argument('--save',
                     action='store_true',
                     help="Whether to save the plot to ./figures.")
@@ -97,32 +153,100 @@ np.random.seed(FLAGS.random_seed)
 config = FLAGS.__dict__.copy()
 
 
+def generate_matrix(rows, cols, nnz, row_distribution='uniform',
+                    col_distribution='uniform', row_alpha=1.2):
+    """Generate a COO matrix of roughly nnz non-zeros (duplicates are
+    summed). Uniform rows and columns are the same as sp.sparse.rand, while
+    powerlaw rows have Pareto distributed lengths and clustered columns are
+    drawn around a few random centres in each row."""
+    if row_distribution == 'uniform' and col_distribution == 'uniform':
+        return sp.sparse.rand(rows, cols, density=nnz/(rows*cols))
+
+    if row_distribution == 'uniform':
+        row = np.random.randint(0, rows, nnz)
+    elif row_distribution == 'powerlaw':
+        weights = np.random.pareto(row_alpha, rows) + 1
+        row = np.random.choice(rows, nnz, p=weights/weights.sum())
+    else:
+        raise Exception("row_distribution must be uniform or powerlaw.")
+
+    if col_distribution == 'uniform':
+        col = np.random.randint(0, cols, nnz)
+    elif col_distribution == 'clustered':
+        ## Each row has 4 centres, picked from the row number so they are
+        ## shared by all of its entries.
+        centres = np.random.randint(0, cols, (rows, 4))
+        width = max(cols//1000, 1)
+        col = (centres[row, np.random.randint(0, 4, nnz)]
+               + np.random.normal(0, width, nnz).astype(np.int64)) % cols
+    else:
+        raise Exception("col_distribution must be uniform or clustered.")
+
+    M = sp.sparse.coo_matrix((np.random.rand(nnz), (row, col)),
+                             shape=(rows, cols))
+    M.sum_duplicates()
+    return M
+
+
+def generate_indexer(M, n_indexers, query_distribution='uniform',
+                     miss_rate=0.0, zipf_s=1.2):
+    """Generate an indexer into the COO matrix M. A fraction miss_rate of it
+    are random coordinates and the rest are non-zeros of M, picked uniformly
+    or with a zipf distribution over a random order of the non-zeros."""
+    n_miss = int(round(miss_rate*n_indexers))
+    n_hit = n_indexers - n_miss
+
+    if query_distribution == 'uniform':
+        idx = np.random.choice(M.nnz, n_hit, replace=True)
+    elif query_distribution == 'zipf':
+        order = np.random.permutation(M.nnz)
+        idx = order[(np.random.zipf(zipf_s, n_hit) - 1) % M.nnz]
+    else:
+        raise Exception("query_distribution must be uniform or zipf.")
+
+    indexer = {}
+    indexer['row'] = np.concatenate(
+        [M.row[idx], np.random.randint(0, M.shape[0], n_miss)])
+    indexer['col'] = np.concatenate(
+        [M.col[idx], np.random.randint(0, M.shape[1], n_miss)])
+
+    ## Interleave the misses with the hits.
+    shuffle = np.random.permutation(n_indexers)
+    indexer['row'] = indexer['row'][shuffle].astype(np.int32)
+    indexer['col'] = indexer['col'][shuffle].astype(np.int32)
+    indexer['data'] = np.random.rand(n_indexers).astype(np.float64)
+    return indexer
+
+
 def index_time(sort, n_threads, sparse_format, rows, cols, nnz, n_indexers,
-               search_type, operation, debug):
+               search_type, operation, debug, row_distribution='uniform',
+               col_distribution='uniform', query_distribution='uniform',
+               miss_rate=0.0, repeats=1):
     """A function for timing our cxindexer and scipy indexer. It first creates
     sparse matrices, sorts if necessary, runs indexers on both and returns
-    the times."""
+    the times (the fastest of repeats for the indexing)."""
     if debug:
         print("Benchmarking:\n\tSORT = %s\n\tN_THREADS = %s\n\tSPARSE_FORMAT ="
               " %s\n\tROWS = %s\n\tCOLS = %s\n\tNNZ = %s\n\tN_INDEXERS ="
-              " %s\n\t" "SEARCH_TYPE = %s\n\tOPERATION = %s"
+              " %s\n\t" "SEARCH_TYPE = %s\n\tOPERATION = %s\n\t"
+              "ROW_DISTRIBUTION = %s\n\tCOL_DISTRIBUTION = %s\n\t"
+              "QUERY_DISTRIBUTION = %s\n\tMISS_RATE = %s"
               % (sort, n_threads, sparse_format, rows, cols, nnz, n_indexers,
-                 search_type, operation))
+                 search_type, operation, row_distribution, col_distribution,
+                 query_distribution, miss_rate))
 
     # Generate matrix.
     with Timer() as t:
-        M = sp.sparse.rand(rows, cols, density=nnz/(rows*cols))
+        M = generate_matrix(rows, cols, nnz, row_distribution,
+                            col_distribution, config['row_alpha'])
 
     if debug:
         print("\tTime to generate sparse matrix: %s" % t.elapsed)
 
     # Generate indexer.
     with Timer() as t:
-        indexer = {}
-        idx = np.random.choice(M.nnz, n_indexers, replace=True)
-        indexer['row'] = M.row[idx]
-        indexer['col'] = M.col[idx]
-        indexer['data'] = np.random.rand(idx.size).astype(np.float64)
+        indexer = generate_indexer(M, n_indexers, query_distribution,
+                                   miss_rate, config['zipf_s'])
 
     if debug:
         print("\tTime to generate indexer: %s" % t.elapsed)
@@ -139,6 +263,12 @@ def index_time(sort, n_threads, sparse_format, rows, cols, nnz, n_indexers,
     if debug:
         print("\tTime to convert sparse matrix: %s" % t.elapsed)
 
+    # Models are built once per matrix so are not part of the timing.
+    learned_index = None
+    if search_type == 'learned':
+        M.sort_indices()
+        learned_index = csindexer.LearnedIndex(M, n_threads=n_threads)
+
     # Sort.
     with Timer() as t:
         if sort:
@@ -157,6 +287,18 @@ def index_time(sort, n_threads, sparse_format, rows, cols, nnz, n_indexers,
         print("\tTime to sort indexer: %s" % t.elapsed)
     sort_time = t.elapsed
 
+    computation_time = np.inf
+    for _ in range(repeats):
+        computation_time = min(computation_time, run_indexer(
+            M, indexer, sort_idx, unsort_idx, rows, cols, search_type,
+            operation, n_threads, debug, learned_index))
+
+    return computation_time, sort_time
+
+
+def run_indexer(M, indexer, sort_idx, unsort_idx, rows, cols, search_type,
+                operation, n_threads, debug, learned_index=None):
+    """Time a single run of the indexer."""
     # Time the csindexer.
     with Timer() as t:
         if search_type == 'scipy':
@@ -188,7 +330,8 @@ def index_time(sort, n_threads, sparse_format, rows, cols, nnz, n_indexers,
 
                 csindexer.apply(M_cs, np.array(indexer['row'][sort_idx]),
                                 np.array(indexer['col'][sort_idx]), data_cs,
-                                operation, search_type, n_threads, debug)
+                                operation, search_type, n_threads, debug,
+                                learned_index=learned_index)
 
                 ### Unsort to get final result.
                 data_cs = data_cs[unsort_idx]
@@ -201,16 +344,84 @@ def index_time(sort, n_threads, sparse_format, rows, cols, nnz, n_indexers,
                                 np.array(indexer['col'][sort_idx]),
                                 np.array(data_cs[sort_idx]), operation,
                                 search_type,
-                                n_threads, debug)
+                                n_threads, debug,
+                                learned_index=learned_index)
             else:
                 raise Exception("Operation must be either get or add.")
 
 
     if debug:
         print("\tTime for indexing: %s" % t.elapsed)
-    computation_time = t.elapsed
 
-    return computation_time, sort_time
+    return t.elapsed
+
+
+def scaling_report(config, variables):
+    """Run a strong or weak scaling sweep over config['n_threads'] for every
+    combination of the other variables. For strong scaling n_indexers is
+    fixed and for weak scaling it is per thread. The parallel efficiency is
+    relative to the smallest thread count p0,
+        strong: (T(p0)*p0)/(T(p)*p)
+        weak: T(p0)/T(p)
+    The bandwidth counts the bytes every lookup has to move: its row, column
+    and value in the indexer and the value in the matrix."""
+    scaling = config['scaling']
+    if scaling not in ['strong', 'weak']:
+        raise Exception("scaling must be either strong or weak.")
+
+    variables = [i for i in variables if i != 'n_threads']
+    thread_counts = sorted(config['n_threads'])
+    models = [dict(zip(variables, i)) for i in
+              itertools.product(*[config[i] for i in variables])]
+
+    results = []
+    for model in models:
+        m = model.copy()
+        if 'n' in m:
+            m['rows'] = m['n']
+            m['cols'] = m['n']
+
+        ## Use the same matrix and indexer for every thread count.
+        seed = np.random.randint(0, 2**32 - 1)
+        base_time = None
+        for p in thread_counts:
+            n_indexers = m['n_indexers']*(p if scaling == 'weak' else 1)
+            np.random.seed(seed)
+            time, _ = index_time(m['sort'], p, m['sparse_format'],
+                                 m['rows'], m['cols'], m['nnz'], n_indexers,
+                                 m['search_type'], m['operation'],
+                                 config['debug'], m['row_distribution'],
+                                 m['col_distribution'],
+                                 m['query_distribution'], m['miss_rate'],
+                                 config['repeats'])
+            if base_time is None:
+                base_time = time
+            if scaling == 'strong':
+                efficiency = (base_time*thread_counts[0])/(time*p)
+            else:
+                efficiency = base_time/time
+
+            result = dict(model, n_threads=p, n_indexers=n_indexers,
+                          scaling=scaling, time=time,
+                          efficiency=efficiency,
+                          ns_per_lookup=1e9*time/n_indexers,
+                          gb_per_s=n_indexers*(4 + 4 + 8 + 8)/time/1e9)
+            results.append(result)
+            print("%s: %.3fs, efficiency %.2f, %.1f ns/lookup, %.2f GB/s"
+                  % (dict(model, n_threads=p), time, efficiency,
+                     result['ns_per_lookup'], result['gb_per_s']))
+
+    if config['report'] is not None:
+        if config['report'].endswith('.json'):
+            with open(config['report'], 'w') as f:
+                json.dump(results, f, indent=2)
+        else:
+            with open(config['report'], 'w', newline='') as f:
+                writer = csv.DictWriter(f, fieldnames=list(results[0]))
+                writer.writeheader()
+                writer.writerows(results)
+
+    return results
 
 
 if __name__ == "__main__":
@@ -226,6 +437,12 @@ if __name__ == "__main__":
     else:
         variables = ['sort', 'n_threads', 'sparse_format', 'rows', 'cols',
                      'nnz', 'n_indexers', 'search_type', 'operation']
+    variables += ['row_distribution', 'col_distribution',
+                  'query_distribution', 'miss_rate']
+
+    if config['scaling'] is not None:
+        scaling_report(config, variables)
+        raise SystemExit
 
     dependent = config['dependent']
     variables.remove(dependent)
@@ -250,7 +467,11 @@ if __name__ == "__main__":
                                         m['sparse_format'], m['rows'],
                                         m['cols'], m['nnz'], m['n_indexers'],
                                         m['search_type'], m['operation'],
-                                        config['debug'])
+                                        config['debug'],
+                                        m['row_distribution'],
+                                        m['col_distribution'],
+                                        m['query_distribution'],
+                                        m['miss_rate'], config['repeats'])
 
     # Finally plot each model.
     ## Get the maximum time seen.
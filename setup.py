@@ -11,7 +11,20 @@ ext_modules += [
         Extension("csindexer.indexer",
             sources=["./csindexer/indexer.pyx",
                      "./csindexer/indexer_c.c",
-                     "./csindexer/interpolation_search.c"],
+                     "./csindexer/interpolation_search.c",
+                     "./csindexer/range_query.c",
+                     "./csindexer/block_indexer.c",
+                     "./csindexer/mutable.c",
+                     "./csindexer/packed_indices.c",
+                     "./csindexer/learned_index.c",
+                     "./csindexer/lookup_cache.c",
+                     "./csindexer/row_filter.c",
+                     "./csindexer/scatter_add.c",
+                     "./csindexer/snapshot.c",
+                     "./csindexer/arena.c",
+                     "./csindexer/pipeline.c",
+                     "./csindexer/symmetric.c",
+                     "./csindexer/sidecar.c"],
             include_dirs=[numpy.get_include()],
             extra_compile_args=["-Ofast", "-lm", "-fopenmp"],
             extra_link_args=["-fopenmp"],